@@ -5,29 +5,43 @@
 #include <netinet/in.h> // sockaddr_in, in_port_t, in_addr
 #include <arpa/inet.h> // inet_aton, inet_ntoa
 #include <fcntl.h> // fcntl
+#include <limits.h> // INT_MAX
 #include <poll.h> // poll, pollfd, nfds_t
-#include <unistd.h> // close
+#include <unistd.h> // close, getopt
 #include <stdio.h> // perror
 #include <stdlib.h> // malloc
 #include <string.h> // memset
 
 #include "round_buffer.h"
+#include "pipe_buffer.h"
 
 // Maximal number of pending connections.
 #define SOCK_BACKLOG 50
 #define MAX_CLIENTS 510
 #define BUFFER_SIZE 1024
 
+// Data of one direction is kept in the user space buffer,
+// or in the kernel pipe in splice mode.
+struct direction {
+    struct round_buffer buf;
+    struct pipe_buffer pipe;
+    // Input is closed, output is shut down when the buffered data is sent.
+    unsigned eof : 1;
+};
+
 struct client {
     int src_fd;
     int dst_fd;
     unsigned src_dst_active : 1;
     unsigned dst_src_active : 1;
-    struct round_buffer src_dst_buf;
-    struct round_buffer dst_src_buf;
+    struct direction src_dst;
+    struct direction dst_src;
     struct sockaddr_in src_address;
 };
 
+// Zero when data is copied through user space buffers.
+size_t pipe_size = 0;
+
 struct sockaddr_in listen_addr;
 struct sockaddr_in dst_address;
 
@@ -74,19 +88,49 @@ void shrink_slots() {
     clients_count = i;
 }
 
+int init_direction(struct direction *dir) {
+    dir->eof = 0;
+    if (pipe_size > 0)
+        return pb_init(&dir->pipe, pipe_size);
+    return rb_init(&dir->buf, BUFFER_SIZE);
+}
+
+void destroy_direction(const struct direction *dir) {
+    if (pipe_size > 0)
+        pb_destroy(&dir->pipe);
+    else
+        rb_destroy(&dir->buf);
+}
+
+int direction_full(const struct direction *dir) {
+    return pipe_size > 0 ? pb_full(&dir->pipe) : rb_full(&dir->buf);
+}
+
+int direction_empty(const struct direction *dir) {
+    return pipe_size > 0 ? pb_empty(&dir->pipe) : rb_empty(&dir->buf);
+}
+
+ssize_t read_direction(int fd, struct direction *dir) {
+    return pipe_size > 0 ? splice_to_pb(fd, &dir->pipe) : read_rb(fd, &dir->buf);
+}
+
+ssize_t write_direction(int fd, struct direction *dir) {
+    return pipe_size > 0 ? splice_from_pb(fd, &dir->pipe) : write_rb(fd, &dir->buf);
+}
+
 struct client *make_client(const struct sockaddr_in *addr, int src_fd, int dst_fd) {
     struct client *client = malloc(sizeof(struct client));
     if (client == NULL) {
         return NULL;
     }
 
-    if (rb_init(&client->dst_src_buf, BUFFER_SIZE) == -1) {
+    if (init_direction(&client->dst_src) == -1) {
         free(client);
         return NULL;
     }
-    if (rb_init(&client->src_dst_buf, BUFFER_SIZE) == -1) {
+    if (init_direction(&client->src_dst) == -1) {
+        destroy_direction(&client->dst_src);
         free(client);
-        rb_destroy(&client->dst_src_buf);
         return NULL;
     }
 
@@ -100,8 +144,8 @@ struct client *make_client(const struct sockaddr_in *addr, int src_fd, int dst_f
 }
 
 void destroy_client(struct client *client) {
-    rb_destroy(&client->src_dst_buf);
-    rb_destroy(&client->dst_src_buf);
+    destroy_direction(&client->src_dst);
+    destroy_direction(&client->dst_src);
     free(client);
 }
 
@@ -256,22 +300,20 @@ void set_pollfd_flags(struct pollfd *fd, short mask) {
 int transfer(
         struct pollfd *in_fd,
         struct pollfd *out_fd,
-        struct round_buffer *buf) {
-    if (in_fd->revents & POLLIN && !rb_full(buf)) {
-        ssize_t res = read_rb(in_fd->fd, buf);
+        struct direction *buf) {
+    if (!buf->eof && in_fd->revents & POLLIN && !direction_full(buf)) {
+        ssize_t res = read_direction(in_fd->fd, buf);
         switch (get_rw_error_cause(res, errno)) {
             case CAUSE_ERROR:
                 perror("read");
                 /* FALLTHROUGH */
             case CAUSE_EOF:
                 clear_pollfd_flags(in_fd, POLLIN);
-                clear_pollfd_flags(out_fd, POLLOUT);
-                try_shutdown(out_fd->fd, SHUT_WR);
-                return -1;
+                buf->eof = 1;
         }
     }
-    if (out_fd->revents & POLLOUT && !rb_empty(buf)) {
-        ssize_t res = write_rb(out_fd->fd, buf);
+    if (out_fd->revents & POLLOUT && !direction_empty(buf)) {
+        ssize_t res = write_direction(out_fd->fd, buf);
         switch (get_rw_error_cause(res, errno)) {
             case CAUSE_ERROR:
                 perror("write");
@@ -284,7 +326,13 @@ int transfer(
         }
     }
 
-    if (rb_empty(buf))
+    if (buf->eof && direction_empty(buf)) {
+        clear_pollfd_flags(out_fd, POLLOUT);
+        try_shutdown(out_fd->fd, SHUT_WR);
+        return -1;
+    }
+
+    if (direction_empty(buf))
         clear_pollfd_flags(out_fd, POLLOUT);
     else
         set_pollfd_flags(out_fd, POLLOUT);
@@ -303,31 +351,50 @@ int parse_port(const char *str, in_port_t *res) {
 }
 
 void print_usage_and_exit(const char *name) {
-    fprintf(stderr, "USAGE %s <listen-port> <target-ip> <target-port>", name);
+    fprintf(stderr, "USAGE %s [-s pipe-size] <listen-port> <target-ip> <target-port>\n"
+                    "  -s  relay data through kernel pipes of given size with splice (zero-copy)\n", name);
     exit(1);
 }
 
 void parse_args(int argc, char *const argv[]) {
+    const char *name = argv[0];
+    int opt;
+    while ((opt = getopt(argc, argv, "+s:")) != -1) {
+        if (opt != 's')
+            print_usage_and_exit(name);
+        char *end;
+        errno = 0;
+        long size = strtol(optarg, &end, 10);
+        // F_SETPIPE_SZ takes an int
+        if (errno != 0 || end == optarg || *end != '\0' || size <= 0 || size > INT_MAX) {
+            fprintf(stderr, "Invalid pipe size, it must be from 1 to %d bytes\n", INT_MAX);
+            print_usage_and_exit(name);
+        }
+        pipe_size = size;
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
     if (argc != 4) {
-        print_usage_and_exit(argv[0]);
+        print_usage_and_exit(name);
     }
 
     in_port_t listen_port;
     if (parse_port(argv[1], &listen_port) == -1) {
         fprintf(stderr, "Invalid listening port value\n");
-        print_usage_and_exit(argv[0]);
+        print_usage_and_exit(name);
     }
 
     struct in_addr target_ip_addr;
     if (!inet_aton(argv[2], &target_ip_addr)) {
         fprintf(stderr, "Invalid target ip address\n");
-        print_usage_and_exit(argv[0]);
+        print_usage_and_exit(name);
     }
 
     in_port_t target_port;
     if (parse_port(argv[3], &target_port) == -1) {
         fprintf(stderr, "Invalid target port value\n");
-        print_usage_and_exit(argv[0]);
+        print_usage_and_exit(name);
     }
 
     struct in_addr listen_ip_addr;
@@ -435,13 +502,13 @@ int main(int argc, char *const argv[]) {
             struct client *client = clients[i];
 
             if (client->src_dst_active) {
-                int res = transfer(src_fd, dst_fd, &client->src_dst_buf);
+                int res = transfer(src_fd, dst_fd, &client->src_dst);
 
                 if (res == -1)
                     client->src_dst_active = 0;
             }
             if (client->dst_src_active) {
-                int res = transfer(dst_fd, src_fd, &client->dst_src_buf);
+                int res = transfer(dst_fd, src_fd, &client->dst_src);
 
                 if (res == -1)
                     client->dst_src_active = 0;
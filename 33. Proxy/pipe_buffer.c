@@ -0,0 +1,72 @@
+#define _GNU_SOURCE // splice, pipe2, F_SETPIPE_SZ
+#include "pipe_buffer.h"
+
+#include <errno.h>
+#include <fcntl.h> // splice, fcntl
+#include <unistd.h> // pipe2, close
+
+int pb_init(struct pipe_buffer *buf, size_t capacity) {
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK) == -1)
+        return -1;
+
+    int size = fcntl(fds[1], F_SETPIPE_SZ, (int) capacity);
+    if (size == -1) {
+        // Size is limited by /proc/sys/fs/pipe-max-size, keep the default one.
+        size = fcntl(fds[1], F_GETPIPE_SZ);
+    }
+    if (size == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    buf->read_fd = fds[0];
+    buf->write_fd = fds[1];
+    buf->length = 0;
+    buf->capacity = size;
+    buf->blocked = 0;
+
+    return 0;
+}
+
+void pb_destroy(const struct pipe_buffer *buf) {
+    close(buf->read_fd);
+    close(buf->write_fd);
+}
+
+int pb_full(const struct pipe_buffer *buf) {
+    return buf->length == buf->capacity || (buf->blocked && buf->length > 0);
+}
+
+int pb_empty(const struct pipe_buffer *buf) {
+    return buf->length == 0;
+}
+
+ssize_t splice_to_pb(int fd, struct pipe_buffer *buf) {
+    if (pb_full(buf))
+        return -2;
+
+    ssize_t res = splice(fd, NULL, buf->write_fd, NULL, buf->capacity - buf->length,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (res > 0)
+        buf->length += res;
+    else if (res == -1 && errno == EAGAIN)
+        buf->blocked = 1;
+
+    return res;
+}
+
+ssize_t splice_from_pb(int fd, struct pipe_buffer *buf) {
+    if (pb_empty(buf))
+        return -2;
+
+    ssize_t res = splice(buf->read_fd, NULL, fd, NULL, buf->length,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (res > 0) {
+        buf->length -= res;
+        buf->blocked = 0;
+    }
+
+    return res;
+}
@@ -0,0 +1,26 @@
+#ifndef PIPE_BUFFER_H
+#define PIPE_BUFFER_H
+
+#include <sys/types.h> // ssize_t
+
+// Data is moved between sockets through the pipe with splice,
+// so it is never copied to user space.
+struct pipe_buffer {
+    int read_fd;
+    int write_fd;
+    size_t length;
+    size_t capacity;
+    // Pipe may run out of slots before it is full, splice fails with EAGAIN then.
+    unsigned blocked : 1;
+};
+
+int pb_init(struct pipe_buffer *buf, size_t capacity);
+void pb_destroy(const struct pipe_buffer *buf);
+
+int pb_full(const struct pipe_buffer *buf);
+int pb_empty(const struct pipe_buffer *buf);
+
+ssize_t splice_to_pb(int fd, struct pipe_buffer *buf);
+ssize_t splice_from_pb(int fd, struct pipe_buffer *buf);
+
+#endif
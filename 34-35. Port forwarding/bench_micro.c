@@ -0,0 +1,382 @@
+#define _GNU_SOURCE // F_SETPIPE_SZ
+#include "command_queue.h"
+#include "lz.h"
+#include "round_buffer.h"
+#include "stuffing.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Microbenchmarks of the primitives on the data path: round buffer copies and fd I/O,
+ * byte stuffing and LZ codecs of the tunnel protocol and the command queue.
+ * Every case is repeated until it runs for the given time, results are printed as CSV:
+ * group,op,capacity,size,pattern,wrap,ns_per_op,gb_per_s (empty when an op moves no payload).
+ * Wrap "split" places the data across the end of the ring, so every copy takes two parts.
+ * USAGE: bench_micro [milliseconds-per-case]
+ */
+
+#define QUEUE_CAPACITY 512
+#define PIPE_CAPACITY (1 << 20)
+
+static const size_t capacities[] = {4096, 65536, 1 << 20};
+static const size_t codec_sizes[] = {64, 1500, 16384, 65535};
+// Payloads shorter than MIN_COMPRESS_LENGTH of the pump are never compressed
+static const size_t lz_sizes[] = {1500, 16384};
+static const size_t queue_depths[] = {0, 64, QUEUE_CAPACITY - 1};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fill_random(uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        data[i] = (uint8_t) rand();
+}
+
+// Every byte has to be escaped by byte stuffing
+static void fill_end_bytes(uint8_t *data, size_t len) {
+    memset(data, END_BYTE, len);
+}
+
+// Text of random words, compressible as usual text is
+static void fill_ascii(uint8_t *data, size_t len) {
+    static const char *words[] = {"the ", "tunnel ", "carries ", "frames ", "of ", "many ", "streams ", "and ",
+                                  "commands ", "between ", "client ", "server ", "\r\n"};
+    size_t i = 0;
+    while (i < len) {
+        const char *word = words[rand() % (sizeof(words) / sizeof(words[0]))];
+        for (size_t j = 0; word[j] != 0 && i < len; j++)
+            data[i++] = word[j];
+    }
+}
+
+struct payload {
+    const char *name;
+    void (*fill)(uint8_t *, size_t);
+};
+
+static const struct payload payloads[] = {
+        {"random", fill_random},
+        {"all-0x7E", fill_end_bytes},
+        {"ascii", fill_ascii},
+};
+
+/*
+ * State shared by the ops. Each op leaves its buffers as it found them,
+ * so every call does the same work at the same positions.
+ */
+struct context {
+    size_t size;
+    const uint8_t *payload;
+    uint8_t *scratch;
+    struct round_buffer *src;
+    struct round_buffer *frame;
+    struct round_buffer *dst;
+    // Length of the encoded frame or the compressed block
+    size_t encoded;
+    uint8_t *packed;
+    size_t packed_cap;
+    int pipe[2];
+    struct cmd_queue *queue;
+};
+
+/*
+ * Make the data just consumed from the empty buffer readable again from the same position.
+ * Storage keeps the data, only the pointers are moved.
+ */
+static void replay(struct round_buffer *buf, size_t length) {
+    size_t cap = buf_capacity(buf);
+    buf_advance_write_ptr(buf, cap);
+    buf_advance_read_ptr(buf, cap - length);
+}
+
+/*
+ * Drop the data of the buffer and move the pointers back to where the data started.
+ */
+static void discard(struct round_buffer *buf) {
+    size_t length = buf_data_length(buf);
+    size_t cap = buf_capacity(buf);
+    buf_advance_read_ptr(buf, length);
+    buf_advance_write_ptr(buf, (cap - length) % cap);
+    buf_advance_read_ptr(buf, (cap - length) % cap);
+}
+
+// Move the pointers of the new buffer to the offset
+static void place(struct round_buffer *buf, size_t offset) {
+    buf_advance_write_ptr(buf, offset);
+    buf_advance_read_ptr(buf, offset);
+}
+
+static void op_put_peek(struct context *ctx) {
+    buf_put(ctx->src, ctx->payload, ctx->size);
+    buf_peek(ctx->src, ctx->scratch, ctx->size);
+    discard(ctx->src);
+}
+
+static void op_move(struct context *ctx) {
+    buf_move(ctx->dst, ctx->src, ctx->size);
+    replay(ctx->src, ctx->size);
+    discard(ctx->dst);
+}
+
+static void op_write_read(struct context *ctx) {
+    buf_write(ctx->pipe[1], ctx->src);
+    buf_read(ctx->pipe[0], ctx->dst);
+    replay(ctx->src, ctx->size);
+    discard(ctx->dst);
+}
+
+static void op_stuff_encode(struct context *ctx) {
+    stuffing_encode(ctx->src, ctx->frame, 1);
+    replay(ctx->src, ctx->size);
+    discard(ctx->frame);
+}
+
+static void op_stuff_decode(struct context *ctx) {
+    stuffing_decode(ctx->frame, ctx->dst);
+    replay(ctx->frame, ctx->encoded);
+    discard(ctx->dst);
+}
+
+static void op_lz_compress(struct context *ctx) {
+    // Limit used by the pump: the block has to save 1/8 of the payload
+    lz_compress(ctx->payload, ctx->size, ctx->packed, ctx->size - ctx->size / 8);
+}
+
+static void op_lz_decompress(struct context *ctx) {
+    lz_decompress(ctx->packed, ctx->encoded, ctx->scratch, ctx->size);
+}
+
+static void op_enqueue_dequeue(struct context *ctx) {
+    cmdq_enqueue(ctx->queue, (struct command) {.cmd = CMD_NOP, .arg = 1, .value = 2});
+    cmdq_dequeue(ctx->queue);
+}
+
+static void op_burst(struct context *ctx) {
+    for (int i = 0; i < QUEUE_CAPACITY; i++)
+        cmdq_enqueue(ctx->queue, (struct command) {.cmd = CMD_NOP, .arg = i, .value = i});
+    for (int i = 0; i < QUEUE_CAPACITY; i++)
+        cmdq_dequeue(ctx->queue);
+}
+
+/*
+ * Returns time of a single call of the op, calls are doubled until they take min_time.
+ */
+static double measure(void (*op)(struct context *), struct context *ctx, double min_time) {
+    for (size_t n = 1;; n *= 2) {
+        double start = now();
+        for (size_t i = 0; i < n; i++)
+            op(ctx);
+        double elapsed = now() - start;
+        if (elapsed >= min_time)
+            return elapsed / n;
+    }
+}
+
+static void report(const char *group, const char *op, size_t capacity, size_t size, const char *pattern,
+                   const char *wrap, double op_time, size_t bytes) {
+    printf("%s,%s,%zu,%zu,%s,%s,%.1f,", group, op, capacity, size, pattern, wrap, op_time * 1e9);
+    if (bytes > 0)
+        printf("%.3f", bytes / op_time / 1e9);
+    printf("\n");
+}
+
+static struct round_buffer *create_buffer(size_t capacity) {
+    struct round_buffer *buf = buf_create(capacity);
+    if (buf == NULL) {
+        perror("bench_micro: malloc");
+        exit(1);
+    }
+    return buf;
+}
+
+// Offset of data of the length in the buffer, "split" data crosses the end of the storage
+static size_t wrap_offset(size_t capacity, size_t length, int split) {
+    return split ? capacity - length / 2 : 0;
+}
+
+static const char *wrap_name(int split) {
+    return split ? "split" : "aligned";
+}
+
+/*
+ * Returns number of mismatches.
+ */
+static int bench_round_buffer(struct context *ctx, double min_time, size_t pipe_capacity) {
+    int failed = 0;
+    for (size_t c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++) {
+        size_t cap = capacities[c];
+        size_t sizes[] = {64, 1500, cap / 2};
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            size_t size = sizes[s];
+            for (int split = 0; split <= 1; split++) {
+                ctx->size = size;
+                ctx->src = create_buffer(cap);
+                ctx->dst = create_buffer(cap);
+                size_t offset = wrap_offset(cap, size, split);
+
+                place(ctx->src, offset);
+                op_put_peek(ctx);
+                failed += memcmp(ctx->scratch, ctx->payload, size) != 0;
+                report("round_buffer", "put_peek", cap, size, "random", wrap_name(split),
+                       measure(op_put_peek, ctx, min_time), size);
+
+                // put_peek leaves src empty at the offset
+                buf_put(ctx->src, ctx->payload, size);
+                place(ctx->dst, offset);
+                report("round_buffer", "move", cap, size, "random", wrap_name(split),
+                       measure(op_move, ctx, min_time), size);
+
+                if (size <= pipe_capacity) {
+                    report("round_buffer", "write_read", cap, size, "random", wrap_name(split),
+                           measure(op_write_read, ctx, min_time), size);
+                    buf_write(ctx->pipe[1], ctx->src);
+                    buf_read(ctx->pipe[0], ctx->dst);
+                    buf_peek(ctx->dst, ctx->scratch, size);
+                    failed += buf_data_length(ctx->dst) != size || memcmp(ctx->scratch, ctx->payload, size) != 0;
+                }
+
+                buf_destroy(ctx->src);
+                buf_destroy(ctx->dst);
+            }
+        }
+    }
+    return failed;
+}
+
+static int bench_stuffing(struct context *ctx, const struct payload *payload, double min_time) {
+    int failed = 0;
+    for (size_t s = 0; s < sizeof(codec_sizes) / sizeof(codec_sizes[0]); s++) {
+        size_t size = codec_sizes[s];
+        for (int split = 0; split <= 1; split++) {
+            ctx->size = size;
+            ctx->src = create_buffer(size);
+            ctx->frame = create_buffer(size * 2 + 3);
+            // Decoder stops without consuming END_BYTE when destination is full
+            ctx->dst = create_buffer(size + 1);
+
+            place(ctx->src, wrap_offset(size, size, split));
+            buf_put(ctx->src, ctx->payload, size);
+            place(ctx->frame, wrap_offset(size * 2 + 3, size * 2, split));
+            place(ctx->dst, wrap_offset(size + 1, size, split));
+            report("codec", "stuff_encode", size, size, payload->name, wrap_name(split),
+                   measure(op_stuff_encode, ctx, min_time), size);
+
+            stuffing_encode(ctx->src, ctx->frame, 1);
+            replay(ctx->src, size);
+            // Decoder starts after END_BYTE and connection id
+            buf_advance_read_ptr(ctx->frame, 2);
+            ctx->encoded = buf_data_length(ctx->frame);
+            stuffing_decode(ctx->frame, ctx->dst);
+            buf_peek(ctx->dst, ctx->scratch, size);
+            failed += buf_data_length(ctx->dst) != size || memcmp(ctx->scratch, ctx->payload, size) != 0;
+            replay(ctx->frame, ctx->encoded);
+            discard(ctx->dst);
+            report("codec", "stuff_decode", size, size, payload->name, wrap_name(split),
+                   measure(op_stuff_decode, ctx, min_time), size);
+
+            buf_destroy(ctx->src);
+            buf_destroy(ctx->frame);
+            buf_destroy(ctx->dst);
+        }
+    }
+    return failed;
+}
+
+static int bench_lz(struct context *ctx, const struct payload *payload, double min_time) {
+    int failed = 0;
+    for (size_t s = 0; s < sizeof(lz_sizes) / sizeof(lz_sizes[0]); s++) {
+        ctx->size = lz_sizes[s];
+        report("codec", "lz_compress", 0, ctx->size, payload->name, "none",
+               measure(op_lz_compress, ctx, min_time), ctx->size);
+
+        // Block for decompression is made without the limit, so incompressible data has one too
+        ctx->encoded = lz_compress(ctx->payload, ctx->size, ctx->packed, ctx->packed_cap);
+        failed += lz_decompress(ctx->packed, ctx->encoded, ctx->scratch, ctx->size) != (ssize_t) ctx->size ||
+                  memcmp(ctx->scratch, ctx->payload, ctx->size) != 0;
+        report("codec", "lz_decompress", 0, ctx->size, payload->name, "none",
+               measure(op_lz_decompress, ctx, min_time), ctx->size);
+    }
+    return failed;
+}
+
+static void bench_cmd_queue(struct context *ctx, double min_time) {
+    for (size_t d = 0; d < sizeof(queue_depths) / sizeof(queue_depths[0]); d++) {
+        ctx->queue = make_cmd_queue(QUEUE_CAPACITY);
+        if (ctx->queue == NULL) {
+            perror("bench_micro: make_cmd_queue");
+            exit(1);
+        }
+        for (size_t i = 0; i < queue_depths[d]; i++)
+            cmdq_enqueue(ctx->queue, (struct command) {.cmd = CMD_NOP});
+        report("cmd_queue", "enqueue_dequeue", QUEUE_CAPACITY, queue_depths[d], "none", "none",
+               measure(op_enqueue_dequeue, ctx, min_time), 0);
+        free_cmd_queue(ctx->queue);
+    }
+
+    ctx->queue = make_cmd_queue(QUEUE_CAPACITY);
+    if (ctx->queue == NULL) {
+        perror("bench_micro: make_cmd_queue");
+        exit(1);
+    }
+    // Time per command of filling the whole queue and draining it
+    report("cmd_queue", "burst", QUEUE_CAPACITY, QUEUE_CAPACITY, "none", "none",
+           measure(op_burst, ctx, min_time) / QUEUE_CAPACITY, 0);
+    free_cmd_queue(ctx->queue);
+}
+
+int main(int argc, char *argv[]) {
+    double min_time = 0.1;
+    if (argc > 1)
+        min_time = strtoul(argv[1], NULL, 10) / 1e3;
+
+    size_t max_size = capacities[sizeof(capacities) / sizeof(capacities[0]) - 1];
+    struct context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    uint8_t *payload = malloc(max_size);
+    ctx.scratch = malloc(max_size);
+    ctx.packed_cap = LZ_MAX_INPUT * 2;
+    ctx.packed = malloc(ctx.packed_cap);
+    if (payload == NULL || ctx.scratch == NULL || ctx.packed == NULL) {
+        perror("bench_micro: malloc");
+        return 1;
+    }
+    ctx.payload = payload;
+
+    if (pipe(ctx.pipe) == -1) {
+        perror("bench_micro: pipe");
+        return 1;
+    }
+    // Data of a single op has to fit into the pipe, larger sizes skip the fd I/O
+    int pipe_capacity = fcntl(ctx.pipe[1], F_SETPIPE_SZ, PIPE_CAPACITY);
+    if (pipe_capacity == -1)
+        pipe_capacity = fcntl(ctx.pipe[1], F_GETPIPE_SZ);
+
+    printf("group,op,capacity,size,pattern,wrap,ns_per_op,gb_per_s\n");
+    srand(1);
+    fill_random(payload, max_size);
+    int failed = bench_round_buffer(&ctx, min_time, pipe_capacity);
+    for (size_t p = 0; p < sizeof(payloads) / sizeof(payloads[0]); p++) {
+        srand(1);
+        payloads[p].fill(payload, max_size);
+        failed += bench_stuffing(&ctx, &payloads[p], min_time);
+        failed += bench_lz(&ctx, &payloads[p], min_time);
+    }
+    bench_cmd_queue(&ctx, min_time);
+
+    if (failed)
+        fprintf(stderr, "bench_micro: %d cases produced wrong data\n", failed);
+    close(ctx.pipe[0]);
+    close(ctx.pipe[1]);
+    free(payload);
+    free(ctx.scratch);
+    free(ctx.packed);
+    return failed != 0;
+}
@@ -0,0 +1,139 @@
+#include "stuffing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Measures throughput of byte stuffing with every kernel supported by the processor,
+ * with ordinary and mirrored buffers.
+ * USAGE: bench_stuffing [megabytes-per-run]
+ */
+
+#define PAYLOAD_SIZE 65536
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fill_random(uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        data[i] = (uint8_t) rand();
+}
+
+// Every fourth byte needs escaping
+static void fill_escape_heavy(uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        data[i] = i % 4 == 0 ? (rand() & 1 ? END_BYTE : ESC_BYTE) : 'a' + rand() % 26;
+}
+
+static void fill_clean(uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        data[i] = 'a' + rand() % 26;
+}
+
+struct payload {
+    const char *name;
+    void (*fill)(uint8_t *, size_t);
+};
+
+static const struct payload payloads[] = {
+        {"random", fill_random},
+        {"escape-heavy", fill_escape_heavy},
+        {"clean", fill_clean},
+};
+
+struct layout {
+    const char *name;
+    struct round_buffer *(*create)(size_t);
+};
+
+static const struct layout layouts[] = {
+        {"ring", buf_create},
+        {"mirrored", buf_create_mirrored},
+};
+
+/*
+ * Encode payload into a frame and decode it back, rounds times.
+ * Returns 0 if decoded data differs from the payload.
+ */
+static int run(const struct layout *layout, const uint8_t *payload, size_t rounds, double *enc_time, double *dec_time) {
+    struct round_buffer *src = layout->create(PAYLOAD_SIZE);
+    struct round_buffer *frame = layout->create(PAYLOAD_SIZE * 2 + 3);
+    // Decoder stops without consuming END_BYTE when destination is full
+    struct round_buffer *dst = layout->create(PAYLOAD_SIZE + 1);
+    uint8_t *check = malloc(PAYLOAD_SIZE);
+    if (src == NULL || frame == NULL || dst == NULL || check == NULL) {
+        perror("bench_stuffing: malloc");
+        exit(1);
+    }
+
+    int ok = 1;
+    *enc_time = 0;
+    *dec_time = 0;
+    for (size_t r = 0; r < rounds; r++) {
+        buf_put(src, payload, PAYLOAD_SIZE);
+
+        double t0 = now();
+        stuffing_encode(src, frame, 1);
+        double t1 = now();
+        buf_advance_read_ptr(frame, 2);
+        stuffing_decode(frame, dst);
+        double t2 = now();
+
+        *enc_time += t1 - t0;
+        *dec_time += t2 - t1;
+        if (!buf_empty(src) || !buf_empty(frame) || buf_data_length(dst) != PAYLOAD_SIZE)
+            ok = 0;
+        buf_peek(dst, check, PAYLOAD_SIZE);
+        if (memcmp(check, payload, PAYLOAD_SIZE) != 0)
+            ok = 0;
+        buf_advance_read_ptr(dst, PAYLOAD_SIZE);
+    }
+
+    free(check);
+    buf_destroy(src);
+    buf_destroy(frame);
+    buf_destroy(dst);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    size_t megabytes = 256;
+    if (argc > 1)
+        megabytes = strtoul(argv[1], NULL, 10);
+    size_t rounds = megabytes * 1024 * 1024 / PAYLOAD_SIZE;
+    if (rounds == 0)
+        rounds = 1;
+
+    uint8_t *payload = malloc(PAYLOAD_SIZE);
+    if (payload == NULL) {
+        perror("bench_stuffing: malloc");
+        return 1;
+    }
+
+    printf("%-8s %-10s %-14s %12s %12s\n", "kernel", "buffers", "payload", "encode GB/s", "decode GB/s");
+    int failed = 0;
+    for (int k = KERNEL_SCALAR; k <= KERNEL_AVX2; k++) {
+        if (!stuffing_select_kernel(k))
+            continue;
+        for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+            for (size_t p = 0; p < sizeof(payloads) / sizeof(payloads[0]); p++) {
+                srand(1);
+                payloads[p].fill(payload, PAYLOAD_SIZE);
+
+                double enc, dec;
+                int ok = run(&layouts[l], payload, rounds, &enc, &dec);
+                double gb = (double) rounds * PAYLOAD_SIZE / 1e9;
+                printf("%-8s %-10s %-14s %12.2f %12.2f%s\n", stuffing_kernel_name(), layouts[l].name,
+                       payloads[p].name, gb / enc, gb / dec, ok ? "" : "  MISMATCH");
+                failed |= !ok;
+            }
+        }
+    }
+    free(payload);
+    return failed;
+}
@@ -0,0 +1,294 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+/*
+ * Measures CPU time the forwarder spends per round trip of a single active stream
+ * while the tunnel also carries many idle streams.
+ * Client and server run in separate processes, so /proc/<pid>/stat shows the cost of each side.
+ * USAGE: bench_update [-e poll|epoll|uring] [portfwd-binary]
+ */
+
+#define DURATION 2.0
+#define CONNECT_ATTEMPTS 500
+#define MAX_EVENTS 256
+
+static const int idle_counts[] = {10, 1000, 10000};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static struct sockaddr_in local_addr(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    return addr;
+}
+
+/*
+ * Create listening socket on the port chosen by the kernel.
+ */
+static int listen_any(int *port) {
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == -1) {
+        perror("bench_update: socket");
+        return -1;
+    }
+    struct sockaddr_in addr = local_addr(0);
+    socklen_t len = sizeof(addr);
+    if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        listen(s, SOMAXCONN) == -1 ||
+        getsockname(s, (struct sockaddr *) &addr, &len) == -1) {
+        perror("bench_update: listen");
+        close(s);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return s;
+}
+
+static int free_port(void) {
+    int port;
+    int s = listen_any(&port);
+    if (s == -1)
+        return -1;
+    close(s);
+    return port;
+}
+
+/*
+ * Echo everything received on accepted connections. Never returns.
+ */
+static void run_echo(int ls) {
+    int ep = epoll_create1(0);
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = ls};
+    if (ep == -1 || epoll_ctl(ep, EPOLL_CTL_ADD, ls, &ev) == -1) {
+        perror("bench_update: echo: epoll");
+        _exit(1);
+    }
+    char buf[4096];
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int cnt = epoll_wait(ep, events, MAX_EVENTS, -1);
+        for (int i = 0; i < cnt; i++) {
+            int fd = events[i].data.fd;
+            if (fd == ls) {
+                int s = accept(ls, NULL, NULL);
+                if (s == -1)
+                    continue;
+                ev.data.fd = s;
+                epoll_ctl(ep, EPOLL_CTL_ADD, s, &ev);
+                continue;
+            }
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0 || write(fd, buf, n) != n)
+                close(fd);
+        }
+    }
+}
+
+static pid_t spawn(char *const argv[]) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("bench_update: fork");
+        return -1;
+    }
+    if (pid == 0) {
+        // Forwarder reports every connection, keep the output clean
+        int null = open("/dev/null", O_WRONLY);
+        if (null != -1) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+static int connect_to(int port) {
+    struct sockaddr_in addr = local_addr(port);
+    for (int i = 0; i < CONNECT_ATTEMPTS; i++) {
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        if (s == -1) {
+            perror("bench_update: socket");
+            return -1;
+        }
+        if (connect(s, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            int one = 1;
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return s;
+        }
+        close(s);
+        if (errno != ECONNREFUSED)
+            break;
+        usleep(10000);
+    }
+    perror("bench_update: connect");
+    return -1;
+}
+
+/*
+ * Send one byte and wait for the echo. Returns 0 on failure.
+ */
+static int ping(int s) {
+    char c = 'x';
+    return write(s, &c, 1) == 1 && read(s, &c, 1) == 1;
+}
+
+/*
+ * Returns CPU time (user and system) consumed by the process in seconds.
+ */
+static double cpu_seconds(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    unsigned long utime = 0, stime = 0;
+    // Fields after the command name, which is enclosed in parentheses
+    if (fscanf(f, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        utime = stime = 0;
+    fclose(f);
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static void raise_descriptor_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/*
+ * Open idle streams through the forwarder and make sure all of them reached the echo server.
+ */
+static int open_idle(int port, int *socks, int count) {
+    for (int i = 0; i < count; i++) {
+        socks[i] = connect_to(port);
+        if (socks[i] == -1)
+            return 0;
+        char c = 'x';
+        if (write(socks[i], &c, 1) != 1)
+            return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        char c;
+        if (read(socks[i], &c, 1) != 1)
+            return 0;
+    }
+    return 1;
+}
+
+static int run(const char *portfwd, const char *engine, int idle) {
+    int echo_port, tunnel_port = free_port(), listen_port = free_port();
+    int ls = listen_any(&echo_port);
+    if (ls == -1 || tunnel_port == -1 || listen_port == -1)
+        return 0;
+
+    pid_t echo = fork();
+    if (echo == 0)
+        run_echo(ls);
+    close(ls);
+
+    char tp[16], lp[16], ep[16];
+    snprintf(tp, sizeof(tp), "%d", tunnel_port);
+    snprintf(lp, sizeof(lp), "%d", listen_port);
+    snprintf(ep, sizeof(ep), "%d", echo_port);
+    char *server_argv[] = {(char *) portfwd, "-e", (char *) engine, "server", tp, "127.0.0.1", ep, NULL};
+    char *client_argv[] = {(char *) portfwd, "-e", (char *) engine, "client", lp, "127.0.0.1", tp, NULL};
+    pid_t server = spawn(server_argv);
+    usleep(200000);
+    pid_t client = spawn(client_argv);
+
+    int ok = 0;
+    int active = -1;
+    int *socks = calloc(idle, sizeof(int));
+    if (socks == NULL) {
+        perror("bench_update: calloc");
+        goto cleanup;
+    }
+    for (int i = 0; i < idle; i++)
+        socks[i] = -1;
+    active = connect_to(listen_port);
+    if (active == -1 || !ping(active) || !open_idle(listen_port, socks, idle)) {
+        fprintf(stderr, "bench_update: forwarder doesn't respond\n");
+        goto cleanup;
+    }
+
+    double client_cpu = cpu_seconds(client), server_cpu = cpu_seconds(server);
+    double start = now(), elapsed;
+    long rounds = 0;
+    do {
+        if (!ping(active)) {
+            fprintf(stderr, "bench_update: active stream is closed\n");
+            goto cleanup;
+        }
+        rounds++;
+    } while ((elapsed = now() - start) < DURATION);
+    client_cpu = cpu_seconds(client) - client_cpu;
+    server_cpu = cpu_seconds(server) - server_cpu;
+
+    printf("%-8s %8d %12.0f %14.2f %14.2f\n", engine, idle, rounds / elapsed,
+           client_cpu * 1e6 / rounds, server_cpu * 1e6 / rounds);
+    ok = 1;
+
+    cleanup:
+    if (active != -1)
+        close(active);
+    for (int i = 0; socks != NULL && i < idle; i++) {
+        if (socks[i] != -1)
+            close(socks[i]);
+    }
+    free(socks);
+    pid_t pids[] = {client, server, echo};
+    for (int i = 0; i < 3; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGKILL);
+            waitpid(pids[i], NULL, 0);
+        }
+    }
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    const char *engine = "epoll";
+    int opt;
+    while ((opt = getopt(argc, argv, "e:")) != -1) {
+        if (opt != 'e') {
+            fprintf(stderr, "USAGE: bench_update [-e poll|epoll|uring] [portfwd-binary]\n");
+            return 1;
+        }
+        engine = optarg;
+    }
+    const char *portfwd = optind < argc ? argv[optind] : "bin/portfwd";
+
+    raise_descriptor_limit();
+    signal(SIGPIPE, SIG_IGN);
+    // Runs with many connections are long, show results as soon as they are ready
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    printf("%-8s %8s %12s %14s %14s\n", "engine", "idle", "round trips/s", "client us/rt", "server us/rt");
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(idle_counts) / sizeof(idle_counts[0]); i++)
+        failed |= !run(portfwd, engine, idle_counts[i]);
+    return failed;
+}
@@ -3,8 +3,12 @@
 #include <errno.h>
 #include <stdio.h>
 
+// Drained queue that has grown this many times over its initial capacity is shrunk back
+#define SHRINK_FACTOR 4
+
 struct cmd_queue {
     size_t cap;
+    size_t initial_cap;
     size_t offset, length;
     struct command *queue;
 };
@@ -25,6 +29,7 @@ struct cmd_queue *make_cmd_queue(size_t cap) {
     }
 
     q->cap = cap;
+    q->initial_cap = cap;
     q->offset = 0;
     q->length = 0;
     q->queue = queue;
@@ -43,8 +48,27 @@ size_t cmdq_length(struct cmd_queue *q) {
     return q->length;
 }
 
+/*
+ * Move the commands to new storage of cap entries, the oldest one goes first.
+ * Returns 0 on failure, the queue is not changed then.
+ */
+static int resize(struct cmd_queue *q, size_t cap) {
+    struct command *queue = malloc(cap * sizeof(struct command));
+    if (queue == NULL) {
+        perror("cmdq: malloc");
+        return 0;
+    }
+    for (size_t i = 0; i < q->length; i++)
+        queue[i] = q->queue[(q->offset + i) % q->cap];
+    free(q->queue);
+    q->queue = queue;
+    q->cap = cap;
+    q->offset = 0;
+    return 1;
+}
+
 int cmdq_enqueue(struct cmd_queue *q, struct command cmd) {
-    if (q->length == q->cap)
+    if (q->length == q->cap && !resize(q, q->cap * 2))
         return 0;
 
     q->queue[(q->offset + q->length) % q->cap] = cmd;
@@ -58,6 +82,7 @@ struct command cmdq_dequeue(struct cmd_queue *q) {
     if (q->length == 0) {
         res.cmd = CMD_NOP;
         res.arg = 0;
+        res.value = 0;
         return res;
     }
 
@@ -65,5 +90,7 @@ struct command cmdq_dequeue(struct cmd_queue *q) {
     if (q->offset >= q->cap)
         q->offset %= q->cap;
     q->length--;
+    if (q->length == 0 && q->cap >= q->initial_cap * SHRINK_FACTOR)
+        resize(q, q->initial_cap);
     return res;
 }
@@ -8,17 +8,26 @@
 
 struct command {
     uint8_t cmd;
-    uint8_t arg;
+    uint32_t arg;
+    // Additional argument of commands that need it
+    uint32_t value;
 };
 
 struct cmd_queue;
 
+/*
+ * Queue starts with cap entries and doubles when it is full,
+ * it returns to the initial size when it is drained after growing fourfold.
+ */
 struct cmd_queue *make_cmd_queue(size_t cap);
 
 void free_cmd_queue(struct cmd_queue *q);
 
 size_t cmdq_length(struct cmd_queue *q);
 
+/*
+ * Returns 0 only if the queue can't grow.
+ */
 int cmdq_enqueue(struct cmd_queue *q, struct command cmd);
 
 struct command cmdq_dequeue(struct cmd_queue *q);
@@ -0,0 +1,55 @@
+#include "conn_table.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_TABLE_SIZE 256
+
+void table_init(struct conn_table *t) {
+    t->items = NULL;
+    t->count = 0;
+    t->cap = 0;
+}
+
+void table_free(struct conn_table *t) {
+    free(t->items);
+}
+
+int table_reserve(struct conn_table *t, size_t id) {
+    if (id < t->cap)
+        return 1;
+    size_t cap = t->cap == 0 ? INITIAL_TABLE_SIZE : t->cap;
+    while (cap <= id)
+        cap *= 2;
+    struct connection **items = realloc(t->items, cap * sizeof(struct connection *));
+    if (items == NULL) {
+        perror("table_reserve: realloc");
+        return 0;
+    }
+    memset(items + t->cap, 0, (cap - t->cap) * sizeof(struct connection *));
+    t->items = items;
+    t->cap = cap;
+    return 1;
+}
+
+int table_insert(struct conn_table *t, struct connection *c) {
+    if (!table_reserve(t, c->id))
+        return 0;
+    t->items[c->id] = c;
+    if ((size_t) c->id >= t->count)
+        t->count = c->id + 1;
+    return 1;
+}
+
+void table_remove(struct conn_table *t, uint32_t id) {
+    if (id >= t->count)
+        return;
+    t->items[id] = NULL;
+    while (t->count > 0 && t->items[t->count - 1] == NULL)
+        t->count--;
+}
+
+struct connection *table_get(const struct conn_table *t, uint32_t id) {
+    return id < t->count ? t->items[id] : NULL;
+}
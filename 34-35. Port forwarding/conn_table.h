@@ -0,0 +1,43 @@
+#ifndef CONN_TABLE_H_INCLUDED
+#define CONN_TABLE_H_INCLUDED
+
+#include "manager.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Live connections indexed by id, items[0] is the tunnel.
+ * Entries are added when the connection gets its id and removed when it is marked
+ * for deletion, so the table is never rebuilt. Table may grow while the pump
+ * handles commands, so items must not be cached across command handlers.
+ */
+struct conn_table {
+    struct connection **items;
+    // All entries starting from this one are empty
+    size_t count;
+    size_t cap;
+};
+
+void table_init(struct conn_table *t);
+
+void table_free(struct conn_table *t);
+
+/*
+ * Make the table large enough to hold the connection with specified id.
+ */
+int table_reserve(struct conn_table *t, size_t id);
+
+/*
+ * Put the connection to the entry specified by its id. Returns 0 on failure.
+ */
+int table_insert(struct conn_table *t, struct connection *c);
+
+void table_remove(struct conn_table *t, uint32_t id);
+
+/*
+ * Returns connection with specified id or NULL.
+ */
+struct connection *table_get(const struct conn_table *t, uint32_t id);
+
+#endif
@@ -1,70 +1,146 @@
 #include "controller.h"
 
 #include <stdlib.h>
-#include <string.h>
 #include <stdio.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #define TUNNEL_BUF_SIZE_MULTIPLIER 10
-#define MAX_STACK_SIZE (MAX_CONNECTIONS - 1)
-#define QUEUE_SIZE (MAX_CONNECTIONS * 2)
-
+// Initial size of the command queue, it grows while commands wait for the tunnel
+#define QUEUE_SIZE 512
+#define INITIAL_STACK_SIZE 256
+
+/*
+ * Identifiers released by closed connections are reused first,
+ * new identifiers are taken only when there are no released ones.
+ */
 struct id_stack {
-    int stack[MAX_STACK_SIZE];
-    int cnt;
+    int *stack;
+    size_t cnt;
+    size_t cap;
+    // Smallest identifier that was never used
+    int next;
+};
+
+/*
+ * Accepted connections that are waiting for a free identifier.
+ * Their id is set to WAITING_ID, so they are pushed only once.
+ */
+#define WAITING_ID (-2)
+
+struct conn_stack {
+    struct connection **items;
+    size_t cnt;
+    size_t cap;
 };
 
 struct controller {
     struct connection_manager *manager;
     struct pump *pump;
     struct id_stack free_ids;
+    struct conn_table table;
+    struct conn_stack waiting;
     struct sockaddr_in address;
     int accepting;
+    // Pump has work that can be done without waiting for events
+    int pending;
     size_t buf_size;
+    struct shard_metrics *metrics;
+    // Syscall counter of the manager at the start of the loop
+    uint64_t syscalls;
+    // Scheduling of accepted connections, see controller_config
+    uint8_t priority;
+    uint32_t quantum;
 };
 
 static void id_stack_init(struct id_stack *s) {
-    for (int i = 0; i < MAX_STACK_SIZE; i++)
-        s->stack[i] = MAX_STACK_SIZE - i;
-    s->cnt = MAX_CONNECTIONS - 1;
+    s->stack = NULL;
+    s->cnt = 0;
+    s->cap = 0;
+    s->next = 1;
 }
 
-static int id_stack_empty(struct id_stack *s) {
-    return s->cnt == 0;
+static void id_stack_free(struct id_stack *s) {
+    free(s->stack);
 }
 
 static void id_stack_push(struct id_stack *s, int id) {
-    if (s->cnt == MAX_STACK_SIZE) {
-        fprintf(stderr, "controller: free id stack overflow\n");
-        return;
+    if (s->cnt == s->cap) {
+        size_t cap = s->cap == 0 ? INITIAL_STACK_SIZE : s->cap * 2;
+        int *stack = realloc(s->stack, cap * sizeof(int));
+        if (stack == NULL) {
+            // Identifier is lost, but it doesn't break anything.
+            perror("controller: id_stack_push: realloc");
+            return;
+        }
+        s->stack = stack;
+        s->cap = cap;
     }
     s->stack[s->cnt++] = id;
 }
 
-static int id_stack_pop(struct id_stack *s) {
-    if (s->cnt == 0) {
-        fprintf(stderr, "controller: free id stack underflow\n");
+/*
+ * Returns free identifier not greater than max_id or -1 if there is no such identifier.
+ */
+static int id_stack_pop(struct id_stack *s, int max_id) {
+    if (s->cnt > 0)
+        return s->stack[--s->cnt];
+    if (s->next > max_id)
         return -1;
-    }
-    return s->stack[--s->cnt];
+    return s->next++;
+}
+
+static void conn_stack_init(struct conn_stack *s) {
+    s->items = NULL;
+    s->cnt = 0;
+    s->cap = 0;
+}
+
+static void conn_stack_free(struct conn_stack *s) {
+    free(s->items);
 }
 
-static void sort_connections(
-        struct id_stack *stack,
-        struct connection *const *connections,
-        struct connection **sorted,
-        size_t count) {
-    memset(sorted, 0, sizeof(void *) * MAX_CONNECTIONS);
-    while (count--) {
-        struct connection *c = *connections++;
-        if (c->id > MAX_CONNECTIONS || c->id < 0) {
-            if (id_stack_empty(stack))
-                continue;
-            c->id = id_stack_pop(stack);
+static int conn_stack_push(struct conn_stack *s, struct connection *c) {
+    if (s->cnt == s->cap) {
+        size_t cap = s->cap == 0 ? INITIAL_STACK_SIZE : s->cap * 2;
+        struct connection **items = realloc(s->items, cap * sizeof(struct connection *));
+        if (items == NULL) {
+            perror("controller: conn_stack_push: realloc");
+            return 0;
         }
-        sorted[c->id] = c;
+        s->items = items;
+        s->cap = cap;
     }
+    s->items[s->cnt++] = c;
+    return 1;
+}
+
+/*
+ * Give identifier to the accepted connection and add it to the table.
+ * Returns 0 if there are no free identifiers.
+ */
+static int assign_id(struct controller *controller, struct connection *c) {
+    int id = id_stack_pop(&controller->free_ids, pump_max_id(controller->pump));
+    if (id == -1)
+        return 0;
+    int old_id = c->id;
+    c->id = id;
+    if (!table_insert(&controller->table, c)) {
+        id_stack_push(&controller->free_ids, id);
+        c->id = old_id;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Forget the connection marked for deletion, its identifier may be reused immediately.
+ */
+static void release_connection(struct controller *controller, struct connection *c) {
+    table_remove(&controller->table, c->id);
+    if (controller->accepting)
+        id_stack_push(&controller->free_ids, c->id);
 }
 
 static int is_new_connection(struct connection *c) {
@@ -87,124 +163,192 @@ static int should_close_out(struct connection *c) {
 #define STATE_AGAIN 2
 #define STATE_SHUTDOWN 3
 
-static int handle_state_changes(struct controller *controller, struct connection **connections) {
-    struct connection *tunnel = connections[0];
+static int handle_state_change(struct controller *controller, struct connection *c) {
+    if (c->state & CS_CONNECTING)
+        return STATE_OK;
+    if (is_new_connection(c) && controller->accepting) {
+        uint32_t schedule = 0;
+        if (controller->priority != 0 || controller->quantum != DEFAULT_QUANTUM)
+            schedule = (uint32_t) controller->priority << NEW_PRIORITY_SHIFT | controller->quantum;
+        if (!send_command_with_value(controller->pump, CMD_NEW, c->id, schedule))
+            return STATE_AGAIN;
+        cm_set_priority(controller->manager, c, controller->priority);
+        c->quantum = controller->quantum;
+        c->state &= ~CS_NEW;
+        c->state |= CS_STOPPED;
+        // Data received before the connection was announced can be sent now
+        if (!buf_empty(c->in_buf))
+            cm_queue_input(controller->manager, c);
+        printf("New connection accepted (id: %d)\n", c->id);
+    } else if (is_new_connection(c) && is_alive(c->state)) {
+        // Connection requested by the peer is established
+        if (!send_command(controller->pump, CMD_ACK, c->id))
+            return STATE_AGAIN;
+        c->state &= ~CS_NEW;
+        if (!buf_empty(c->in_buf))
+            cm_queue_input(controller->manager, c);
+        printf("New connection established (id: %d)\n", c->id);
+    }
+    if (should_close_connection(c)) {
+        if (!send_command(controller->pump, CMD_CLOSE, c->id))
+            return STATE_AGAIN;
+        c->state |= CS_DELETE;
+        cm_schedule_close(controller->manager, c);
+        release_connection(controller, c);
+        printf("Connection closed by socket (id: %d)\n", c->id);
+    } else {
+        if (!(c->in_state & CS_DELETE) && should_close_in(c)) {
+            if (!send_command(controller->pump, CMD_CLOSE_SRC_TO_DST, c->id))
+                return STATE_AGAIN;
+            c->in_state |= CS_DELETE;
+            cm_schedule_close(controller->manager, c);
+            printf("(source -> destination) closed by socket (id: %d)\n", c->id);
+        }
+        if (!(c->out_state & CS_DELETE) && should_close_out(c)) {
+            if (!send_command(controller->pump, CMD_CLOSE_DST_TO_SRC, c->id))
+                return STATE_AGAIN;
+            c->out_state |= CS_DELETE;
+            cm_schedule_close(controller->manager, c);
+            printf("(destination -> source) closed by socket (id: %d)\n", c->id);
+        }
+        if (c->shrink_output) {
+            if (!pump_reclaim_credit(controller->pump, c))
+                return STATE_AGAIN;
+            c->shrink_output = 0;
+        }
+        // Output buffer may be drained or resized since the last grant
+        if (!pump_grant_credit(controller->pump, c))
+            return STATE_AGAIN;
+    }
+    return STATE_OK;
+}
+
+/*
+ * Only connections reported as changed by the manager are checked.
+ */
+static int handle_state_changes(struct controller *controller) {
+    struct connection *tunnel = controller->table.items[0];
     if (tunnel->state & CS_CLOSED || tunnel->in_state & CS_CLOSED || tunnel->out_state & CS_CLOSED) {
         return STATE_SHUTDOWN;
     }
-    for (int i = 1; i < 256; i++) {
-        struct connection *c = connections[i];
-        if (c == NULL)
+
+    // Identifiers may be released by the previous update or by the protocol switch
+    struct conn_stack *waiting = &controller->waiting;
+    while (waiting->cnt > 0 && assign_id(controller, waiting->items[waiting->cnt - 1]))
+        cm_mark_changed(controller->manager, waiting->items[--waiting->cnt]);
+
+    struct connection *c;
+    while ((c = cm_pop_changed(controller->manager)) != NULL) {
+        if (c == tunnel || (c->state & CS_DELETE))
+            continue; // Connection is closing and may share id with a new one.
+        if (c->id == WAITING_ID)
+            continue; // Connection is handled when it gets identifier.
+        if (c->id < 0 && !assign_id(controller, c)) {
+            if (conn_stack_push(waiting, c))
+                c->id = WAITING_ID;
+            else
+                cm_mark_changed(controller->manager, c);
             continue;
-        if (is_new_connection(c)) {
-            if (!send_command(controller->pump, CMD_NEW, c->id))
-                return STATE_AGAIN;
-            c->state &= ~CS_NEW;
-            c->state |= CS_STOPPED;
-            printf("New connection accepted (id: %d)\n", c->id);
         }
-        if (should_close_connection(c)) {
-            if (!send_command(controller->pump, CMD_CLOSE, c->id))
-                return STATE_AGAIN;
-            c->state |= CS_DELETE;
-            if (controller->accepting)
-                id_stack_push(&controller->free_ids, c->id);
-            connections[i] = NULL; // Ignore the connection on next stages.
-            printf("Connection closed by socket (id: %d)\n", c->id);
-        } else {
-            if (!(c->in_state & CS_DELETE) && should_close_in(c)) {
-                if (!send_command(controller->pump, CMD_CLOSE_SRC_TO_DST, c->id))
-                    return STATE_AGAIN;
-                c->in_state |= CS_DELETE;
-                printf("(source -> destination) closed by socket (id: %d)\n", c->id);
-            }
-            if (!(c->out_state & CS_DELETE) && should_close_out(c)) {
-                if (!send_command(controller->pump, CMD_CLOSE_DST_TO_SRC, c->id))
-                    return STATE_AGAIN;
-                c->out_state |= CS_DELETE;
-                printf("(destination -> source) closed by socket (id: %d)\n", c->id);
-            }
+        if (handle_state_change(controller, c) == STATE_AGAIN) {
+            // The rest of changed connections stays in the manager
+            cm_mark_changed(controller->manager, c);
+            return STATE_AGAIN;
         }
     }
     return STATE_OK;
 }
 
-static void on_command(void *self, uint8_t cmd, uint8_t arg) {
+static int on_command(void *self, uint8_t cmd, uint32_t arg, uint32_t value) {
     struct controller *c = self;
 
+    if (arg == 0 || arg > MAX_STREAM_ID) {
+        fprintf(stderr, "controller: on_command: wrong connection id %u\n", arg);
+        return 1;
+    }
+    struct connection *conn = table_get(&c->table, arg);
     if (cmd == CMD_NEW) {
-        int count = 0;
-        struct connection *const *cs = cm_get_connections(c->manager, &count);
-        for (int i = 0; i < count; ++i) {
-            if (cs[i]->id == arg) {
-                // TODO: shutdown or just ignore
-                return;
-            }
+        if (conn != NULL) {
+            fprintf(stderr, "controller: on_command: protocol violation: connection %u is already open\n", arg);
+            return -1;
         }
-        if (cm_connect(c->manager, &c->address, c->buf_size, c->buf_size, arg)) {
-            if (!send_command(c->pump, CMD_ACK, arg)) {
-                // This should newer happen if queue size is enough.
-                fprintf(stderr, "controller: on_command: WARNING command queue overflow\n");
-                // TODO: shutdown
+        // Event loop is not blocked by the connect, ACK or CLOSE is sent when it completes.
+        conn = cm_connect_async(c->manager, &c->address, c->buf_size, c->buf_size, arg);
+        if (conn != NULL && !table_insert(&c->table, conn)) {
+            conn->state |= CS_DELETE;
+            cm_schedule_close(c->manager, conn);
+            conn = NULL;
+        }
+        if (conn != NULL) {
+            conn->state |= CS_NEW;
+            if (value != 0) {
+                cm_set_priority(c->manager, conn, value >> NEW_PRIORITY_SHIFT);
+                if (value & NEW_QUANTUM_MASK)
+                    conn->quantum = value & NEW_QUANTUM_MASK;
             }
-            printf("New connection established\n");
+            // Connection established immediately has to be acknowledged before waiting for events.
+            if (!(conn->state & CS_CONNECTING))
+                c->pending = 1;
         } else {
             // We can't send commands directly, because buffer may be full.
             if (!send_command(c->pump, CMD_CLOSE, arg)) {
-                // This should newer happen if queue size is enough.
-                fprintf(stderr, "controller: on_command: WARNING command queue overflow\n");
-                // TODO: shutdown
-            }
-            return;
-        }
-    } else if (cmd == CMD_CLOSE || // Commands that need to find connection by id
-               cmd == CMD_CLOSE_SRC_TO_DST ||
-               cmd == CMD_CLOSE_DST_TO_SRC ||
-               cmd == CMD_ACK) {
-        int count = 0;
-        struct connection *const *cs = cm_get_connections(c->manager, &count);
-        for (int i = 0; i < count; ++i) {
-            if (cs[i]->id == arg) {
-                if (cmd == CMD_CLOSE) {
-                    cs[i]->state |= CS_DELETE;
-                    if (c->accepting)
-                        id_stack_push(&c->free_ids, cs[i]->id);
-                    printf("Connection closed by command (id: %d)\n", arg);
-                } else if (cmd == CMD_CLOSE_SRC_TO_DST) {
-                    cs[i]->out_state |= CS_DELETE;
-                    printf("(source -> destination) closed by command (id: %d)\n", arg);
-                } else if (cmd == CMD_CLOSE_DST_TO_SRC) {
-                    cs[i]->in_state |= CS_DELETE;
-                    printf("(destination -> source) closed by command (id: %d)\n", arg);
-                } else if (cmd == CMD_ACK) {
-                    cs[i]->state &= ~CS_STOPPED;
-                }
-                return;
+                // Queue grows, so this happens only when memory is exhausted.
+                // Peer would wait for the connection forever, so the tunnel is closed.
+                fprintf(stderr, "controller: on_command: command queue overflow\n");
+                return -1;
             }
+            return 1;
         }
+    } else if (conn == NULL) {
+        return 1;
+    } else if (cmd == CMD_CLOSE) {
+        conn->state |= CS_DELETE;
+        cm_schedule_close(c->manager, conn);
+        release_connection(c, conn);
+        printf("Connection closed by command (id: %u)\n", arg);
+    } else if (cmd == CMD_CLOSE_SRC_TO_DST) {
+        conn->out_state |= CS_DELETE;
+        cm_schedule_close(c->manager, conn);
+        printf("(source -> destination) closed by command (id: %u)\n", arg);
+    } else if (cmd == CMD_CLOSE_DST_TO_SRC) {
+        conn->in_state |= CS_DELETE;
+        cm_schedule_close(c->manager, conn);
+        printf("(destination -> source) closed by command (id: %u)\n", arg);
+    } else if (cmd == CMD_ACK) {
+        conn->state &= ~CS_STOPPED;
     }
+    return 1;
 }
 
-int accept_tunnel_connection(struct controller *controller, struct sockaddr_in *addr, size_t buf_size) {
+int listen_tunnel(struct sockaddr_in *addr, int backlog) {
     int ls = socket(AF_INET, SOCK_STREAM, 0);
     if (ls == -1) {
-        perror("accept_tunnel_connection: socket");
-        return 0;
+        perror("listen_tunnel: socket");
+        return -1;
     }
     if (bind(ls, (struct sockaddr *) addr, sizeof(struct sockaddr_in))) {
-        perror("accept_tunnel_connection: bind");
+        perror("listen_tunnel: bind");
         goto fail;
     }
-    if (listen(ls, 1)) {
-        perror("accept_tunnel_connection: listen");
+    if (listen(ls, backlog)) {
+        perror("listen_tunnel: listen");
         goto fail;
     }
+    return ls;
+
+    fail:
+    if (close(ls))
+        perror("listen_tunnel: close");
+    return -1;
+}
+
+int accept_tunnel_connection(struct controller *controller, int ls, size_t buf_size) {
     struct sockaddr_in tunnel_addr;
     socklen_t len = sizeof(tunnel_addr);
     int s = accept(ls, (struct sockaddr *) &tunnel_addr, &len);
     if (s == -1) {
         perror("accept_tunnel_connection: accept");
-        goto fail;
+        return 0;
     }
 
     struct connection *c = make_connection(&tunnel_addr, buf_size, buf_size, 0);
@@ -213,70 +357,100 @@ int accept_tunnel_connection(struct controller *controller, struct sockaddr_in *
         goto fail;
     }
 
-    cm_add_connection(controller->manager, c, s);
-
-    if (close(ls))
-        perror("accept_tunnel_connection: close");
+    if (cm_add_connection(controller->manager, c, s) == -1) {
+        fprintf(stderr, "accept_tunnel_connection: cm_add_connection failed\n");
+        free_connection(c);
+        goto fail;
+    }
+    // Table is empty yet, so it has enough space for the tunnel
+    table_insert(&controller->table, c);
     return 1;
 
     fail:
-    if (close(ls))
+    if (close(s))
         perror("accept_tunnel_connection: close");
     return 0;
 }
 
-struct controller *
-start_controller(size_t buf_size,
-                 int accepting,
-                 struct sockaddr_in *listen_addr,
-                 struct sockaddr_in *addr,
-                 int backlog) {
+struct controller *start_controller(const struct controller_config *config) {
     struct controller *c = malloc(sizeof(struct controller));
     if (c == NULL) {
         perror("start_controller: malloc");
         return NULL;
     }
 
-    struct pump *pump = make_pump(QUEUE_SIZE, on_command, c);
+    struct pump *pump = make_pump(QUEUE_SIZE, config->protocol, on_command, c);
     if (pump == NULL) {
         perror("start_controller: make_pump");
         goto pump_failed;
     }
+    if (config->compress)
+        pump_enable_compression(pump);
+    pump_set_coalescing(pump, config->min_frame_payload, config->max_delay);
 
     struct connection_manager *manager;
-    if (accepting)
-        manager = init_accepting_manager(listen_addr, buf_size, backlog);
+    struct sockaddr_in listen_addr = config->listen_addr;
+    if (config->accepting)
+        manager = init_accepting_manager(config->engine, &listen_addr, config->buf_size, config->backlog,
+                                         config->reuse_port);
     else
-        manager = init_manager();
+        manager = init_manager(config->engine);
 
     if (manager == NULL) {
         fprintf(stderr, "start_controller: Unable to create connection manager\n");
         goto manager_failed;
     }
+    cm_init_pools(manager, config->buf_size, config->lazy_buffers);
+    if (config->max_buf_size > config->buf_size)
+        cm_init_adaptive_buffers(manager, config->max_buf_size, config->budget);
 
     c->pump = pump;
     c->manager = manager;
-    c->address = *addr;
-    c->buf_size = buf_size;
-    c->accepting = accepting;
+    c->address = config->addr;
+    c->buf_size = config->buf_size;
+    c->accepting = config->accepting;
+    c->pending = 0;
+    c->metrics = config->metrics;
+    c->syscalls = 0;
+    c->priority = config->priority;
+    c->quantum = config->quantum != 0 ? config->quantum : DEFAULT_QUANTUM;
+    if (c->metrics != NULL) {
+        c->metrics->manager = manager;
+        cm_enable_stats(manager);
+    }
     id_stack_init(&c->free_ids);
-
-    size_t bs = buf_size * TUNNEL_BUF_SIZE_MULTIPLIER;
-    if (accepting) {
-        if (!cm_connect(manager, addr, bs, bs, 0)) {
+    table_init(&c->table);
+    conn_stack_init(&c->waiting);
+    if (!table_reserve(&c->table, 0))
+        goto tunnel_failed;
+
+    size_t bs = config->buf_size * TUNNEL_BUF_SIZE_MULTIPLIER;
+    if (config->accepting) {
+        struct connection *tunnel = cm_connect(manager, &c->address, bs, bs, 0);
+        if (tunnel == NULL) {
             fprintf(stderr, "start_controller: Cannot connect to server\n");
             goto tunnel_failed;
         }
+        table_insert(&c->table, tunnel);
     } else {
-        if (!accept_tunnel_connection(c, listen_addr, bs)) {
+        if (!accept_tunnel_connection(c, config->tunnel_listener, bs)) {
             fprintf(stderr, "start_controller: Cannot accept client connection\n");
             goto tunnel_failed;
         }
     }
 
+    // Frames are batched by the pump or by the kernel when the tunnel is corked.
+    // Nagle's algorithm would hold credit updates until the peer's delayed ACK.
+    struct connection *tunnel = c->table.items[0];
+    if (config->cork)
+        cm_cork(manager, tunnel, config->max_delay);
+    else
+        cm_set_nodelay(tunnel);
+
     return c;
 
     tunnel_failed:
+    table_free(&c->table);
     destroy_manager(manager);
 
     manager_failed:
@@ -293,39 +467,138 @@ void shutdown_controller(struct controller *c) {
     cm_shutdown(c->manager);
 }
 
+static void print_compression_stats(struct pump *pump) {
+    const struct compression_stats *s = pump_compression_stats(pump);
+    if (s->raw_bytes + s->rejected_bytes + s->bypassed_bytes > 0) {
+        printf("Compressed %llu bytes to %llu (ratio %.2f) in %.1f ms, "
+               "%llu bytes sent as is after a poor attempt, %llu bytes sent as is\n",
+               (unsigned long long) s->raw_bytes, (unsigned long long) s->compressed_bytes,
+               s->compressed_bytes ? (double) s->raw_bytes / s->compressed_bytes : 0.0, s->compress_ns / 1e6,
+               (unsigned long long) s->rejected_bytes, (unsigned long long) s->bypassed_bytes);
+    }
+    if (s->received_bytes > 0) {
+        printf("Decompressed %llu bytes to %llu in %.1f ms\n", (unsigned long long) s->received_bytes,
+               (unsigned long long) s->decompressed_bytes, s->decompress_ns / 1e6);
+    }
+}
+
 void destroy_controller(struct controller *c) {
     if (c == NULL)
         return;
 
+    print_compression_stats(c->pump);
     free_pump(c->pump);
     destroy_manager(c->manager);
+    id_stack_free(&c->free_ids);
+    table_free(&c->table);
+    conn_stack_free(&c->waiting);
     free(c);
 }
 
+/*
+ * Make the snapshot of streams for the metrics server.
+ */
+static void publish_streams(struct controller *controller) {
+    struct shard_metrics *m = controller->metrics;
+    char *text = NULL;
+    size_t length = 0;
+    FILE *f = open_memstream(&text, &length);
+    if (f == NULL) {
+        perror("publish_streams: open_memstream");
+        metrics_publish_streams(m, NULL, 0);
+        return;
+    }
+
+    uint64_t streams = 0;
+    struct conn_table *table = &controller->table;
+    for (size_t id = 1; id < table->count; id++) {
+        struct connection *c = table->items[id];
+        if (c == NULL)
+            continue;
+        streams++;
+        const char *names[] = {"received_bytes_total", "sent_bytes_total", "in_buffer_bytes", "out_buffer_bytes"};
+        uint64_t values[] = {c->bytes_received, c->bytes_sent, buf_data_length(c->in_buf), buf_data_length(c->out_buf)};
+        for (int i = 0; i < 4; i++) {
+            fprintf(f, "portfwd_stream_%s{shard=\"%d\",stream=\"%d\"} %llu\n",
+                    names[i], m->shard, c->id, (unsigned long long) values[i]);
+        }
+    }
+    metric_set(&m->streams, streams);
+    if (fclose(f)) {
+        perror("publish_streams: fclose");
+        free(text);
+        text = NULL;
+        length = 0;
+    }
+    metrics_publish_streams(m, text, length);
+}
+
+/*
+ * Copy counters of the manager and the pump to the metrics and sample the gauges, once per loop.
+ */
+static void publish_metrics(struct controller *controller) {
+    struct shard_metrics *m = controller->metrics;
+    const struct cm_stats *cs = cm_stats(controller->manager);
+    const struct frame_stats *fs = pump_frame_stats(controller->pump);
+    struct connection *tunnel = controller->table.items[0];
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    histogram_add(&m->loop_ns, now > cs->wakeup_ns ? now - cs->wakeup_ns : 0);
+    histogram_add(&m->loop_syscalls, cs->syscalls - controller->syscalls);
+    controller->syscalls = cs->syscalls;
+
+    metric_add(&m->loops, 1);
+    metric_set(&m->syscalls, cs->syscalls);
+    metric_set(&m->frames_encoded, fs->frames_encoded);
+    metric_set(&m->frames_decoded, fs->frames_decoded);
+    metric_set(&m->commands_encoded, fs->commands_encoded);
+    metric_set(&m->commands_decoded, fs->commands_decoded);
+
+    size_t queued = pump_cmd_queue_length(controller->pump);
+    metric_set(&m->cmd_queue_length, queued);
+    histogram_add(&m->cmd_queue_depth, queued);
+    if (tunnel != NULL) {
+        size_t out_length = buf_data_length(tunnel->out_buf);
+        metric_set(&m->tunnel_bytes_received, tunnel->bytes_received);
+        metric_set(&m->tunnel_bytes_sent, tunnel->bytes_sent);
+        metric_set(&m->tunnel_in_length, buf_data_length(tunnel->in_buf));
+        metric_set(&m->tunnel_out_length, out_length);
+        metric_set(&m->tunnel_in_capacity, buf_capacity(tunnel->in_buf));
+        metric_set(&m->tunnel_out_capacity, buf_capacity(tunnel->out_buf));
+        histogram_add(&m->tunnel_out_occupancy, out_length);
+    }
+}
+
 int update(struct controller *controller) {
-    int cause = cm_poll(controller->manager);
+    // Held frames are sent when the timeout expires
+    int timeout = controller->pending ? 0 : pump_timeout(controller->manager);
+    int cause = cm_poll(controller->manager, timeout);
     if (cause != CLOSE_CAUSE_NONE)
         return cause;
+    controller->pending = 0;
 
-    int count = 0;
-    struct connection *const *manager_connections = cm_get_connections(controller->manager, &count);
-    struct connection *connections[MAX_CONNECTIONS];
-    sort_connections(&controller->free_ids, manager_connections, connections, count);
-
-    if (count == 0) {
-        fprintf(stderr, "controller: no connections\n");
-        return CLOSE_CAUSE_NONE;
-    }
-    if (connections[0] == NULL) {
+    struct conn_table *table = &controller->table;
+    if (table->count == 0 || table->items[0] == NULL) {
         fprintf(stderr, "controller: no tunnel\n");
         return CLOSE_CAUSE_NONE;
     }
 
-    int state = handle_state_changes(controller, connections);
-    if (state == STATE_AGAIN) return CLOSE_CAUSE_NONE;
+    int state = handle_state_changes(controller);
     if (state == STATE_SHUTDOWN) return CLOSE_CAUSE_ERROR;
 
-    pump_transfer(controller->pump, connections);
+    // Data keeps flowing while state changes wait, they are handled by the next update
+    // (the command queue refuses commands only when it can't grow).
+    int pending = pump_transfer(controller->pump, controller->manager, table);
+    if (pending == -1) return CLOSE_CAUSE_ERROR;
+    controller->pending |= pending || state == STATE_AGAIN;
+
+    if (controller->metrics != NULL) {
+        if (metrics_streams_requested(controller->metrics))
+            publish_streams(controller);
+        publish_metrics(controller);
+    }
 
     return CLOSE_CAUSE_NONE;
 }
@@ -2,6 +2,7 @@
 #define CONTROLLER_H_INCLUDED
 
 #include "manager.h"
+#include "metrics.h"
 #include "pump.h"
 
 #define CMD_NEW 1
@@ -10,10 +11,53 @@
 #define CMD_CLOSE_DST_TO_SRC 4
 #define CMD_ACK 5
 
+// Value of CMD_NEW: priority class of the stream in the high byte and its quantum in the rest, 0 keeps the defaults
+#define NEW_PRIORITY_SHIFT 24
+#define NEW_QUANTUM_MASK 0xFFFFFF
+
 struct controller;
 
-struct controller *
-start_controller(size_t buf_size, int accepting, struct sockaddr_in *listen_addr, struct sockaddr_in *addr, int backlog);
+struct controller_config {
+    size_t buf_size;
+    // Client accepts service connections and connects to the server.
+    // Server accepts the tunnel and connects to the service.
+    int accepting;
+    struct sockaddr_in listen_addr;
+    struct sockaddr_in addr;
+    int backlog;
+    int engine;
+    int protocol;
+    // Listening socket the server accepts the tunnel from
+    int tunnel_listener;
+    // Client: several controllers accept service connections on the same port
+    int reuse_port;
+    // Buffers of service connections get storage only while they have data
+    int lazy_buffers;
+    // Data sent to the tunnel is compressed when the peer supports it
+    int compress;
+    // Frames with less payload are held for at most max_delay milliseconds, 0 disables coalescing
+    size_t min_frame_payload;
+    int max_delay;
+    // Tunnel socket is corked instead of sending small segments immediately
+    int cork;
+    // Buffers of service connections grow up to this size under the shared budget, 0 disables growth
+    size_t max_buf_size;
+    struct buffer_budget *budget;
+    // Metrics of the shard are published here, NULL disables them
+    struct shard_metrics *metrics;
+    // Client: priority class and quantum of accepted connections, see cm_queue_input.
+    // They are announced with CMD_NEW, so the server sends the data of the stream the same way.
+    uint8_t priority;
+    uint32_t quantum;
+};
+
+/*
+ * Create listening socket for tunnel connections.
+ * Returns -1 on failure.
+ */
+int listen_tunnel(struct sockaddr_in *addr, int backlog);
+
+struct controller *start_controller(const struct controller_config *config);
 
 void shutdown_controller(struct controller *c);
 
@@ -0,0 +1,162 @@
+#include "lz.h"
+
+#include <string.h>
+
+#define HASH_LOG 12
+#define MIN_MATCH 4
+// Matches are not searched close to the end of the input, it is left as literals
+#define LAST_LITERALS 5
+// Search step grows when no matches are found, so incompressible data is skipped faster
+#define SKIP_TRIGGER 6
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+/*
+ * Write length that doesn't fit into the token nibble. Returns new output position or 0 on overflow.
+ */
+static size_t put_length(uint8_t *dst, size_t op, size_t cap, size_t len) {
+    while (len >= 255) {
+        if (op >= cap)
+            return 0;
+        dst[op++] = 255;
+        len -= 255;
+    }
+    if (op >= cap)
+        return 0;
+    dst[op++] = len;
+    return op;
+}
+
+/*
+ * Put literals src[anchor..ip) followed by the match, match_len is 0 for the last sequence.
+ * Returns new output position or 0 on overflow.
+ */
+static size_t put_sequence(uint8_t *dst, size_t op, size_t cap, const uint8_t *literals, size_t lit_len,
+                           size_t offset, size_t match_len) {
+    if (op >= cap)
+        return 0;
+    size_t token = op++;
+    size_t ml = match_len > 0 ? match_len - MIN_MATCH : 0;
+    dst[token] = (lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15);
+    if (lit_len >= 15 && (op = put_length(dst, op, cap, lit_len - 15)) == 0)
+        return 0;
+    if (lit_len > cap - op)
+        return 0;
+    memcpy(dst + op, literals, lit_len);
+    op += lit_len;
+    if (match_len == 0)
+        return op;
+
+    if (cap - op < 2)
+        return 0;
+    dst[op++] = offset & 0xFF;
+    dst[op++] = offset >> 8;
+    if (ml >= 15 && (op = put_length(dst, op, cap, ml - 15)) == 0)
+        return 0;
+    return op;
+}
+
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    if (len > LZ_MAX_INPUT)
+        return 0;
+
+    // Positions are stored plus one, zero marks empty entry
+    uint16_t table[1 << HASH_LOG];
+    memset(table, 0, sizeof(table));
+
+    size_t ip = 0, anchor = 0, op = 0;
+    size_t limit = len > LAST_LITERALS + MIN_MATCH ? len - LAST_LITERALS - MIN_MATCH : 0;
+    while (ip < limit) {
+        uint32_t seq = read32(src + ip);
+        uint32_t h = hash(seq);
+        size_t ref = table[h];
+        table[h] = ip + 1;
+        if (ref == 0 || read32(src + ref - 1) != seq) {
+            ip += 1 + ((ip - anchor) >> SKIP_TRIGGER);
+            continue;
+        }
+        ref--;
+
+        // Extend the match backwards over literals and forwards
+        while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+            ip--;
+            ref--;
+        }
+        size_t match_len = MIN_MATCH;
+        while (ip + match_len < len - LAST_LITERALS && src[ip + match_len] == src[ref + match_len])
+            match_len++;
+
+        op = put_sequence(dst, op, cap, src + anchor, ip - anchor, ip - ref, match_len);
+        if (op == 0)
+            return 0;
+        ip += match_len;
+        anchor = ip;
+    }
+
+    op = put_sequence(dst, op, cap, src + anchor, len - anchor, 0, 0);
+    return op;
+}
+
+/*
+ * Read length continued after the token nibble. Returns -1 if input is truncated.
+ */
+static ssize_t get_length(const uint8_t *src, size_t len, size_t *ip, size_t base) {
+    uint8_t b;
+    do {
+        if (*ip >= len)
+            return -1;
+        b = src[(*ip)++];
+        base += b;
+    } while (b == 255 && base <= LZ_MAX_INPUT);
+    return base;
+}
+
+ssize_t lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    size_t ip = 0, op = 0;
+    while (ip < len) {
+        uint8_t token = src[ip++];
+
+        ssize_t lit_len = token >> 4;
+        if (lit_len == 15 && (lit_len = get_length(src, len, &ip, lit_len)) == -1)
+            return -1;
+        if ((size_t) lit_len > len - ip || (size_t) lit_len > cap - op)
+            return -1;
+        memcpy(dst + op, src + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == len)
+            break;
+
+        if (len - ip < 2)
+            return -1;
+        size_t offset = src[ip] | (size_t) src[ip + 1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op)
+            return -1;
+        ssize_t match_len = token & 15;
+        if (match_len == 15 && (match_len = get_length(src, len, &ip, match_len)) == -1)
+            return -1;
+        match_len += MIN_MATCH;
+        if ((size_t) match_len > cap - op)
+            return -1;
+
+        // Source and destination overlap when the offset is less than the length
+        const uint8_t *ref = dst + op - offset;
+        if (offset >= (size_t) match_len) {
+            memcpy(dst + op, ref, match_len);
+        } else {
+            for (ssize_t i = 0; i < match_len; i++)
+                dst[op + i] = ref[i];
+        }
+        op += match_len;
+    }
+    return op;
+}
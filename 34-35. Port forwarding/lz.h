@@ -0,0 +1,27 @@
+#ifndef LZ_H_INCLUDED
+#define LZ_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h> // ssize_t
+
+/*
+ * Fast LZ77 codec with the block format similar to LZ4.
+ * Block is a sequence of token byte (literal length in the high nibble, match length - 4 in the low one),
+ * extra length bytes when a nibble is 15, literals and 2-byte little-endian match offset.
+ * The last sequence has literals only.
+ */
+#define LZ_MAX_INPUT 0xFFFF
+
+/*
+ * Compress len bytes (at most LZ_MAX_INPUT) from src to dst.
+ * Returns size of the compressed block or 0 if it doesn't fit into cap bytes.
+ */
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+/*
+ * Returns size of the decompressed data or -1 if the block is malformed or doesn't fit into cap bytes.
+ */
+ssize_t lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+#endif
@@ -3,12 +3,30 @@
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h> // INT_MAX
+#include <stdint.h> // SIZE_MAX
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h> // SOMAXCONN
+#include <unistd.h> // getopt
 
 static const int buffer_size = 10240;
-struct controller *controller = NULL;
+#define MAX_SHARDS 64
+
+// Each shard is served by its own thread with its own tunnel
+struct shard {
+    struct controller *controller;
+    pthread_t thread;
+};
+
+struct shard shards[MAX_SHARDS];
+int shards_count = 1;
+// Metrics of the shards, served on the Unix domain socket at metrics_path
+struct shard_metrics metrics[MAX_SHARDS];
+const char *metrics_path = NULL;
 
 int parse_port(const char *str, in_port_t *res) {
     char *end;
@@ -20,16 +38,143 @@ int parse_port(const char *str, in_port_t *res) {
     return 0;
 }
 
+/*
+ * Parse the whole string as a decimal number without sign. Returns -1 on failure.
+ */
+int parse_number(const char *str, unsigned long *res) {
+    char *end;
+    errno = 0;
+    unsigned long r = strtoul(str, &end, 10);
+    // strtoul skips spaces and negates numbers with minus
+    if (errno != 0 || str[0] < '0' || str[0] > '9' || *end != '\0')
+        return -1;
+    *res = r;
+    return 0;
+}
+
 void print_usage_and_exit() {
-    fprintf(stderr, "USAGE: portfwd (server|client) <listen-port> <target-ip> <target-port>");
+    fprintf(stderr, "USAGE: portfwd [-e poll|epoll|uring] [-p 1|2|3|4|5|6] [-t threads] [-l] [-c] [-m min-frame-payload] [-d max-delay-ms] [-k] [-b max-buffer-size] [-B budget-mb] [-M metrics-socket] [-P priority-class] [-q quantum] (server|client) <listen-port> <target-ip> <target-port>\n");
     exit(1);
 }
 
 int is_server;
+int engine = DEFAULT_ENGINE;
+int protocol = PROTOCOL_BATCHED;
+int lazy_buffers = 0;
+int compress = 0;
+size_t min_frame_payload = 0;
+int max_delay = 1;
+int cork = 0;
+size_t max_buf_size = 0;
+struct buffer_budget budget = {.limit = 64 << 20};
+int priority = 0;
+unsigned long quantum = DEFAULT_QUANTUM;
 struct sockaddr_in listen_addr;
 struct sockaddr_in dst_address;
 
 void parse_args(int argc, char *const argv[]) {
+    int opt;
+    unsigned long number;
+    while ((opt = getopt(argc, argv, "+e:p:t:lcm:d:kb:B:M:P:q:")) != -1) {
+        switch (opt) {
+            case 'e':
+                if (strcmp(optarg, "poll") == 0) {
+                    engine = ENGINE_POLL;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    engine = ENGINE_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    engine = ENGINE_URING;
+                } else {
+                    fprintf(stderr, "unknown engine \"%s\"\n", optarg);
+                    print_usage_and_exit();
+                }
+                break;
+            case 'p':
+                if (strcmp(optarg, "1") == 0) {
+                    protocol = PROTOCOL_STUFFED;
+                } else if (strcmp(optarg, "2") == 0) {
+                    protocol = PROTOCOL_BINARY;
+                } else if (strcmp(optarg, "3") == 0) {
+                    protocol = PROTOCOL_CREDIT;
+                } else if (strcmp(optarg, "4") == 0) {
+                    protocol = PROTOCOL_COMPRESSED;
+                } else if (strcmp(optarg, "5") == 0) {
+                    protocol = PROTOCOL_ADAPTIVE;
+                } else if (strcmp(optarg, "6") == 0) {
+                    protocol = PROTOCOL_BATCHED;
+                } else {
+                    fprintf(stderr, "unknown protocol version \"%s\"\n", optarg);
+                    print_usage_and_exit();
+                }
+                break;
+            case 't':
+                shards_count = atoi(optarg);
+                if (shards_count < 1 || shards_count > MAX_SHARDS) {
+                    fprintf(stderr, "number of threads must be from 1 to %d\n", MAX_SHARDS);
+                    print_usage_and_exit();
+                }
+                break;
+            case 'l':
+                lazy_buffers = 1;
+                break;
+            case 'c':
+                compress = 1;
+                break;
+            case 'm':
+                if (parse_number(optarg, &number) == -1 || number > (unsigned long) buffer_size) {
+                    fprintf(stderr, "minimal frame payload must be from 0 to the buffer size %d\n", buffer_size);
+                    print_usage_and_exit();
+                }
+                min_frame_payload = number;
+                break;
+            case 'd':
+                max_delay = atoi(optarg);
+                if (max_delay < 1) {
+                    fprintf(stderr, "maximal delay must be at least 1 ms\n");
+                    print_usage_and_exit();
+                }
+                break;
+            case 'k':
+                cork = 1;
+                break;
+            case 'b':
+                // Capacity of round buffers is an int
+                if (parse_number(optarg, &number) == -1 || number < (unsigned long) buffer_size || number > INT_MAX) {
+                    fprintf(stderr, "maximal buffer size must be from %d to %d\n", buffer_size, INT_MAX);
+                    print_usage_and_exit();
+                }
+                max_buf_size = number;
+                break;
+            case 'B':
+                if (parse_number(optarg, &number) == -1 || number == 0 || number > SIZE_MAX >> 20) {
+                    fprintf(stderr, "buffer budget must be from 1 to %zu megabytes\n", (size_t) (SIZE_MAX >> 20));
+                    print_usage_and_exit();
+                }
+                budget.limit = (size_t) number << 20;
+                break;
+            case 'M':
+                metrics_path = optarg;
+                break;
+            case 'P':
+                if (parse_number(optarg, &number) == -1 || number >= PRIORITY_CLASSES) {
+                    fprintf(stderr, "priority class must be from 0 to %d\n", PRIORITY_CLASSES - 1);
+                    print_usage_and_exit();
+                }
+                priority = (int) number;
+                break;
+            case 'q':
+                if (parse_number(optarg, &quantum) == -1 || quantum == 0 || quantum > NEW_QUANTUM_MASK) {
+                    fprintf(stderr, "quantum must be from 1 to %d bytes\n", NEW_QUANTUM_MASK);
+                    print_usage_and_exit();
+                }
+                break;
+            default:
+                print_usage_and_exit();
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
     if (argc != 5) {
         print_usage_and_exit();
     }
@@ -72,9 +217,15 @@ void parse_args(int argc, char *const argv[]) {
     dst_address.sin_addr = target_ip_addr;
 }
 
+void shutdown_shards() {
+    for (int i = 0; i < shards_count; i++) {
+        if (shards[i].controller != NULL)
+            shutdown_controller(shards[i].controller);
+    }
+}
+
 void termination_signal_handler(int sig) {
-    if (controller != NULL)
-        shutdown_controller(controller);
+    shutdown_shards();
 }
 
 void setup_signals() {
@@ -91,35 +242,130 @@ void setup_signals() {
     sigaction(SIGPIPE, &action, NULL);
 }
 
-int main(int argc, char *const argv[]) {
-    parse_args(argc, argv);
-    setup_signals();
-
-    printf("Starting controller...\n");
-    if (is_server)
-        controller = start_controller(buffer_size, 0, &listen_addr, &dst_address, -1);
-    else
-        controller = start_controller(buffer_size, 1, &listen_addr, &dst_address, 10);
-    printf("Controller started\n");
-    if (controller == NULL) {
-        fprintf(stderr, "Start failed\n");
-        return 1;
+/*
+ * Each forwarded connection needs a descriptor, so use as many as allowed.
+ */
+void raise_descriptor_limit() {
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == -1) {
+        perror("getrlimit");
+        return;
     }
+    lim.rlim_cur = lim.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &lim) == -1)
+        perror("setrlimit");
+}
 
+void *run_shard(void *arg) {
+    struct shard *shard = arg;
 #define ever (;;)
     for ever {
-        int close_cause = update(controller);
+        int close_cause = update(shard->controller);
         if (close_cause == CLOSE_CAUSE_USER) {
             fprintf(stderr, "Controller stopped\n");
             break;
         }
         if (close_cause == CLOSE_CAUSE_ERROR) {
             fprintf(stderr, "Something went wrong\n");
+            // Process can't work without one of the tunnels
+            shutdown_shards();
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Start controllers of all shards. Server accepts all tunnels from the single listening socket.
+ */
+int start_shards() {
+    struct controller_config config;
+    memset(&config, 0, sizeof(config));
+    config.buf_size = buffer_size;
+    config.accepting = !is_server;
+    config.listen_addr = listen_addr;
+    config.addr = dst_address;
+    config.backlog = SOMAXCONN;
+    config.engine = engine;
+    config.protocol = protocol;
+    config.tunnel_listener = -1;
+    config.reuse_port = shards_count > 1;
+    config.lazy_buffers = lazy_buffers;
+    config.compress = compress;
+    config.min_frame_payload = min_frame_payload;
+    config.max_delay = max_delay;
+    config.cork = cork;
+    config.max_buf_size = max_buf_size;
+    config.budget = &budget;
+    config.priority = priority;
+    config.quantum = quantum;
+
+    if (is_server) {
+        config.tunnel_listener = listen_tunnel(&listen_addr, shards_count);
+        if (config.tunnel_listener == -1)
+            return 0;
+    }
+
+    int ok = 1;
+    for (int i = 0; i < shards_count && ok; i++) {
+        if (metrics_path != NULL) {
+            metrics_init(&metrics[i], i);
+            config.metrics = &metrics[i];
+        }
+        shards[i].controller = start_controller(&config);
+        ok = shards[i].controller != NULL;
+    }
+
+    if (config.tunnel_listener != -1 && close(config.tunnel_listener))
+        perror("close");
+    return ok;
+}
+
+void destroy_shards() {
+    for (int i = 0; i < shards_count; i++) {
+        destroy_controller(shards[i].controller);
+        shards[i].controller = NULL;
+        if (metrics_path != NULL)
+            metrics_destroy(&metrics[i]);
+    }
+}
+
+int main(int argc, char *const argv[]) {
+    parse_args(argc, argv);
+    setup_signals();
+    raise_descriptor_limit();
+
+    printf("Starting controller...\n");
+    if (!start_shards()) {
+        fprintf(stderr, "Start failed\n");
+        destroy_shards();
+        return 1;
+    }
+    printf("Controller started\n");
+
+    struct metrics_server *server = NULL;
+    if (metrics_path != NULL && (server = start_metrics_server(metrics_path, metrics, shards_count)) == NULL)
+        fprintf(stderr, "Metrics are not served\n");
+
+    // All shards are destroyed, but only the started threads are joined
+    int threads_count = 1;
+    for (int i = 1; i < shards_count; i++) {
+        int err = pthread_create(&shards[i].thread, NULL, run_shard, &shards[i]);
+        if (err) {
+            errno = err;
+            perror("pthread_create");
+            shutdown_shards();
             break;
         }
+        threads_count++;
     }
+    // First shard is served by the main thread
+    run_shard(&shards[0]);
+    for (int i = 1; i < threads_count; i++)
+        pthread_join(shards[i].thread, NULL);
 
+    stop_metrics_server(server);
     printf("Destroying controller\n");
-    destroy_controller(controller);
+    destroy_shards();
     return 0;
 }
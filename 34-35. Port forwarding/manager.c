@@ -1,36 +1,142 @@
 #include "manager.h"
+#include "uring.h"
 
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <poll.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#define MAX_DESCRIPTORS 1024
-#define MAX_CONNECTIONS (MAX_DESCRIPTORS - 2)
+#define INITIAL_CAPACITY 64
+// Connections and buffers are taken from the system in slabs of this many objects
+#define POOL_SLAB_OBJECTS 64
+// Kernel allows at most 16384 registered buffers, two per connection
+#define FIXED_BUFFER_SLOTS 8192
 #define ACCEPTOR_INDEX 0
 #define PIPE_INDEX 1
+#define MAX_EVENTS 256
+#define URING_ENTRIES 1024
+// Grown buffers are checked for idleness this often (ms)
+#define SHRINK_INTERVAL 1000
+
+#define IO_READABLE ((uint16_t)1)
+#define IO_WRITABLE ((uint16_t)2)
+#define IO_QUEUED ((uint16_t)4)
+#define IO_HUP ((uint16_t)8)
+#define IO_RECV_PENDING ((uint16_t)16)
+#define IO_SEND_PENDING ((uint16_t)32)
+#define IO_CHANGED ((uint16_t)64)
+#define IO_CONNECT_PENDING ((uint16_t)128)
+#define IO_INPUT_QUEUED ((uint16_t)256)
+#define IO_DEAD ((uint16_t)512)
+#define IO_DEFERRED ((uint16_t)1024)
+#define IO_GROWN ((uint16_t)2048)
+
+// io_uring user_data values. Operations on connections are tagged with
+// the connection pointer combined with the operation code in the lower bits.
+#define TAG_ACCEPT 1
+#define TAG_PIPE 2
+#define TAG_CANCEL 3
+#define TAG_TIMEOUT 4
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_CONNECT 3
+#define OP_MASK 3
+
+// epoll data of the pipe and the listening socket
+static char pipe_tag, acceptor_tag;
 
 struct connection_manager {
+    int engine;
     size_t buf_size;
-    size_t connections_count;
+    // Slots below this index are in use or free, free slots are listed in free_indices.
+    size_t slots_count;
     int pipe;
-    struct pollfd fds[MAX_DESCRIPTORS];
-    struct connection *connections[MAX_CONNECTIONS];
+    int epoll_fd;
+    int acceptor_ready;
+    // Connections with readiness not consumed yet (epoll engine) or
+    // connections that need new operations to be submitted (io_uring engine).
+    struct connection *ready;
+    // Connections not seen by the controller since their last change
+    struct connection *changed;
+    // Input queues of priority classes, see cm_queue_input
+    struct connection *input_head[PRIORITY_CLASSES];
+    struct connection *input_tail[PRIORITY_CLASSES];
+    // Connections to be closed, shut down or freed, see close_sockets
+    struct connection *dead;
+    // Deferred queue, see cm_defer_input
+    struct connection *defer_head;
+    struct connection *defer_tail;
+    // Corked connection, time (ms) its partial segment has to be pushed at or 0 if nothing is written since the push
+    struct connection *corked;
+    int push_delay;
+    uint64_t push_deadline;
+    // Time (ms) the io_uring timeout is armed for or 0
+    uint64_t timer_deadline;
+    // Adaptive buffers, see cm_init_adaptive_buffers
+    size_t max_buf_size;
+    struct buffer_budget *budget;
+    struct connection *grown;
+    // Time (ms) of the next check of grown buffers
+    uint64_t shrink_deadline;
+    struct cm_stats stats;
+    // Time of the wakeup is recorded, see cm_enable_stats
+    int timed;
+    struct uring *ring;
+    // Buffers of connections are registered in the ring when this is set.
+    int fixed_buffers;
+    uint8_t pipe_cause;
+    int free_slots_count;
+    int free_slots[FIXED_BUFFER_SLOTS];
+    // Arrays below grow together, fds has two additional entries for the acceptor and the pipe.
+    // Connection keeps its slot until it is freed, free slot has NULL connection and negative fd.
+    size_t capacity;
+    struct pollfd *fds;
+    struct connection **connections;
+    int *free_indices;
+    size_t free_count;
+    // Connections with buffers of pooled size are allocated from the pools, see cm_init_pools
+    size_t pooled_size;
+    int lazy_buffers;
+    struct pool conn_pool;
+    struct buf_pool buf_pool;
 };
 
 #define cm_conn_fd(cm, i) ((cm)->fds[2 + (i)])
 
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Count the call that waits for events and remember when it returned.
+ */
+static void note_wakeup(struct connection_manager *cm) {
+    cm->stats.syscalls++;
+    if (cm->timed) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        cm->stats.wakeup_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+}
+
 int is_alive(uint8_t state) {
     return !(state & (CS_EOF | CS_CLOSED | CS_DELETE));
 }
 
 int is_stopped(uint8_t state) {
-    return state & CS_STOPPED;
+    return state & (CS_STOPPED | CS_CONNECTING);
 }
 
 static int is_closed(uint8_t state) {
@@ -41,7 +147,22 @@ static int should_close(uint8_t state) {
     return state & (CS_EOF | CS_DELETE);
 }
 
+/*
+ * Connections and directions marked for deletion still send buffered data.
+ */
+static int can_flush(uint8_t state) {
+    return !(state & (CS_EOF | CS_CLOSED));
+}
+
+static int output_flushed(struct connection *c) {
+    return buf_empty(c->out_buf) || !can_flush(c->out_state) || !can_flush(c->state);
+}
+
 static int should_close_socket(struct connection *c) {
+    if (c->state & CS_EOF)
+        return 1;
+    if (!output_flushed(c))
+        return 0;
     return should_close(c->state) ||
            (!is_alive(c->in_state) && !is_alive(c->out_state));
 }
@@ -50,17 +171,70 @@ static int should_delete(uint8_t state) {
     return (state & CS_DELETE) && (state & CS_CLOSED);
 }
 
+static void init_connection(
+        struct connection *c,
+        struct sockaddr_in *addr,
+        struct round_buffer *in_buf,
+        struct round_buffer *out_buf,
+        int id) {
+    c->id = id;
+    c->fd = -1;
+    c->state = 0;
+    c->in_state = 0;
+    c->out_state = 0;
+    c->address = *addr;
+    c->in_buf = in_buf;
+    c->out_buf = out_buf;
+    c->tx_credit = 0;
+    c->rx_granted = 0;
+    c->credit_blocked = 0;
+    c->bytes_received = 0;
+    c->bytes_sent = 0;
+    c->compress_skip = 0;
+    c->compress_failures = 0;
+    c->events = 0;
+    c->buf_slot = -1;
+    c->ready_prev = NULL;
+    c->ready_next = NULL;
+    c->changed_prev = NULL;
+    c->changed_next = NULL;
+    c->input_prev = NULL;
+    c->input_next = NULL;
+    c->priority = 0;
+    c->quantum = DEFAULT_QUANTUM;
+    c->deficit = 0;
+    c->dead_prev = NULL;
+    c->dead_next = NULL;
+    c->defer_prev = NULL;
+    c->defer_next = NULL;
+    c->defer_deadline = 0;
+    c->grown_prev = NULL;
+    c->grown_next = NULL;
+    c->shrink_output = 0;
+    c->index = -1;
+    c->pooled = 0;
+}
+
+/*
+ * Connections created outside of the pools (the tunnel) get mirrored buffers,
+ * so frames are encoded and decoded without splitting at the buffer end.
+ */
+static struct round_buffer *create_buffer(size_t capacity) {
+    struct round_buffer *buf = buf_create_mirrored(capacity);
+    return buf != NULL ? buf : buf_create(capacity);
+}
+
 struct connection *make_connection(
         struct sockaddr_in *addr,
         size_t in_buf_size,
         size_t out_buf_size,
         int id) {
-    struct round_buffer *in_buf = buf_create(in_buf_size);
+    struct round_buffer *in_buf = create_buffer(in_buf_size);
     if (in_buf == NULL) {
         perror("make_connection: buf_create");
         return NULL;
     }
-    struct round_buffer *out_buf = buf_create(out_buf_size);
+    struct round_buffer *out_buf = create_buffer(out_buf_size);
     if (out_buf == NULL) {
         perror("make_connection: buf_create");
         buf_destroy(in_buf);
@@ -74,88 +248,691 @@ struct connection *make_connection(
         return NULL;
     }
 
-    c->id = id;
-    c->state = 0;
-    c->in_state = 0;
-    c->out_state = 0;
-    c->address = *addr;
-    c->in_buf = in_buf;
-    c->out_buf = out_buf;
-
+    init_connection(c, addr, in_buf, out_buf, id);
     return c;
 }
 
-static void free_connection(struct connection *c) {
+void free_connection(struct connection *c) {
     buf_destroy(c->in_buf);
     buf_destroy(c->out_buf);
     free(c);
 }
 
+void cm_init_pools(struct connection_manager *cm, size_t buf_size, int lazy_buffers) {
+    if (cm->pooled_size != 0)
+        return;
+    // Registered buffers and pending receives need storage all the time
+    if (lazy_buffers && cm->engine == ENGINE_URING) {
+        fprintf(stderr, "cm_init_pools: lazy buffers are not used by io_uring engine\n");
+        lazy_buffers = 0;
+    }
+    cm->pooled_size = buf_size;
+    cm->lazy_buffers = lazy_buffers;
+    pool_init(&cm->conn_pool, sizeof(struct connection), POOL_SLAB_OBJECTS);
+    buf_pool_init(&cm->buf_pool, buf_size, POOL_SLAB_OBJECTS);
+}
+
+void cm_init_adaptive_buffers(struct connection_manager *cm, size_t max_size, struct buffer_budget *budget) {
+    if (cm->engine == ENGINE_URING) {
+        fprintf(stderr, "cm_init_adaptive_buffers: buffers are not resized by io_uring engine\n");
+        return;
+    }
+    cm->max_buf_size = max_size;
+    cm->budget = budget;
+}
+
+static void grown_push(struct connection_manager *cm, struct connection *c) {
+    if (c->events & IO_GROWN)
+        return;
+    c->events |= IO_GROWN;
+    c->grown_prev = NULL;
+    c->grown_next = cm->grown;
+    if (cm->grown != NULL)
+        cm->grown->grown_prev = c;
+    cm->grown = c;
+}
+
+static void grown_remove(struct connection_manager *cm, struct connection *c) {
+    if (!(c->events & IO_GROWN))
+        return;
+    c->events &= ~IO_GROWN;
+    if (c->grown_prev != NULL)
+        c->grown_prev->grown_next = c->grown_next;
+    else
+        cm->grown = c->grown_next;
+    if (c->grown_next != NULL)
+        c->grown_next->grown_prev = c->grown_prev;
+    c->grown_prev = NULL;
+    c->grown_next = NULL;
+}
+
+static int take_budget(struct buffer_budget *budget, size_t size) {
+    size_t used = __atomic_load_n(&budget->used, __ATOMIC_RELAXED);
+    do {
+        if (used + size > budget->limit)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&budget->used, &used, used + size, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+static void return_budget(struct buffer_budget *budget, size_t size) {
+    __atomic_fetch_sub(&budget->used, size, __ATOMIC_RELAXED);
+}
+
+int cm_grow_buffer(struct connection_manager *cm, struct connection *c, struct round_buffer *buf) {
+    size_t capacity = buf_capacity(buf);
+    if (cm->max_buf_size <= capacity || !c->pooled)
+        return 0;
+    size_t grown = 2 * capacity < cm->max_buf_size ? 2 * capacity : cm->max_buf_size;
+    if (!take_budget(cm->budget, grown - capacity))
+        return 0;
+    if (!buf_resize(buf, grown)) {
+        return_budget(cm->budget, grown - capacity);
+        return 0;
+    }
+    grown_push(cm, c);
+    if (cm->shrink_deadline == 0)
+        cm->shrink_deadline = now_ms() + SHRINK_INTERVAL;
+    return 1;
+}
+
+int cm_shrink_buffer(struct connection_manager *cm, struct connection *c, struct round_buffer *buf, size_t reserved) {
+    size_t capacity = buf_capacity(buf);
+    if (capacity <= cm->pooled_size || !c->pooled)
+        return 0;
+    size_t shrunk = capacity / 2 > cm->pooled_size ? capacity / 2 : cm->pooled_size;
+    if (buf_data_length(buf) + reserved > shrunk || !buf_resize(buf, shrunk))
+        return 0;
+    return_budget(cm->budget, capacity - shrunk);
+    if (buf_capacity(c->in_buf) == (int) cm->pooled_size && buf_capacity(c->out_buf) == (int) cm->pooled_size)
+        grown_remove(cm, c);
+    return 1;
+}
+
+/*
+ * Shrink grown buffers that were not filled above a quarter since the previous check.
+ * Output buffer has to keep room for the credit granted to the peer,
+ * such connections are reported to the controller, which asks the peer to return the credit.
+ */
+static void shrink_idle_buffers(struct connection_manager *cm) {
+    if (cm->shrink_deadline == 0 || now_ms() < cm->shrink_deadline)
+        return;
+    struct connection *c = cm->grown;
+    while (c != NULL) {
+        struct connection *next = c->grown_next;
+        if (buf_take_peak(c->in_buf) < (size_t) buf_capacity(c->in_buf) / 4)
+            cm_shrink_buffer(cm, c, c->in_buf, 0);
+        if (buf_take_peak(c->out_buf) < (size_t) buf_capacity(c->out_buf) / 4 &&
+            !cm_shrink_buffer(cm, c, c->out_buf, c->rx_granted) &&
+            buf_capacity(c->out_buf) > (int) cm->pooled_size && !c->shrink_output) {
+            c->shrink_output = 1;
+            cm_mark_changed(cm, c);
+        }
+        c = next;
+    }
+    cm->shrink_deadline = cm->grown != NULL ? now_ms() + SHRINK_INTERVAL : 0;
+}
+
+/*
+ * Same as make_connection, but the connection with buffers of pooled size
+ * is taken from the pools of the manager.
+ */
+static struct connection *alloc_connection(
+        struct connection_manager *cm,
+        struct sockaddr_in *addr,
+        size_t in_buf_size,
+        size_t out_buf_size,
+        int id) {
+    if (cm->pooled_size == 0 || in_buf_size != cm->pooled_size || out_buf_size != cm->pooled_size)
+        return make_connection(addr, in_buf_size, out_buf_size, id);
+
+    struct round_buffer *in_buf = buf_create_pooled(&cm->buf_pool, cm->lazy_buffers);
+    if (in_buf == NULL) {
+        fprintf(stderr, "alloc_connection: buf_create_pooled failed\n");
+        return NULL;
+    }
+    struct round_buffer *out_buf = buf_create_pooled(&cm->buf_pool, cm->lazy_buffers);
+    if (out_buf == NULL) {
+        fprintf(stderr, "alloc_connection: buf_create_pooled failed\n");
+        buf_destroy(in_buf);
+        return NULL;
+    }
+    struct connection *c = pool_alloc(&cm->conn_pool);
+    if (c == NULL) {
+        fprintf(stderr, "alloc_connection: pool_alloc failed\n");
+        buf_destroy(in_buf);
+        buf_destroy(out_buf);
+        return NULL;
+    }
+
+    init_connection(c, addr, in_buf, out_buf, id);
+    c->pooled = 1;
+    return c;
+}
+
+static void release_connection(struct connection_manager *cm, struct connection *c) {
+    if (!c->pooled) {
+        free_connection(c);
+        return;
+    }
+    buf_destroy(c->in_buf);
+    buf_destroy(c->out_buf);
+    pool_free(&cm->conn_pool, c);
+}
+
+static void ready_push(struct connection_manager *cm, struct connection *c) {
+    if (c->events & IO_QUEUED)
+        return;
+    c->events |= IO_QUEUED;
+    c->ready_prev = NULL;
+    c->ready_next = cm->ready;
+    if (cm->ready != NULL)
+        cm->ready->ready_prev = c;
+    cm->ready = c;
+}
+
+static void ready_remove(struct connection_manager *cm, struct connection *c) {
+    if (!(c->events & IO_QUEUED))
+        return;
+    c->events &= ~IO_QUEUED;
+    if (c->ready_prev != NULL)
+        c->ready_prev->ready_next = c->ready_next;
+    else
+        cm->ready = c->ready_next;
+    if (c->ready_next != NULL)
+        c->ready_next->ready_prev = c->ready_prev;
+    c->ready_prev = NULL;
+    c->ready_next = NULL;
+}
+
+void cm_mark_changed(struct connection_manager *cm, struct connection *c) {
+    if (c->events & IO_CHANGED)
+        return;
+    c->events |= IO_CHANGED;
+    c->changed_prev = NULL;
+    c->changed_next = cm->changed;
+    if (cm->changed != NULL)
+        cm->changed->changed_prev = c;
+    cm->changed = c;
+}
+
+static void changed_remove(struct connection_manager *cm, struct connection *c) {
+    if (!(c->events & IO_CHANGED))
+        return;
+    c->events &= ~IO_CHANGED;
+    if (c->changed_prev != NULL)
+        c->changed_prev->changed_next = c->changed_next;
+    else
+        cm->changed = c->changed_next;
+    if (c->changed_next != NULL)
+        c->changed_next->changed_prev = c->changed_prev;
+    c->changed_prev = NULL;
+    c->changed_next = NULL;
+}
+
+struct connection *cm_pop_changed(struct connection_manager *cm) {
+    struct connection *c = cm->changed;
+    if (c != NULL)
+        changed_remove(cm, c);
+    return c;
+}
+
+void cm_queue_input(struct connection_manager *cm, struct connection *c) {
+    if (c->events & IO_INPUT_QUEUED)
+        return;
+    c->events |= IO_INPUT_QUEUED;
+    c->input_prev = cm->input_tail[c->priority];
+    c->input_next = NULL;
+    if (cm->input_tail[c->priority] != NULL)
+        cm->input_tail[c->priority]->input_next = c;
+    else
+        cm->input_head[c->priority] = c;
+    cm->input_tail[c->priority] = c;
+}
+
+void cm_dequeue_input(struct connection_manager *cm, struct connection *c) {
+    if (!(c->events & IO_INPUT_QUEUED))
+        return;
+    c->events &= ~IO_INPUT_QUEUED;
+    if (c->input_prev != NULL)
+        c->input_prev->input_next = c->input_next;
+    else
+        cm->input_head[c->priority] = c->input_next;
+    if (c->input_next != NULL)
+        c->input_next->input_prev = c->input_prev;
+    else
+        cm->input_tail[c->priority] = c->input_prev;
+    c->input_prev = NULL;
+    c->input_next = NULL;
+}
+
+struct connection *cm_input_head(struct connection_manager *cm) {
+    for (int i = 0; i < PRIORITY_CLASSES; i++) {
+        if (cm->input_head[i] != NULL)
+            return cm->input_head[i];
+    }
+    return NULL;
+}
+
+void cm_set_priority(struct connection_manager *cm, struct connection *c, uint8_t priority) {
+    int queued = c->events & IO_INPUT_QUEUED;
+    cm_dequeue_input(cm, c);
+    c->priority = priority < PRIORITY_CLASSES ? priority : PRIORITY_CLASSES - 1;
+    if (queued)
+        cm_queue_input(cm, c);
+}
+
+void cm_defer_input(struct connection_manager *cm, struct connection *c) {
+    if (c->events & IO_DEFERRED)
+        return;
+    c->events |= IO_DEFERRED;
+    c->defer_prev = cm->defer_tail;
+    c->defer_next = NULL;
+    if (cm->defer_tail != NULL)
+        cm->defer_tail->defer_next = c;
+    else
+        cm->defer_head = c;
+    cm->defer_tail = c;
+}
+
+void cm_undefer_input(struct connection_manager *cm, struct connection *c) {
+    if (!(c->events & IO_DEFERRED))
+        return;
+    c->events &= ~IO_DEFERRED;
+    if (c->defer_prev != NULL)
+        c->defer_prev->defer_next = c->defer_next;
+    else
+        cm->defer_head = c->defer_next;
+    if (c->defer_next != NULL)
+        c->defer_next->defer_prev = c->defer_prev;
+    else
+        cm->defer_tail = c->defer_prev;
+    c->defer_prev = NULL;
+    c->defer_next = NULL;
+}
+
+struct connection *cm_deferred_head(struct connection_manager *cm) {
+    return cm->defer_head;
+}
+
+int cm_set_nodelay(struct connection *c) {
+    int one = 1;
+    if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1) {
+        perror("cm_set_nodelay: setsockopt");
+        return 0;
+    }
+    return 1;
+}
+
+int cm_cork(struct connection_manager *cm, struct connection *c, int push_delay) {
+    int one = 1;
+    if (setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &one, sizeof(one)) == -1) {
+        perror("cm_cork: setsockopt");
+        return 0;
+    }
+    cm->corked = c;
+    cm->push_delay = push_delay;
+    cm->push_deadline = 0;
+    return 1;
+}
+
+/*
+ * Start the push timer when data is written to the corked socket.
+ */
+static void note_sent(struct connection_manager *cm, struct connection *c) {
+    if (c == cm->corked && cm->push_deadline == 0)
+        cm->push_deadline = now_ms() + cm->push_delay;
+}
+
+/*
+ * Send partial segment of the corked socket if it waits too long. Clearing TCP_CORK flushes it.
+ */
+static void push_corked(struct connection_manager *cm) {
+    if (cm->push_deadline == 0 || now_ms() < cm->push_deadline)
+        return;
+    cm->push_deadline = 0;
+    int zero = 0, one = 1;
+    struct connection *c = cm->corked;
+    cm->stats.syscalls += 2;
+    if (setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero)) == -1 ||
+        setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &one, sizeof(one)) == -1)
+        perror("push_corked: setsockopt");
+}
+
+/*
+ * Shorten the timeout of cm_poll, so the deadline (ms, 0 if not set) is not missed.
+ */
+static int deadline_timeout(uint64_t deadline, int timeout) {
+    if (deadline == 0)
+        return timeout;
+    uint64_t now = now_ms();
+    int left = deadline > now ? (int) (deadline - now) : 0;
+    return timeout < 0 || left < timeout ? left : timeout;
+}
+
+static void dead_push(struct connection_manager *cm, struct connection *c) {
+    if (c->events & IO_DEAD)
+        return;
+    c->events |= IO_DEAD;
+    c->dead_prev = NULL;
+    c->dead_next = cm->dead;
+    if (cm->dead != NULL)
+        cm->dead->dead_prev = c;
+    cm->dead = c;
+}
+
+static void dead_remove(struct connection_manager *cm, struct connection *c) {
+    if (!(c->events & IO_DEAD))
+        return;
+    c->events &= ~IO_DEAD;
+    if (c->dead_prev != NULL)
+        c->dead_prev->dead_next = c->dead_next;
+    else
+        cm->dead = c->dead_next;
+    if (c->dead_next != NULL)
+        c->dead_next->dead_prev = c->dead_prev;
+    c->dead_prev = NULL;
+    c->dead_next = NULL;
+}
+
+/*
+ * Returns 1 if the socket or one of its directions has to be closed or the connection has to be freed.
+ */
+static int needs_closing(struct connection *c) {
+    if (should_delete(c->state))
+        return 1;
+    if (is_closed(c->state))
+        return 0;
+    return should_close_socket(c) ||
+           (should_close(c->in_state) && !is_closed(c->in_state)) ||
+           (should_close(c->out_state) && !is_closed(c->out_state));
+}
+
+/*
+ * Called whenever the state or the output buffer of the connection may have changed,
+ * so close_sockets looks only at connections that have something to do.
+ */
+static void check_closing(struct connection_manager *cm, struct connection *c) {
+    if (needs_closing(c))
+        dead_push(cm, c);
+}
+
+void cm_schedule_close(struct connection_manager *cm, struct connection *c) {
+    check_closing(cm, c);
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Register connection buffers in the ring,
+ * so the kernel doesn't have to map them on every operation.
+ */
+static void uring_attach_buffers(struct connection_manager *cm, struct connection *c) {
+    if (!cm->fixed_buffers || cm->free_slots_count == 0)
+        return;
+
+    int slot = cm->free_slots[--cm->free_slots_count];
+    struct iovec iov[2];
+    buf_storage(c->in_buf, &iov[0]);
+    buf_storage(c->out_buf, &iov[1]);
+    if (uring_update_buffers(cm->ring, 2 * slot, iov, 2) == -1) {
+        perror("uring_update_buffers");
+        cm->free_slots[cm->free_slots_count++] = slot;
+        return;
+    }
+    c->buf_slot = slot;
+}
+
+static void uring_detach_buffers(struct connection_manager *cm, struct connection *c) {
+    if (c->buf_slot == -1)
+        return;
+
+    struct iovec iov[2];
+    memset(iov, 0, sizeof(iov));
+    if (uring_update_buffers(cm->ring, 2 * c->buf_slot, iov, 2) == -1)
+        perror("uring_update_buffers");
+    cm->free_slots[cm->free_slots_count++] = c->buf_slot;
+    c->buf_slot = -1;
+}
+
+/*
+ * Make space for one more connection.
+ */
+static int reserve(struct connection_manager *cm) {
+    if (cm->free_count > 0 || cm->slots_count < cm->capacity)
+        return 1;
+
+    size_t capacity = cm->capacity * 2;
+    struct pollfd *fds = realloc(cm->fds, (2 + capacity) * sizeof(struct pollfd));
+    if (fds == NULL) {
+        perror("reserve: realloc");
+        return 0;
+    }
+    cm->fds = fds;
+    struct connection **connections = realloc(cm->connections, capacity * sizeof(struct connection *));
+    if (connections == NULL) {
+        perror("reserve: realloc");
+        return 0;
+    }
+    cm->connections = connections;
+    int *free_indices = realloc(cm->free_indices, capacity * sizeof(int));
+    if (free_indices == NULL) {
+        perror("reserve: realloc");
+        return 0;
+    }
+    cm->free_indices = free_indices;
+    cm->capacity = capacity;
+    return 1;
+}
+
+static int epoll_add(struct connection_manager *cm, int fd, uint32_t events, void *ptr) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = ptr;
+    cm->stats.syscalls++;
+    if (epoll_ctl(cm->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        return 0;
+    }
+    return 1;
+}
+
 int cm_add_connection(
         struct connection_manager *cm,
         struct connection *connection,
         int fd) {
-    if (cm->connections_count == MAX_CONNECTIONS)
+    if (!reserve(cm))
         return -1;
 
-    int ind = cm->connections_count++;
+    if (cm->engine == ENGINE_EPOLL) {
+        // Edge-triggered epoll requires non-blocking sockets
+        if (!set_nonblocking(fd))
+            return -1;
+        if (!epoll_add(cm, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, connection))
+            return -1;
+    }
+
+    int ind = cm->free_count > 0 ? cm->free_indices[--cm->free_count] : (int) cm->slots_count++;
     cm->connections[ind] = connection;
+    connection->index = ind;
+    connection->fd = fd;
+
+    if (cm->engine == ENGINE_URING) {
+        uring_attach_buffers(cm, connection);
+        // First receive is submitted by the next cm_poll call
+        ready_push(cm, connection);
+    }
+    cm_mark_changed(cm, connection);
 
     struct pollfd *pfd = &cm_conn_fd(cm, ind);
     pfd->fd = fd;
-    pfd->events = POLLIN;
+    // Socket becomes writable when connect completes
+    pfd->events = (connection->state & CS_CONNECTING) ? POLLOUT : POLLIN;
+    pfd->revents = 0;
 
     return ind;
 }
 
-int cm_connect(
+static struct connection *start_connect(
         struct connection_manager *cm,
         struct sockaddr_in *addr,
         size_t in_buf_size,
         size_t out_buf_size,
-        int id) {
-    if (cm->connections_count == MAX_CONNECTIONS) {
-        fprintf(stderr, "cm_connect: too many connections");
-        return 0;
-    }
-    struct connection *c = make_connection(addr, in_buf_size, out_buf_size, id);
+        int id,
+        int async) {
+    struct connection *c = alloc_connection(cm, addr, in_buf_size, out_buf_size, id);
     if (c == NULL) {
         fprintf(stderr, "cm_connect: failed\n");
-        return 0;
+        return NULL;
     }
     int s = socket(AF_INET, SOCK_STREAM, 0);
     if (s == -1) {
         perror("cm_connect: socket");
-        free_connection(c);
-        return 0;
+        release_connection(cm, c);
+        return NULL;
     }
 
-    if (connect(s, (struct sockaddr *) addr, sizeof(struct sockaddr_in)) == -1) {
+    if (async && cm->engine == ENGINE_URING) {
+        // Connect request is submitted by the next cm_poll call
+        c->state |= CS_CONNECTING;
+    } else if (async) {
+        if (!set_nonblocking(s))
+            goto fail;
+        cm->stats.syscalls++;
+        if (connect(s, (struct sockaddr *) addr, sizeof(struct sockaddr_in)) == -1) {
+            if (errno != EINPROGRESS) {
+                perror("cm_connect: connect");
+                goto fail;
+            }
+            c->state |= CS_CONNECTING;
+        }
+    } else if (connect(s, (struct sockaddr *) addr, sizeof(struct sockaddr_in)) == -1) {
         perror("cm_connect: connect");
-        if (close(s))
-            perror("close");
-        free_connection(c);
-        return 0;
+        goto fail;
     }
 
-    cm_add_connection(cm, c, s);
+    if (cm_add_connection(cm, c, s) == -1) {
+        fprintf(stderr, "cm_connect: cm_add_connection failed\n");
+        goto fail;
+    }
 
-    return 1;
+    return c;
+
+    fail:
+    if (close(s))
+        perror("close");
+    release_connection(cm, c);
+    return NULL;
 }
 
-static int cm_get_connection_fd(struct connection_manager *m, int ind) {
-    int fd = cm_conn_fd(m, ind).fd;
-    if (fd < 0)
-        fd = ~fd;
-    return fd;
+struct connection *cm_connect(
+        struct connection_manager *cm,
+        struct sockaddr_in *addr,
+        size_t in_buf_size,
+        size_t out_buf_size,
+        int id) {
+    return start_connect(cm, addr, in_buf_size, out_buf_size, id, 0);
 }
 
-struct connection *const *cm_get_connections(struct connection_manager *cm, int *count) {
-    *count = cm->connections_count;
-    return cm->connections;
+struct connection *cm_connect_async(
+        struct connection_manager *cm,
+        struct sockaddr_in *addr,
+        size_t in_buf_size,
+        size_t out_buf_size,
+        int id) {
+    return start_connect(cm, addr, in_buf_size, out_buf_size, id, 1);
+}
+
+void cm_schedule_write(struct connection_manager *cm, struct connection *c) {
+    // Poll engine checks all output buffers before each poll call.
+    if (cm->engine == ENGINE_EPOLL && (c->events & IO_WRITABLE))
+        ready_push(cm, c);
+    if (cm->engine == ENGINE_URING && !(c->events & IO_SEND_PENDING) && !is_closed(c->state))
+        ready_push(cm, c);
+}
+
+/*
+ * Returns free submission queue entry.
+ * Submits prepared requests when the queue is full, returns NULL and sets errno if it stays full.
+ */
+static struct io_uring_sqe *uring_sqe(struct connection_manager *cm) {
+    struct io_uring_sqe *sqe = uring_get_sqe(cm->ring);
+    if (sqe == NULL && uring_submit(cm->ring, 0) != -1) {
+        sqe = uring_get_sqe(cm->ring);
+        // Kernel has taken none of the entries
+        if (sqe == NULL)
+            errno = EAGAIN;
+    }
+    return sqe;
+}
+
+static void uring_prep_pipe_read(struct connection_manager *m) {
+    struct io_uring_sqe *sqe = uring_sqe(m);
+    if (sqe == NULL) {
+        fprintf(stderr, "uring_prep_pipe_read: submission queue is full\n");
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = m->fds[PIPE_INDEX].fd;
+    sqe->addr = (uint64_t) (uintptr_t) &m->pipe_cause;
+    sqe->len = 1;
+    sqe->user_data = TAG_PIPE;
+}
+
+static void uring_prep_accept(struct connection_manager *m) {
+    struct io_uring_sqe *sqe = uring_sqe(m);
+    if (sqe == NULL) {
+        fprintf(stderr, "uring_prep_accept: submission queue is full\n");
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m->fds[ACCEPTOR_INDEX].fd;
+    // Single request accepts all incoming connections
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = TAG_ACCEPT;
+}
+
+static int init_uring(struct connection_manager *m) {
+    m->ring = make_uring(URING_ENTRIES);
+    if (m->ring == NULL)
+        return 0;
+
+    // Connections that don't get a slot use the regular send and receive operations.
+    m->fixed_buffers = uring_register_buffers(m->ring, 2 * FIXED_BUFFER_SLOTS) != -1;
+    if (!m->fixed_buffers)
+        perror("init_manager: buffers are not registered");
+
+    m->free_slots_count = FIXED_BUFFER_SLOTS;
+    for (int i = 0; i < FIXED_BUFFER_SLOTS; i++)
+        m->free_slots[i] = FIXED_BUFFER_SLOTS - 1 - i;
+
+    uring_prep_pipe_read(m);
+    return 1;
 }
 
-struct connection_manager *init_manager() {
+static int init_epoll(struct connection_manager *m) {
+    m->epoll_fd = epoll_create1(0);
+    if (m->epoll_fd == -1) {
+        perror("epoll_create1");
+        return 0;
+    }
+    if (!epoll_add(m, m->fds[PIPE_INDEX].fd, EPOLLIN, &pipe_tag)) {
+        if (close(m->epoll_fd))
+            perror("close epoll");
+        m->epoll_fd = -1;
+        return 0;
+    }
+    return 1;
+}
+
+struct connection_manager *init_manager(int engine) {
     struct connection_manager *m = malloc(sizeof(struct connection_manager));
     if (m == NULL) {
         perror("malloc");
@@ -163,26 +940,79 @@ struct connection_manager *init_manager() {
     }
     memset(m, 0, sizeof(struct connection_manager));
 
+    m->capacity = INITIAL_CAPACITY;
+    m->fds = malloc((2 + m->capacity) * sizeof(struct pollfd));
+    m->connections = malloc(m->capacity * sizeof(struct connection *));
+    m->free_indices = malloc(m->capacity * sizeof(int));
+    if (m->fds == NULL || m->connections == NULL || m->free_indices == NULL) {
+        perror("malloc");
+        goto abort;
+    }
+
     int pipe_fds[2];
     if (pipe(pipe_fds) == -1) {
         perror("pipe");
-        free(m);
-        return NULL;
+        goto abort;
     }
 
-    m->connections_count = 0;
+    m->slots_count = 0;
+    m->free_count = 0;
+    m->pooled_size = 0;
     m->fds[ACCEPTOR_INDEX].fd = -1;
     m->fds[PIPE_INDEX].fd = pipe_fds[0];
     m->fds[PIPE_INDEX].events = POLLIN;
     m->pipe = pipe_fds[1];
+    m->epoll_fd = -1;
+    m->acceptor_ready = 0;
+    m->ready = NULL;
+    m->changed = NULL;
+    for (int i = 0; i < PRIORITY_CLASSES; i++) {
+        m->input_head[i] = NULL;
+        m->input_tail[i] = NULL;
+    }
+    m->dead = NULL;
+    m->defer_head = NULL;
+    m->defer_tail = NULL;
+    m->corked = NULL;
+    m->push_delay = 0;
+    m->push_deadline = 0;
+    m->timer_deadline = 0;
+    m->max_buf_size = 0;
+    m->budget = NULL;
+    m->grown = NULL;
+    m->shrink_deadline = 0;
+    memset(&m->stats, 0, sizeof(m->stats));
+    m->timed = 0;
+
+    m->ring = NULL;
+    m->fixed_buffers = 0;
+    m->free_slots_count = 0;
+
+    m->engine = engine;
+    if (engine == ENGINE_URING && !init_uring(m)) {
+        fprintf(stderr, "init_manager: io_uring is not available, falling back to epoll\n");
+        engine = m->engine = ENGINE_EPOLL;
+    }
+    if (engine == ENGINE_EPOLL && !init_epoll(m)) {
+        fprintf(stderr, "init_manager: epoll is not available, falling back to poll\n");
+        m->engine = ENGINE_POLL;
+    }
 
     return m;
+    abort:
+    free(m->fds);
+    free(m->connections);
+    free(m->free_indices);
+    free(m);
+    return NULL;
 }
 
 struct connection_manager *init_accepting_manager(
+        int engine,
         struct sockaddr_in *addr,
-        int buf_size, int backlog) {
-    struct connection_manager *m = init_manager();
+        int buf_size, int backlog,
+        int reuse_port) {
+    struct connection_manager *m = init_manager(engine);
     if (m == NULL)
         return NULL;
 
@@ -192,6 +1022,13 @@ struct connection_manager *init_accepting_manager(
         goto abort;
     }
 
+    // Kernel distributes incoming connections between all sockets bound to the port
+    int one = 1;
+    if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+        perror("setsockopt");
+        goto abort;
+    }
+
     if (bind(sock, (struct sockaddr *) addr, sizeof(struct sockaddr_in)) == -1) {
         perror("bind");
         goto abort;
@@ -202,10 +1039,19 @@ struct connection_manager *init_accepting_manager(
         goto abort;
     }
 
+    if (m->engine == ENGINE_EPOLL) {
+        if (!set_nonblocking(sock) ||
+            !epoll_add(m, sock, EPOLLIN | EPOLLET, &acceptor_tag))
+            goto abort;
+    }
+
     m->buf_size = buf_size;
     m->fds[ACCEPTOR_INDEX].fd = sock;
     m->fds[ACCEPTOR_INDEX].events = POLLIN;
 
+    if (m->engine == ENGINE_URING)
+        uring_prep_accept(m);
+
     return m;
     abort:
     fprintf(stderr, "Closing socket\n");
@@ -218,6 +1064,10 @@ struct connection_manager *init_accepting_manager(
 }
 
 void destroy_manager(struct connection_manager *m) {
+    // Ring is destroyed first, because it may have requests
+    // that use buffers of connections.
+    free_uring(m->ring);
+
     if (m->fds[ACCEPTOR_INDEX].fd != -1) {
         if (close(m->fds[ACCEPTOR_INDEX].fd) == -1)
             perror("close listening socket");
@@ -229,18 +1079,30 @@ void destroy_manager(struct connection_manager *m) {
     if (close(m->pipe) == -1) {
         perror("close pipe write end");
     }
+    if (m->epoll_fd != -1 && close(m->epoll_fd) == -1) {
+        perror("close epoll");
+    }
 
-    for (size_t i = 0; i < m->connections_count; i++) {
+    for (size_t i = 0; i < m->slots_count; i++) {
         struct connection *c = m->connections[i];
+        if (c == NULL)
+            continue;
 
-        int fd = cm_get_connection_fd(m, i);
+        int fd = c->fd;
         uint8_t state = c->state;
 
-        free_connection(c);
+        release_connection(m, c);
 
         if (!is_closed(state) && close(fd) == -1)
             perror("close");
     }
+    if (m->pooled_size != 0) {
+        pool_destroy(&m->conn_pool);
+        buf_pool_destroy(&m->buf_pool);
+    }
+    free(m->fds);
+    free(m->connections);
+    free(m->free_indices);
     free(m);
 }
 
@@ -284,21 +1146,95 @@ static void set_pollfd_flags(struct pollfd *fd, short mask) {
     fd->events |= mask;
 }
 
-static void receive(struct pollfd *fd, struct connection *conn) {
+/*
+ * Complete the non-blocking connect, err is the error code or 0 on success.
+ * Failed connection is closed as if EOF was received.
+ */
+static void finish_connect(struct connection_manager *cm, struct connection *conn, int err) {
+    conn->state &= ~CS_CONNECTING;
+    if (err != 0) {
+        errno = err;
+        perror("connect");
+        conn->state |= CS_EOF;
+    }
+    cm_mark_changed(cm, conn);
+    check_closing(cm, conn);
+}
+
+static int get_socket_error(int fd) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        return errno;
+    return err;
+}
+
+/*
+ * Read data from the socket to the input buffer of the connection.
+ * Returns 1 if the socket may still have more data to read.
+ */
+static int receive_data(struct connection_manager *cm, struct connection *conn) {
+    struct round_buffer *buf = conn->in_buf;
+    size_t requested = buf_free_length(buf);
+
+    ssize_t res = buf_read(conn->fd, buf);
+    cm->stats.syscalls++;
+    cm_mark_changed(cm, conn);
+    if (res > 0) {
+        conn->bytes_received += res;
+        cm_queue_input(cm, conn);
+    } else
+        buf_trim(buf);
+    switch (get_rw_error_cause(res, errno)) {
+        case CAUSE_ERROR:
+            perror("read");
+            /* FALLTHROUGH */
+        case CAUSE_EOF:
+            conn->in_state |= CS_EOF;
+            check_closing(cm, conn);
+            return 0;
+    }
+    // Short read means that the socket receive queue is drained.
+    return res > 0 && (size_t) res == requested;
+}
+
+/*
+ * Write data from the output buffer of the connection to the socket.
+ * Returns 1 if the socket may still accept more data.
+ */
+static int transmit_data(struct connection_manager *cm, struct connection *conn) {
+    struct round_buffer *buf = conn->out_buf;
+    size_t requested = buf_data_length(buf);
+
+    ssize_t res = buf_write(conn->fd, buf);
+    cm->stats.syscalls++;
+    if (res > 0) {
+        conn->bytes_sent += res;
+        note_sent(cm, conn);
+    }
+    cm_mark_changed(cm, conn);
+    buf_trim(buf);
+    switch (get_rw_error_cause(res, errno)) {
+        case CAUSE_ERROR:
+            perror("write");
+            /* FALLTHROUGH */
+        case CAUSE_EOF:
+            conn->out_state |= CS_EOF;
+            check_closing(cm, conn);
+            return 0;
+    }
+    // Deferred shutdown or close waits for the output to be flushed
+    check_closing(cm, conn);
+    return res > 0 && (size_t) res == requested;
+}
+
+static void receive(struct connection_manager *cm, struct pollfd *fd, struct connection *conn) {
     if (!is_alive(conn->in_state) || is_stopped(conn->state))
         return;
     struct round_buffer *buf = conn->in_buf;
 
-    if ((fd->revents & POLLIN) && !buf_full(buf)) {
-        ssize_t res = buf_read(fd->fd, buf);
-        switch (get_rw_error_cause(res, errno)) {
-            case CAUSE_ERROR:
-                perror("read");
-                /* FALLTHROUGH */
-            case CAUSE_EOF:
-                conn->in_state |= CS_EOF;
-        }
-    }
+    if ((fd->revents & POLLIN) && !buf_full(buf))
+        receive_data(cm, conn);
 
     if (buf_full(buf) || !is_alive(conn->in_state))
         clear_pollfd_flags(fd, POLLIN);
@@ -306,24 +1242,16 @@ static void receive(struct pollfd *fd, struct connection *conn) {
         set_pollfd_flags(fd, POLLIN);
 }
 
-static void transmit(struct pollfd *fd, struct connection *conn) {
-    if (!is_alive(conn->out_state) || is_stopped(conn->state))
+static void transmit(struct connection_manager *cm, struct pollfd *fd, struct connection *conn) {
+    if (!can_flush(conn->out_state) || is_stopped(conn->state))
         return;
 
     struct round_buffer *buf = conn->out_buf;
 
-    if ((fd->revents & POLLOUT) && !buf_empty(buf)) {
-        ssize_t res = buf_write(fd->fd, buf);
-        switch (get_rw_error_cause(res, errno)) {
-            case CAUSE_ERROR:
-                perror("write");
-                /* FALLTHROUGH */
-            case CAUSE_EOF:
-                conn->out_state |= CS_EOF;
-        }
-    }
+    if ((fd->revents & POLLOUT) && !buf_empty(buf))
+        transmit_data(cm, conn);
 
-    if (buf_empty(buf) || !is_alive(conn->out_state))
+    if (buf_empty(buf) || !can_flush(conn->out_state))
         clear_pollfd_flags(fd, POLLOUT);
     else
         set_pollfd_flags(fd, POLLOUT);
@@ -338,23 +1266,13 @@ static void try_shutdown(int fd, int dir) {
         perror("shutdown");
 }
 
-static void accept_connection(struct connection_manager *cm) {
-    if (cm->connections_count == MAX_CONNECTIONS)
-        return;
-
-    int listening_socket = cm->fds[ACCEPTOR_INDEX].fd;
-    socklen_t len = sizeof(struct sockaddr_in);
-    struct sockaddr_in addr;
-    int socket = accept(listening_socket, (struct sockaddr *) &addr, &len);
-    if (socket == -1) {
-        if (errno == EINTR || errno == EAGAIN)
-            return;
-        perror("accept");
-    }
-
-    struct connection *c = make_connection(&addr, cm->buf_size, cm->buf_size, -1);
+/*
+ * Set up new connection accepted by any engine.
+ */
+static void add_accepted_connection(struct connection_manager *cm, int socket, struct sockaddr_in *addr) {
+    struct connection *c = alloc_connection(cm, addr, cm->buf_size, cm->buf_size, -1);
     if (c == NULL) {
-        fprintf(stderr, "make_connection failed\n");
+        fprintf(stderr, "alloc_connection failed\n");
         goto abort;
     }
     c->state |= CS_NEW;
@@ -367,76 +1285,156 @@ static void accept_connection(struct connection_manager *cm) {
     return;
     abort:
     fprintf(stderr, "Closing socket %s:%hu...\n",
-            inet_ntoa(c->address.sin_addr),
-            ntohs(c->address.sin_port));
+            inet_ntoa(addr->sin_addr),
+            ntohs(addr->sin_port));
 
     if (c != NULL)
-        free_connection(c);
+        release_connection(cm, c);
 
     if (close(socket))
         perror("close");
 }
 
-static void close_sockets(struct connection_manager *cm) {
-    for (size_t i = 0; i < cm->connections_count; i++) {
-        struct connection *conn = cm->connections[i];
-        if (is_closed(conn->state))
+/*
+ * Accept one pending connection.
+ * Returns 0 if there are no more connections to accept.
+ */
+static int accept_connection(struct connection_manager *cm) {
+    int listening_socket = cm->fds[ACCEPTOR_INDEX].fd;
+    socklen_t len = sizeof(struct sockaddr_in);
+    struct sockaddr_in addr;
+    int socket = accept(listening_socket, (struct sockaddr *) &addr, &len);
+    cm->stats.syscalls++;
+    if (socket == -1) {
+        if (errno == EINTR)
+            return 1;
+        if (errno != EAGAIN)
+            perror("accept");
+        return 0;
+    }
+
+    add_accepted_connection(cm, socket, &addr);
+    return 1;
+}
+
+static void uring_cancel(struct connection_manager *cm, struct connection *conn) {
+    uint8_t ops[] = {OP_RECV, OP_SEND, OP_CONNECT};
+    uint16_t flags[] = {IO_RECV_PENDING, IO_SEND_PENDING, IO_CONNECT_PENDING};
+    for (int i = 0; i < 3; i++) {
+        if (!(conn->events & flags[i]))
             continue;
+        // Closing the descriptor doesn't cancel requests in flight and their slot can't be freed
+        // until they complete, so the cancel request is submitted even if the queue is full
+        struct io_uring_sqe *sqe;
+        while ((sqe = uring_sqe(cm)) == NULL) {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                perror("uring_cancel: io_uring_enter");
+                return;
+            }
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uint64_t) (uintptr_t) conn | ops[i];
+        sqe->user_data = TAG_CANCEL;
+    }
+}
 
-        int fd = cm_get_connection_fd(cm, i);
+/*
+ * Free the connection and return its slot to the free list.
+ */
+static void release_slot(struct connection_manager *cm, struct connection *c) {
+    if (cm->engine == ENGINE_URING)
+        uring_detach_buffers(cm, c);
+    changed_remove(cm, c);
+    cm_dequeue_input(cm, c);
+    cm_undefer_input(cm, c);
+    grown_remove(cm, c);
+    // Pooled buffers never get smaller than the pooled size
+    if (c->pooled && cm->budget != NULL)
+        return_budget(cm->budget, buf_capacity(c->in_buf) + buf_capacity(c->out_buf) - 2 * cm->pooled_size);
+    if (c == cm->corked) {
+        cm->corked = NULL;
+        cm->push_deadline = 0;
+    }
+    cm->connections[c->index] = NULL;
+    cm_conn_fd(cm, c->index).fd = -1;
+    cm_conn_fd(cm, c->index).revents = 0;
+    cm->free_indices[cm->free_count++] = c->index;
+    release_connection(cm, c);
+}
 
-        if (should_close_socket(conn)) {
-            cm_conn_fd(cm, i).fd = -1;
+/*
+ * Only connections from the dead list are visited. Connection that can't be
+ * handled yet is put back to the list by the event that unblocks it.
+ */
+static void close_sockets(struct connection_manager *cm) {
+    struct connection *conn;
+    while ((conn = cm->dead) != NULL) {
+        dead_remove(cm, conn);
+        int fd = conn->fd;
+
+        if (is_closed(conn->state)) {
+            // Nothing to do but to free the connection
+        } else if (should_close_socket(conn)) {
+            cm_conn_fd(cm, conn->index).fd = -1;
+            // Closing the descriptor also removes it from the epoll set
+            ready_remove(cm, conn);
+            if (cm->engine == ENGINE_URING)
+                uring_cancel(cm, conn);
 
             fprintf(stderr, "Closing socket %s:%hu...\n",
                     inet_ntoa(conn->address.sin_addr),
                     ntohs(conn->address.sin_port));
 
+            cm->stats.syscalls++;
             if (close(fd) == -1)
                 perror("close");
 
             conn->state |= CS_CLOSED;
             conn->in_state |= CS_CLOSED;
             conn->out_state |= CS_CLOSED;
-        } else {
-            // Shutdown direction if required
+            cm_mark_changed(cm, conn);
+        } else if (!(conn->state & CS_CONNECTING)) {
+            // Shutdown direction if required, it is done after connect completes
             if (should_close(conn->in_state) && !is_closed(conn->in_state)) {
                 try_shutdown(fd, SHUT_RD);
+                cm->stats.syscalls++;
                 conn->in_state |= CS_CLOSED;
+                cm_mark_changed(cm, conn);
             }
-            if (should_close(conn->out_state) && !is_closed(conn->out_state)) {
+            if (should_close(conn->out_state) && !is_closed(conn->out_state) && output_flushed(conn)) {
                 try_shutdown(fd, SHUT_WR);
+                cm->stats.syscalls++;
                 conn->out_state |= CS_CLOSED;
+                cm_mark_changed(cm, conn);
             }
         }
+
+        // Buffers can't be freed while the kernel is using them
+        if (should_delete(conn->state) && !(conn->events & (IO_RECV_PENDING | IO_SEND_PENDING | IO_CONNECT_PENDING)))
+            release_slot(cm, conn);
     }
 }
 
-static void shrink(struct connection_manager *cm) {
-    int i = 0;
-    for (int j = 0; j < cm->connections_count; j++) {
-        if (should_delete(cm->connections[j]->state)) {
-            free_connection(cm->connections[j]);
-        } else {
-            if (i != j) {
-                cm->connections[i] = cm->connections[j];
-                cm_conn_fd(cm, i) = cm_conn_fd(cm, j);
-            }
-            i++;
-        }
+static int read_pipe(struct connection_manager *cm) {
+    uint8_t cause;
+    int res = read(cm->fds[PIPE_INDEX].fd, &cause, 1);
+    cm->stats.syscalls++;
+    if (res == -1) {
+        perror("cm_poll: pipe read failed");
+    } else if (res != 0) {
+        return cause;
     }
-    cm->connections_count = i;
+    return CLOSE_CAUSE_NONE;
 }
 
-int cm_poll(struct connection_manager *cm) {
-    close_sockets(cm);
-    shrink(cm);
-
-    int connections_count = cm->connections_count;
-    for (int i = 0; i < connections_count; i++) {
+static int poll_connections(struct connection_manager *cm, int timeout) {
+    int slots_count = cm->slots_count;
+    for (int i = 0; i < slots_count; i++) {
         struct connection *conn = cm->connections[i];
+        if (conn == NULL)
+            continue;
         if (!buf_empty(conn->out_buf)) {
-            if (!is_alive(conn->out_state)) {
+            if (!can_flush(conn->out_state)) {
                 fprintf(stderr, "cm_poll: WARNING: attempt to write to the closed connection (id: %d) detected\n",
                         conn->id);
                 continue;
@@ -446,10 +1444,11 @@ int cm_poll(struct connection_manager *cm) {
         }
     }
 
-    nfds_t nfds = 2 + connections_count;
+    nfds_t nfds = 2 + slots_count;
     int cnt = -1;
     while (cnt < 0) {
-        cnt = poll(cm->fds, nfds, -1);
+        cnt = poll(cm->fds, nfds, timeout);
+        note_wakeup(cm);
         if (cnt == -1) {
             if (errno == EINTR || errno == EAGAIN)
                 continue;
@@ -459,13 +1458,9 @@ int cm_poll(struct connection_manager *cm) {
     }
 
     if (cm->fds[PIPE_INDEX].revents & POLLIN) {
-        uint8_t cause;
-        int res = read(cm->fds[PIPE_INDEX].fd, &cause, 1);
-        if (res == -1) {
-            perror("cm_poll: pipe read failed");
-        } else if (res != 0) {
+        int cause = read_pipe(cm);
+        if (cause != CLOSE_CAUSE_NONE)
             return cause;
-        }
     }
 
     if (cm->fds[ACCEPTOR_INDEX].revents & POLLIN)
@@ -474,21 +1469,397 @@ int cm_poll(struct connection_manager *cm) {
 
     // Transmit/receive data and set connection state on eof/error
     // (Ignore sockets accepted on previous step)
-    for (int i = 0; i < connections_count; i++) {
+    for (int i = 0; i < slots_count; i++) {
         struct connection *conn = cm->connections[i];
+        if (conn == NULL)
+            continue;
         struct pollfd *fd = &cm_conn_fd(cm, i);
-        if (is_alive(conn->state)) {
-            receive(fd, conn);
-            transmit(fd, conn);
+        if (conn->state & CS_CONNECTING) {
+            if (fd->revents & (POLLOUT | POLLERR | POLLHUP)) {
+                finish_connect(cm, conn, get_socket_error(conn->fd));
+                fd->events = POLLIN;
+            }
+            continue;
         }
+        if (is_alive(conn->state))
+            receive(cm, fd, conn);
+        if (can_flush(conn->state))
+            transmit(cm, fd, conn);
     }
 
+    return CLOSE_CAUSE_NONE;
+}
+
+static int can_receive(struct connection *c) {
+    return (c->events & IO_READABLE) && is_alive(c->in_state) && !buf_full(c->in_buf);
+}
+
+static int can_transmit(struct connection *c) {
+    return (c->events & IO_WRITABLE) && can_flush(c->out_state) && !buf_empty(c->out_buf);
+}
+
+static int has_pending_io(struct connection *c) {
+    if (is_stopped(c->state))
+        return 0;
+    return (is_alive(c->state) && can_receive(c)) || (can_flush(c->state) && can_transmit(c));
+}
+
+static void epoll_receive(struct connection_manager *cm, struct connection *conn) {
+    if (!is_alive(conn->in_state))
+        conn->events &= ~IO_READABLE;
+    if (!can_receive(conn))
+        return;
+    // After the peer has closed its side, read until EOF is returned,
+    // because the hang up is not going to be reported again.
+    if (!receive_data(cm, conn) && !(conn->events & IO_HUP))
+        conn->events &= ~IO_READABLE;
+}
+
+static void epoll_transmit(struct connection_manager *cm, struct connection *conn) {
+    if (!can_flush(conn->out_state))
+        conn->events &= ~IO_WRITABLE;
+    if (!can_transmit(conn))
+        return;
+    if (!transmit_data(cm, conn))
+        conn->events &= ~IO_WRITABLE;
+}
+
+static int epoll_connections(struct connection_manager *cm, int timeout) {
+    // Edge-triggered notifications are not repeated, so don't sleep
+    // while some of the already reported events are not handled.
+    if (cm->acceptor_ready)
+        timeout = 0;
+    for (struct connection *c = cm->ready; c != NULL && timeout != 0; c = c->ready_next) {
+        if (has_pending_io(c))
+            timeout = 0;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int cnt = -1;
+    while (cnt < 0) {
+        cnt = epoll_wait(cm->epoll_fd, events, MAX_EVENTS, timeout);
+        note_wakeup(cm);
+        if (cnt == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return CLOSE_CAUSE_ERROR;
+        }
+    }
+
+    for (int i = 0; i < cnt; i++) {
+        void *ptr = events[i].data.ptr;
+        uint32_t ev = events[i].events;
+        if (ptr == &pipe_tag) {
+            int cause = read_pipe(cm);
+            if (cause != CLOSE_CAUSE_NONE)
+                return cause;
+        } else if (ptr == &acceptor_tag) {
+            cm->acceptor_ready = 1;
+        } else {
+            struct connection *conn = ptr;
+            if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                conn->events |= IO_READABLE;
+            if (ev & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                conn->events |= IO_HUP;
+            if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                conn->events |= IO_WRITABLE;
+            ready_push(cm, conn);
+        }
+    }
+
+    // Connections accepted here are handled on the next call,
+    // as it is done by the poll engine.
+    struct connection *conn = cm->ready;
+    while (conn != NULL) {
+        struct connection *next = conn->ready_next;
+        if ((conn->state & CS_CONNECTING) && (conn->events & (IO_WRITABLE | IO_HUP)))
+            finish_connect(cm, conn, get_socket_error(conn->fd));
+        if (!is_stopped(conn->state)) {
+            if (is_alive(conn->state))
+                epoll_receive(cm, conn);
+            if (can_flush(conn->state))
+                epoll_transmit(cm, conn);
+        }
+        // Keep the connection queued while it has unconsumed readiness,
+        // e.g. the input buffer is full or the connection is stopped.
+        if (!(conn->events & IO_READABLE) && !can_transmit(conn))
+            ready_remove(cm, conn);
+        conn = next;
+    }
+
+    while (cm->acceptor_ready) {
+        if (!accept_connection(cm))
+            cm->acceptor_ready = 0;
+    }
+
+    return CLOSE_CAUSE_NONE;
+}
+
+static void uring_prep_io(struct connection_manager *cm, struct connection *conn) {
+    if ((conn->state & CS_CONNECTING) && !(conn->events & IO_CONNECT_PENDING)) {
+        struct io_uring_sqe *sqe = uring_sqe(cm);
+        if (sqe == NULL)
+            return;
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = conn->fd;
+        sqe->addr = (uint64_t) (uintptr_t) &conn->address;
+        // Address length is passed in the offset field
+        sqe->off = sizeof(struct sockaddr_in);
+        sqe->user_data = (uint64_t) (uintptr_t) conn | OP_CONNECT;
+        conn->events |= IO_CONNECT_PENDING;
+    }
+    if (is_stopped(conn->state))
+        return;
+
+    int recv = is_alive(conn->state) && is_alive(conn->in_state) &&
+               !buf_full(conn->in_buf) && !(conn->events & IO_RECV_PENDING);
+    int send = can_flush(conn->state) && can_flush(conn->out_state) &&
+               !buf_empty(conn->out_buf) && !(conn->events & IO_SEND_PENDING);
+
+    if (recv) {
+        struct io_uring_sqe *sqe = uring_sqe(cm);
+        if (sqe == NULL)
+            return;
+        // Only the first part of the free space is used, the rest is read by the next request.
+        struct iovec iov[MAX_IOV_LEN];
+        buf_writing_iov(conn->in_buf, iov);
+        if (conn->buf_slot != -1) {
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->buf_index = 2 * conn->buf_slot;
+        } else {
+            sqe->opcode = IORING_OP_RECV;
+        }
+        sqe->fd = conn->fd;
+        sqe->addr = (uint64_t) (uintptr_t) iov[0].iov_base;
+        sqe->len = iov[0].iov_len;
+        sqe->user_data = (uint64_t) (uintptr_t) conn | OP_RECV;
+        conn->events |= IO_RECV_PENDING;
+    }
+
+    if (send) {
+        struct io_uring_sqe *sqe = uring_sqe(cm);
+        if (sqe == NULL)
+            return;
+        struct iovec iov[MAX_IOV_LEN];
+        buf_reading_iov(conn->out_buf, iov);
+        if (conn->buf_slot != -1) {
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->buf_index = 2 * conn->buf_slot + 1;
+        } else {
+            sqe->opcode = IORING_OP_SEND;
+            sqe->msg_flags = MSG_NOSIGNAL;
+        }
+        sqe->fd = conn->fd;
+        sqe->addr = (uint64_t) (uintptr_t) iov[0].iov_base;
+        sqe->len = iov[0].iov_len;
+        sqe->user_data = (uint64_t) (uintptr_t) conn | OP_SEND;
+        conn->events |= IO_SEND_PENDING;
+    }
+}
+
+/*
+ * Connection is kept in the queue while its input is blocked by the full buffer
+ * or by the stopped state, or while the output is not submitted yet.
+ */
+static int uring_wants_io(struct connection *conn) {
+    if (is_closed(conn->state))
+        return 0;
+    if (conn->state & CS_CONNECTING)
+        return !(conn->events & IO_CONNECT_PENDING);
+    if (is_alive(conn->state) && is_alive(conn->in_state) && !(conn->events & IO_RECV_PENDING))
+        return 1;
+    return can_flush(conn->state) && can_flush(conn->out_state) &&
+           !buf_empty(conn->out_buf) && !(conn->events & IO_SEND_PENDING);
+}
+
+static void uring_complete_io(struct connection_manager *cm, struct connection *conn, int op, int res) {
+    int err = res < 0 ? -res : 0;
+    if (res < 0)
+        res = -1;
+
+    if (op == OP_RECV) {
+        conn->events &= ~IO_RECV_PENDING;
+        if (res > 0) {
+            buf_advance_write_ptr(conn->in_buf, res);
+            conn->bytes_received += res;
+            cm_queue_input(cm, conn);
+        } else if (err != ECANCELED && !is_closed(conn->in_state)) {
+            switch (get_rw_error_cause(res, err)) {
+                case CAUSE_ERROR:
+                    errno = err;
+                    perror("read");
+                    /* FALLTHROUGH */
+                case CAUSE_EOF:
+                    conn->in_state |= CS_EOF;
+            }
+        }
+    } else if (op == OP_CONNECT) {
+        conn->events &= ~IO_CONNECT_PENDING;
+        if (err != ECANCELED && (conn->state & CS_CONNECTING))
+            finish_connect(cm, conn, err);
+    } else {
+        conn->events &= ~IO_SEND_PENDING;
+        if (res > 0) {
+            buf_advance_read_ptr(conn->out_buf, res);
+            conn->bytes_sent += res;
+            note_sent(cm, conn);
+        } else if (err != ECANCELED && !is_closed(conn->out_state)) {
+            switch (get_rw_error_cause(res, err)) {
+                case CAUSE_ERROR:
+                    errno = err;
+                    perror("write");
+                    /* FALLTHROUGH */
+                case CAUSE_EOF:
+                    conn->out_state |= CS_EOF;
+            }
+        }
+    }
+
+    cm_mark_changed(cm, conn);
+    check_closing(cm, conn);
+    if (!is_closed(conn->state))
+        ready_push(cm, conn);
+}
+
+static void uring_complete_accept(struct connection_manager *cm, int res, uint32_t flags) {
+    if (!(flags & IORING_CQE_F_MORE))
+        uring_prep_accept(cm);
+
+    if (res < 0) {
+        errno = -res;
+        perror("accept");
+        return;
+    }
+
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(res, (struct sockaddr *) &addr, &len) == -1) {
+        perror("getpeername");
+        memset(&addr, 0, sizeof(addr));
+    }
+
+    add_accepted_connection(cm, res, &addr);
+}
+
+/*
+ * Wake up the ring after timeout milliseconds unless it is woken up earlier by the armed timeout.
+ */
+static void uring_prep_timeout(struct connection_manager *cm, int timeout) {
+    uint64_t deadline = now_ms() + timeout;
+    if (cm->timer_deadline != 0 && cm->timer_deadline <= deadline)
+        return;
+    struct io_uring_sqe *sqe = uring_sqe(cm);
+    if (sqe == NULL) {
+        fprintf(stderr, "uring_prep_timeout: submission queue is full\n");
+        return;
+    }
+    // Timeout is read by the kernel when the request is submitted
+    static __thread struct __kernel_timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (long long) (timeout % 1000) * 1000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) &ts;
+    sqe->len = 1;
+    sqe->user_data = TAG_TIMEOUT;
+    cm->timer_deadline = deadline;
+}
+
+static int uring_connections(struct connection_manager *cm, int timeout) {
+    // Prepare requests for all connections that need them,
+    // everything is submitted with a single system call.
+    struct connection *conn = cm->ready;
+    while (conn != NULL) {
+        struct connection *next = conn->ready_next;
+        uring_prep_io(cm, conn);
+        if (!uring_wants_io(conn))
+            ready_remove(cm, conn);
+        conn = next;
+    }
+
+    if (timeout > 0)
+        uring_prep_timeout(cm, timeout);
+    unsigned wait_nr = timeout == 0 ? 0 : 1;
+    for (;;) {
+        int submitted = uring_submit(cm->ring, wait_nr);
+        note_wakeup(cm);
+        if (submitted != -1)
+            break;
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EBUSY) {
+            // Completion queue is overflown, handle completions first
+            break;
+        }
+        perror("io_uring_enter");
+        return CLOSE_CAUSE_ERROR;
+    }
+
+    int cause = CLOSE_CAUSE_NONE;
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(cm->ring)) != NULL) {
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        uint32_t flags = cqe->flags;
+        uring_cqe_seen(cm->ring);
+
+        if (data == TAG_PIPE) {
+            if (res == 1)
+                cause = cm->pipe_cause;
+            else if (res < 0)
+                fprintf(stderr, "cm_poll: pipe read failed: %s\n", strerror(-res));
+            uring_prep_pipe_read(cm);
+        } else if (data == TAG_ACCEPT) {
+            uring_complete_accept(cm, res, flags);
+        } else if (data == TAG_TIMEOUT) {
+            cm->timer_deadline = 0;
+        } else if (data != TAG_CANCEL) {
+            conn = (struct connection *) (uintptr_t) (data & ~(uint64_t) OP_MASK);
+            uring_complete_io(cm, conn, (int) (data & OP_MASK), res);
+        }
+    }
+
+    return cause;
+}
+
+int cm_poll(struct connection_manager *cm, int timeout) {
+    close_sockets(cm);
+    timeout = deadline_timeout(cm->push_deadline, timeout);
+    timeout = deadline_timeout(cm->shrink_deadline, timeout);
+
+    int cause;
+    if (cm->engine == ENGINE_URING)
+        cause = uring_connections(cm, timeout);
+    else if (cm->engine == ENGINE_EPOLL)
+        cause = epoll_connections(cm, timeout);
+    else
+        cause = poll_connections(cm, timeout);
+    if (cause != CLOSE_CAUSE_NONE)
+        return cause;
+
+    push_corked(cm);
+    shrink_idle_buffers(cm);
     close_sockets(cm);
-    shrink(cm);
 
     return CLOSE_CAUSE_NONE;
 }
 
+void cm_wakeup(struct connection_manager *m) {
+    uint8_t cmd = CLOSE_CAUSE_NONE;
+    if (write(m->pipe, &cmd, 1) == -1) {
+        perror("ERROR: cannot write to pipe");
+    }
+}
+
+void cm_enable_stats(struct connection_manager *cm) {
+    cm->timed = 1;
+}
+
+const struct cm_stats *cm_stats(struct connection_manager *cm) {
+    return &cm->stats;
+}
+
 void cm_shutdown(struct connection_manager *m) {
     uint8_t cmd = CLOSE_CAUSE_USER;
     if (write(m->pipe, &cmd, 1) == -1) {
@@ -11,30 +11,129 @@
 #define CS_CLOSED ((uint8_t)4)
 #define CS_DELETE ((uint8_t)8)
 #define CS_STOPPED ((uint8_t)16)
+#define CS_CONNECTING ((uint8_t)32)
 
 #define CLOSE_CAUSE_NONE 0
 #define CLOSE_CAUSE_USER 1
 #define CLOSE_CAUSE_ERROR 2
 
+#define ENGINE_POLL 0
+#define ENGINE_EPOLL 1
+#define ENGINE_URING 2
+
+#ifndef DEFAULT_ENGINE
+#define DEFAULT_ENGINE ENGINE_EPOLL
+#endif
+
+// Input of a lower class is sent only when higher classes have nothing to send, class 0 is the highest
+#define PRIORITY_CLASSES 4
+// Bytes a connection may send to the tunnel per turn (the largest binary frame), see cm_queue_input
+#define DEFAULT_QUANTUM 65535
+
 struct connection {
     int id;
+    int fd;
     uint8_t state;
     uint8_t in_state;
     uint8_t out_state;
     struct sockaddr_in address;
     struct round_buffer *in_buf;
     struct round_buffer *out_buf;
+    // Number of bytes the connection may send through the tunnel (flow control)
+    // and number of bytes the peer is allowed to send to the connection.
+    uint32_t tx_credit;
+    uint32_t rx_granted;
+    // Peer knows that the connection has used all the credit, see CMD_WINDOW_BLOCKED.
+    uint8_t credit_blocked;
+    // Bytes sent without compression before the next attempt and number of poorly compressed attempts in a row.
+    uint32_t compress_skip;
+    uint8_t compress_failures;
+    // Readiness reported by epoll and not consumed yet.
+    uint16_t events;
+    // Index of the connection buffers registered in io_uring or -1.
+    int buf_slot;
+    struct connection *ready_prev;
+    struct connection *ready_next;
+    // Connections with state or buffers changed since the controller has seen them.
+    struct connection *changed_prev;
+    struct connection *changed_next;
+    // Connections with data in the input buffer waiting for the pump.
+    struct connection *input_prev;
+    struct connection *input_next;
+    // Priority class, bytes sent per turn and bytes left in the current turn, see cm_queue_input.
+    uint8_t priority;
+    uint32_t quantum;
+    uint32_t deficit;
+    // Connections with pending close, shutdown or deletion.
+    struct connection *dead_prev;
+    struct connection *dead_next;
+    // Connections whose small frames are held by the pump, see cm_defer_input.
+    struct connection *defer_prev;
+    struct connection *defer_next;
+    // Time (CLOCK_MONOTONIC, ns) the held frame has to be sent at, 0 if nothing is held.
+    uint64_t defer_deadline;
+    // Connections with buffers larger than the pooled size, see cm_grow_buffer.
+    struct connection *grown_prev;
+    struct connection *grown_next;
+    // Output buffer is idle, but it can't shrink until the peer returns its credit.
+    uint8_t shrink_output;
+    // Slot of the connection in the manager, it doesn't change until the connection is freed.
+    int index;
+    // Connection and its buffers are taken from the pools of the manager.
+    uint8_t pooled;
+    // Bytes read from and written to the socket.
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
 };
 
 struct connection_manager;
 
+/*
+ * System calls made by the manager and the time (CLOCK_MONOTONIC, ns) the last wait for events returned.
+ */
+struct cm_stats {
+    uint64_t syscalls;
+    uint64_t wakeup_ns;
+};
+
+/*
+ * Memory that buffers of all managers may take above the pooled size, shared by the threads.
+ */
+struct buffer_budget {
+    size_t limit;
+    size_t used;
+};
+
 int is_alive(uint8_t state);
 
+/*
+ * Stopped connections don't transfer data until they are acknowledged by the peer or connected.
+ */
 int is_stopped(uint8_t state);
 
-int cm_poll(struct connection_manager *cm);
+/*
+ * Wait for events and transfer data between sockets and buffers.
+ * Timeout has the same meaning as in poll(2). Pass 0 when there is work
+ * that can be done without waiting for new events.
+ */
+int cm_poll(struct connection_manager *cm, int timeout);
 
-int cm_connect(
+/*
+ * Returns the new connection or NULL on failure.
+ */
+struct connection *cm_connect(
+        struct connection_manager *cm,
+        struct sockaddr_in *addr,
+        size_t in_buf_size,
+        size_t out_buf_size,
+        int id);
+
+/*
+ * Same as cm_connect, but doesn't wait until the connection is established.
+ * The connection has CS_CONNECTING state until then. It is reported as changed
+ * when connect completes, failed connection gets CS_EOF state and is closed.
+ */
+struct connection *cm_connect_async(
         struct connection_manager *cm,
         struct sockaddr_in *addr,
         size_t in_buf_size,
@@ -46,7 +145,71 @@ int cm_add_connection(
         struct connection *connection,
         int fd);
 
-struct connection *const *cm_get_connections(struct connection_manager *cm, int *count);
+/*
+ * Connections are reported as changed when they are added, when data is transferred
+ * or when their state is changed by the manager. Each connection is reported once
+ * until it is taken by cm_pop_changed. Returns NULL when there are no changed connections.
+ */
+struct connection *cm_pop_changed(struct connection_manager *cm);
+
+void cm_mark_changed(struct connection_manager *cm, struct connection *c);
+
+/*
+ * Connections that received data are queued in the order of arrival, each priority class has its own queue.
+ * The pump serves the head connection of the highest class until it has sent its quantum,
+ * then moves it to the tail while it has data left (deficit round robin),
+ * so connections of a class share the tunnel in proportion to their quanta.
+ */
+void cm_queue_input(struct connection_manager *cm, struct connection *c);
+
+void cm_dequeue_input(struct connection_manager *cm, struct connection *c);
+
+/*
+ * Returns the first connection of the highest non-empty class or NULL if all queues are empty.
+ */
+struct connection *cm_input_head(struct connection_manager *cm);
+
+/*
+ * Move the connection to the priority class, a queued connection goes to the tail of the new class.
+ */
+void cm_set_priority(struct connection_manager *cm, struct connection *c, uint8_t priority);
+
+/*
+ * Connections with data too small for a frame wait in the deferred queue until they get more data
+ * or their defer_deadline comes. Connections must be deferred in the order of their deadlines.
+ * Deferred connection may be in the input queue at the same time.
+ */
+void cm_defer_input(struct connection_manager *cm, struct connection *c);
+
+void cm_undefer_input(struct connection_manager *cm, struct connection *c);
+
+/*
+ * Returns the deferred connection with the earliest deadline or NULL if there are none.
+ */
+struct connection *cm_deferred_head(struct connection_manager *cm);
+
+/*
+ * Disable Nagle's algorithm on the socket of the connection.
+ * Returns 0 on failure.
+ */
+int cm_set_nodelay(struct connection *c);
+
+/*
+ * Cork the socket of the connection (TCP_CORK), so the kernel sends only full segments.
+ * Partial segment is pushed by cm_poll push_delay milliseconds after the data is written.
+ * Only one connection of the manager can be corked. Returns 0 on failure.
+ */
+int cm_cork(struct connection_manager *cm, struct connection *c, int push_delay);
+
+/*
+ * Notify the manager that new data was put to the out_buf of the connection.
+ */
+void cm_schedule_write(struct connection_manager *cm, struct connection *c);
+
+/*
+ * Notify the manager that the connection or one of its directions was marked with CS_DELETE.
+ */
+void cm_schedule_close(struct connection_manager *cm, struct connection *c);
 
 struct connection *make_connection(
         struct sockaddr_in *addr,
@@ -54,13 +217,55 @@ struct connection *make_connection(
         size_t out_buf_size,
         int id);
 
+void free_connection(struct connection *c);
+
+/*
+ * Take connections with both buffers of buf_size bytes from the pools of the manager.
+ * Lazy buffers get their storage on the first data and return it when they are drained,
+ * so idle connections hold no buffer memory. Other connections are allocated by make_connection.
+ */
+void cm_init_pools(struct connection_manager *cm, size_t buf_size, int lazy_buffers);
+
+/*
+ * Let buffers of pooled connections grow up to max_size while the budget allows.
+ * Buffers that stay filled below a quarter are shrunk back step by step.
+ * Not used by the io_uring engine, which keeps the buffers registered.
+ */
+void cm_init_adaptive_buffers(struct connection_manager *cm, size_t max_size, struct buffer_budget *budget);
+
+/*
+ * Double the capacity of the buffer of the pooled connection that keeps filling it.
+ * Returns 0 if the buffer has maximal size or the budget is exhausted.
+ */
+int cm_grow_buffer(struct connection_manager *cm, struct connection *c, struct round_buffer *buf);
+
+/*
+ * Halve the capacity of the grown buffer if reserved bytes and data still fit.
+ * Returns 0 if the buffer is not shrunk.
+ */
+int cm_shrink_buffer(struct connection_manager *cm, struct connection *c, struct round_buffer *buf, size_t reserved);
+
 void cm_shutdown(struct connection_manager *m);
 
-struct connection_manager *init_manager();
+/*
+ * Interrupt the wait for events in cm_poll, may be called from another thread.
+ */
+void cm_wakeup(struct connection_manager *m);
+
+/*
+ * Record the time of every wakeup in cm_stats, system calls are always counted.
+ */
+void cm_enable_stats(struct connection_manager *cm);
+
+const struct cm_stats *cm_stats(struct connection_manager *cm);
+
+struct connection_manager *init_manager(int engine);
 
 struct connection_manager *init_accepting_manager(
+        int engine,
         struct sockaddr_in *addr,
-        int buf_size, int backlog);
+        int buf_size, int backlog,
+        int reuse_port);
 
 void destroy_manager(struct connection_manager *m);
 
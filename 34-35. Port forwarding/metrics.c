@@ -0,0 +1,281 @@
+#include "metrics.h"
+#include "manager.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Time the server waits for a shard to make the snapshot of its streams (ms)
+#define STREAMS_TIMEOUT 100
+
+struct metrics_server {
+    int listener;
+    // Write end wakes the server up to stop it
+    int pipe[2];
+    char *path;
+    struct shard_metrics *shards;
+    int shards_count;
+    pthread_t thread;
+};
+
+void histogram_add(struct histogram *h, uint64_t value) {
+    int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    if (bucket >= HISTOGRAM_BUCKETS)
+        bucket = HISTOGRAM_BUCKETS - 1;
+    metric_add(&h->buckets[bucket], 1);
+    metric_add(&h->count, 1);
+    metric_add(&h->sum, value);
+}
+
+void metrics_init(struct shard_metrics *m, int shard) {
+    memset(m, 0, sizeof(*m));
+    m->shard = shard;
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->cond, NULL);
+}
+
+void metrics_destroy(struct shard_metrics *m) {
+    free(m->streams_text);
+    pthread_mutex_destroy(&m->lock);
+    pthread_cond_destroy(&m->cond);
+}
+
+void metrics_publish_streams(struct shard_metrics *m, char *streams, size_t length) {
+    pthread_mutex_lock(&m->lock);
+    free(m->streams_text);
+    m->streams_text = streams;
+    m->streams_length = length;
+    __atomic_store_n(&m->streams_requested, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&m->cond);
+    pthread_mutex_unlock(&m->lock);
+}
+
+static uint64_t load(const uint64_t *metric) {
+    return __atomic_load_n(metric, __ATOMIC_RELAXED);
+}
+
+static void print_counter(FILE *f, const char *name, int shard, const uint64_t *metric) {
+    fprintf(f, "portfwd_%s{shard=\"%d\"} %llu\n", name, shard, (unsigned long long) load(metric));
+}
+
+/*
+ * Buckets are cumulative, as the format requires, and stop at the highest non-empty one.
+ */
+static void print_histogram(FILE *f, const char *name, int shard, const struct histogram *h) {
+    int last = HISTOGRAM_BUCKETS - 1;
+    while (last > 0 && load(&h->buckets[last]) == 0)
+        last--;
+    uint64_t total = 0;
+    for (int i = 0; i <= last; i++) {
+        total += load(&h->buckets[i]);
+        unsigned long long le = i == 0 ? 0 : (1ULL << i) - 1;
+        fprintf(f, "portfwd_%s_bucket{shard=\"%d\",le=\"%llu\"} %llu\n", name, shard, le, (unsigned long long) total);
+    }
+    fprintf(f, "portfwd_%s_bucket{shard=\"%d\",le=\"+Inf\"} %llu\n", name, shard, (unsigned long long) load(&h->count));
+    fprintf(f, "portfwd_%s_sum{shard=\"%d\"} %llu\n", name, shard, (unsigned long long) load(&h->sum));
+    fprintf(f, "portfwd_%s_count{shard=\"%d\"} %llu\n", name, shard, (unsigned long long) load(&h->count));
+}
+
+static void print_shard(FILE *f, int shard, struct shard_metrics *m) {
+    print_counter(f, "loops_total", shard, &m->loops);
+    print_counter(f, "syscalls_total", shard, &m->syscalls);
+    print_counter(f, "frames_encoded_total", shard, &m->frames_encoded);
+    print_counter(f, "frames_decoded_total", shard, &m->frames_decoded);
+    print_counter(f, "commands_encoded_total", shard, &m->commands_encoded);
+    print_counter(f, "commands_decoded_total", shard, &m->commands_decoded);
+    print_counter(f, "tunnel_received_bytes_total", shard, &m->tunnel_bytes_received);
+    print_counter(f, "tunnel_sent_bytes_total", shard, &m->tunnel_bytes_sent);
+    print_counter(f, "streams", shard, &m->streams);
+    print_counter(f, "tunnel_in_buffer_bytes", shard, &m->tunnel_in_length);
+    print_counter(f, "tunnel_out_buffer_bytes", shard, &m->tunnel_out_length);
+    print_counter(f, "tunnel_in_buffer_capacity_bytes", shard, &m->tunnel_in_capacity);
+    print_counter(f, "tunnel_out_buffer_capacity_bytes", shard, &m->tunnel_out_capacity);
+    print_counter(f, "cmd_queue_length", shard, &m->cmd_queue_length);
+    print_histogram(f, "loop_duration_ns", shard, &m->loop_ns);
+    print_histogram(f, "loop_syscalls", shard, &m->loop_syscalls);
+    print_histogram(f, "tunnel_out_buffer_occupancy_bytes", shard, &m->tunnel_out_occupancy);
+    print_histogram(f, "cmd_queue_depth", shard, &m->cmd_queue_depth);
+}
+
+/*
+ * Ask every shard for the snapshot of its streams and wait for all of them.
+ * Shard that doesn't answer in time (e.g. it is stopped) reports the previous snapshot.
+ */
+static void request_streams(struct metrics_server *s) {
+    for (int i = 0; i < s->shards_count; i++) {
+        struct shard_metrics *m = &s->shards[i];
+        __atomic_store_n(&m->streams_requested, 1, __ATOMIC_RELEASE);
+        cm_wakeup(m->manager);
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += STREAMS_TIMEOUT * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    for (int i = 0; i < s->shards_count; i++) {
+        struct shard_metrics *m = &s->shards[i];
+        pthread_mutex_lock(&m->lock);
+        while (metrics_streams_requested(m)) {
+            if (pthread_cond_timedwait(&m->cond, &m->lock, &deadline) == ETIMEDOUT) {
+                __atomic_store_n(&m->streams_requested, 0, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&m->lock);
+    }
+}
+
+static void serve(struct metrics_server *s, int client) {
+    char *text = NULL;
+    size_t length = 0;
+    FILE *f = open_memstream(&text, &length);
+    if (f == NULL) {
+        perror("metrics: open_memstream");
+        return;
+    }
+
+    request_streams(s);
+    for (int i = 0; i < s->shards_count; i++) {
+        struct shard_metrics *m = &s->shards[i];
+        print_shard(f, i, m);
+        pthread_mutex_lock(&m->lock);
+        if (m->streams_text != NULL)
+            fwrite(m->streams_text, 1, m->streams_length, f);
+        pthread_mutex_unlock(&m->lock);
+    }
+    if (fclose(f)) {
+        perror("metrics: fclose");
+        free(text);
+        return;
+    }
+
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t res = send(client, text + sent, length - sent, MSG_NOSIGNAL);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("metrics: send");
+            break;
+        }
+        sent += res;
+    }
+    free(text);
+}
+
+static void *run_server(void *arg) {
+    struct metrics_server *s = arg;
+    struct pollfd fds[2] = {{.fd = s->listener, .events = POLLIN}, {.fd = s->pipe[0], .events = POLLIN}};
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("metrics: poll");
+            return NULL;
+        }
+        if (fds[1].revents)
+            return NULL;
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        int client = accept(s->listener, NULL, NULL);
+        if (client == -1) {
+            if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+                perror("metrics: accept");
+            continue;
+        }
+        serve(s, client);
+        if (close(client))
+            perror("metrics: close");
+    }
+}
+
+struct metrics_server *start_metrics_server(const char *path, struct shard_metrics *shards, int shards_count) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "start_metrics_server: socket path is too long\n");
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    struct metrics_server *s = malloc(sizeof(struct metrics_server));
+    if (s == NULL) {
+        perror("start_metrics_server: malloc");
+        return NULL;
+    }
+    s->shards = shards;
+    s->shards_count = shards_count;
+    s->path = strdup(path);
+    if (s->path == NULL) {
+        perror("start_metrics_server: strdup");
+        goto path_failed;
+    }
+
+    s->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s->listener == -1) {
+        perror("start_metrics_server: socket");
+        goto socket_failed;
+    }
+    // Socket left by the previous run
+    unlink(path);
+    if (bind(s->listener, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(s->listener, SOMAXCONN) == -1) {
+        perror("start_metrics_server: bind");
+        goto listen_failed;
+    }
+
+    if (pipe(s->pipe) == -1) {
+        perror("start_metrics_server: pipe");
+        goto pipe_failed;
+    }
+    int err = pthread_create(&s->thread, NULL, run_server, s);
+    if (err) {
+        errno = err;
+        perror("start_metrics_server: pthread_create");
+        goto thread_failed;
+    }
+    return s;
+
+    thread_failed:
+    close(s->pipe[0]);
+    close(s->pipe[1]);
+
+    pipe_failed:
+    unlink(path);
+
+    listen_failed:
+    close(s->listener);
+
+    socket_failed:
+    free(s->path);
+
+    path_failed:
+    free(s);
+    return NULL;
+}
+
+void stop_metrics_server(struct metrics_server *s) {
+    if (s == NULL)
+        return;
+    uint8_t cmd = 0;
+    if (write(s->pipe[1], &cmd, 1) == -1)
+        perror("stop_metrics_server: write");
+    pthread_join(s->thread, NULL);
+    close(s->pipe[0]);
+    close(s->pipe[1]);
+    if (close(s->listener))
+        perror("stop_metrics_server: close");
+    unlink(s->path);
+    free(s->path);
+    free(s);
+}
@@ -0,0 +1,94 @@
+#ifndef METRICS_H_INCLUDED
+#define METRICS_H_INCLUDED
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bucket i counts values of i significant bits, i.e. from 2^(i-1) to 2^i - 1, bucket 0 counts zeros
+#define HISTOGRAM_BUCKETS 41
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+struct connection_manager;
+
+/*
+ * Metrics of one shard. Values are written only by the shard thread and read by the metrics server,
+ * so they are updated with relaxed atomic stores, which cost the same as plain ones.
+ */
+struct shard_metrics {
+    int shard;
+    uint64_t loops;
+    uint64_t syscalls;
+    uint64_t frames_encoded;
+    uint64_t frames_decoded;
+    uint64_t commands_encoded;
+    uint64_t commands_decoded;
+    uint64_t tunnel_bytes_received;
+    uint64_t tunnel_bytes_sent;
+    // Updated with the snapshot of streams
+    uint64_t streams;
+    uint64_t tunnel_in_length;
+    uint64_t tunnel_out_length;
+    uint64_t tunnel_in_capacity;
+    uint64_t tunnel_out_capacity;
+    uint64_t cmd_queue_length;
+    // Time from the end of the wait for events to the end of the update (ns)
+    struct histogram loop_ns;
+    struct histogram loop_syscalls;
+    // Sampled once per loop
+    struct histogram tunnel_out_occupancy;
+    struct histogram cmd_queue_depth;
+
+    // Manager of the shard is woken up to make the snapshot of streams
+    struct connection_manager *manager;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // Set by the server, the shard replaces streams_text with the new snapshot and clears the flag
+    int streams_requested;
+    char *streams_text;
+    size_t streams_length;
+};
+
+static inline void metric_set(uint64_t *metric, uint64_t value) {
+    __atomic_store_n(metric, value, __ATOMIC_RELAXED);
+}
+
+static inline void metric_add(uint64_t *metric, uint64_t value) {
+    metric_set(metric, __atomic_load_n(metric, __ATOMIC_RELAXED) + value);
+}
+
+void histogram_add(struct histogram *h, uint64_t value);
+
+void metrics_init(struct shard_metrics *m, int shard);
+
+void metrics_destroy(struct shard_metrics *m);
+
+/*
+ * Returns 1 if the server waits for the snapshot of streams.
+ */
+static inline int metrics_streams_requested(struct shard_metrics *m) {
+    return __atomic_load_n(&m->streams_requested, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Hand the snapshot of streams (allocated with malloc) over to the server, which frees it.
+ */
+void metrics_publish_streams(struct shard_metrics *m, char *streams, size_t length);
+
+struct metrics_server;
+
+/*
+ * Serve metrics of all shards on the Unix domain socket at path in the Prometheus text format.
+ * Every accepted connection gets the current values and is closed.
+ * Returns NULL on failure.
+ */
+struct metrics_server *start_metrics_server(const char *path, struct shard_metrics *shards, int shards_count);
+
+void stop_metrics_server(struct metrics_server *s);
+
+#endif
@@ -0,0 +1,59 @@
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+struct slab {
+    struct slab *next;
+    max_align_t objects[];
+};
+
+void pool_init(struct pool *p, size_t object_size, size_t slab_objects) {
+    // Free objects keep the pointer to the next free object
+    if (object_size < sizeof(void *))
+        object_size = sizeof(void *);
+    size_t align = sizeof(max_align_t);
+    p->object_size = (object_size + align - 1) / align * align;
+    p->slab_objects = slab_objects;
+    p->free_list = NULL;
+    p->slabs = NULL;
+}
+
+void pool_destroy(struct pool *p) {
+    while (p->slabs != NULL) {
+        struct slab *next = p->slabs->next;
+        free(p->slabs);
+        p->slabs = next;
+    }
+    p->free_list = NULL;
+}
+
+static int add_slab(struct pool *p) {
+    struct slab *slab = malloc(sizeof(struct slab) + p->object_size * p->slab_objects);
+    if (slab == NULL) {
+        perror("pool: malloc");
+        return 0;
+    }
+    slab->next = p->slabs;
+    p->slabs = slab;
+
+    char *obj = (char *) slab->objects;
+    for (size_t i = 0; i < p->slab_objects; i++, obj += p->object_size) {
+        *(void **) obj = p->free_list;
+        p->free_list = obj;
+    }
+    return 1;
+}
+
+void *pool_alloc(struct pool *p) {
+    if (p->free_list == NULL && !add_slab(p))
+        return NULL;
+    void *obj = p->free_list;
+    p->free_list = *(void **) obj;
+    return obj;
+}
+
+void pool_free(struct pool *p, void *ptr) {
+    *(void **) ptr = p->free_list;
+    p->free_list = ptr;
+}
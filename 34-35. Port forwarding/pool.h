@@ -0,0 +1,32 @@
+#ifndef POOL_H_INCLUDED
+#define POOL_H_INCLUDED
+
+#include <stddef.h>
+
+/*
+ * Pool of objects of the same size. Objects are allocated in slabs and recycled
+ * through the free list, memory is returned to the system only by pool_destroy.
+ * Pool is not thread-safe, every manager has its own pools.
+ */
+struct pool {
+    size_t object_size;
+    size_t slab_objects;
+    void *free_list;
+    struct slab *slabs;
+};
+
+void pool_init(struct pool *p, size_t object_size, size_t slab_objects);
+
+/*
+ * Free all slabs. Objects taken from the pool must not be used after that.
+ */
+void pool_destroy(struct pool *p);
+
+/*
+ * Returns NULL on failure.
+ */
+void *pool_alloc(struct pool *p);
+
+void pool_free(struct pool *p, void *ptr);
+
+#endif
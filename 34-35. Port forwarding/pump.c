@@ -1,197 +1,538 @@
 #include "pump.h"
 
 #include "command_queue.h"
+#include "lz.h"
+#include "stuffing.h"
 
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
-#define END_BYTE 0x7E
-#define ESC_BYTE 0x7F
+#define COMMAND_FRAME_LENGTH 5
+
+/*
+ * Frame of the binary protocol starts with the header:
+ * flags (1 byte), payload length (2 bytes), connection id (4 bytes), numbers are big endian.
+ * Command frames have FRAME_COMMAND flag, command argument in place of
+ * connection id and command code as a single byte payload.
+ * Payload of FRAME_COMPRESSED frames is the length of the original data (2 bytes) and the compressed block,
+ * credit is consumed by the original length.
+ */
+#define FRAME_HEADER_LENGTH 7
+#define FRAME_COMMAND 1
+#define FRAME_COMPRESSED 2
+/*
+ * Since PROTOCOL_BATCHED a frame with FRAME_COMMAND and FRAME_BATCH flags carries several commands,
+ * the header has the number of commands in place of connection id.
+ * Each command is its code (1 byte, BATCH_VALUE bit is set when the value follows), argument (4 bytes)
+ * and optional value (4 bytes).
+ */
+#define FRAME_BATCH 4
+#define BATCH_VALUE 0x80
+#define BATCH_ENTRY_LENGTH 5
+#define MAX_BATCH_ENTRY_LENGTH 9
+// Whole batch is decoded from a copy on the stack
+#define MAX_BATCH_PAYLOAD 1024
+#define COMPRESSED_PREFIX_LENGTH 2
+#define MAX_FRAME_PAYLOAD 0xFFFF
+#define BINARY_COMMAND_LENGTH (FRAME_HEADER_LENGTH + 1)
+// Command with 4-byte value after the command code
+#define MAX_COMMAND_LENGTH (FRAME_HEADER_LENGTH + 5)
+// While streams wait to be encoded, commands take at most 1/COMMAND_SHARE of the free tunnel buffer per transfer
+#define COMMAND_SHARE 2
+
+// Shorter payloads are not worth compressing
+#define MIN_COMPRESS_LENGTH 128
+// Original data of a compressed frame, the whole frame has to fit into the tunnel input buffer
+#define MAX_COMPRESS_LENGTH 16384
+// Compression is kept only if it saves at least 1/COMPRESS_MIN_SAVING of the payload
+#define COMPRESS_MIN_SAVING 8
+// After a poor attempt the stream sends this many bytes as is, doubled after each poor attempt in a row
+#define COMPRESS_BACKOFF 16384
+#define COMPRESS_MAX_BACKOFF_SHIFT 6
 
 struct pump {
     int sending_to;
-    int current_index;
+    // Payload bytes of the current binary frame not received yet
+    size_t remaining;
+    int max_version;
+    // Protocol versions used to encode and decode frames
+    int tx_version;
+    int rx_version;
+    // Credit is granted to all connections after switching to the version with flow control
+    int grant_all;
     void *cmd_handler_arg;
     command_handler cmd_handler;
     struct cmd_queue *cmd_queue;
+    int compress;
+    // Coalescing policy, see pump_set_coalescing
+    size_t min_payload;
+    uint64_t max_delay_ns;
+    // Original and compressed data of the frame being encoded or decoded
+    uint8_t *raw;
+    uint8_t *packed;
+    struct compression_stats stats;
+    struct frame_stats frames;
 };
 
-struct buf_iter {
-    struct iovec iov[MAX_IOV_LEN];
-    int iov_cnt;
-    int iov_ind;
-    uint8_t *ptr;
-    size_t rem;
-};
-
-static inline void prepare_buf_iter(struct buf_iter *iter) {
-    iter->iov_ind = 0;
-    iter->ptr = iter->iov[0].iov_base;
-    iter->rem = iter->iov[0].iov_len;
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static inline int buf_iter_next(struct buf_iter *iter) {
-    iter->ptr++;
-    if (--iter->rem == 0) {
-        if (++iter->iov_ind == iter->iov_cnt)
-            return 0;
-        iter->rem = iter->iov[iter->iov_ind].iov_len;
-        iter->ptr = iter->iov[iter->iov_ind].iov_base;
-    }
-    return 1;
+static void put_header(uint8_t *header, uint8_t flags, size_t length, uint32_t id) {
+    header[0] = flags;
+    header[1] = length >> 8;
+    header[2] = length & 0xFF;
+    header[3] = id >> 24;
+    header[4] = (id >> 16) & 0xFF;
+    header[5] = (id >> 8) & 0xFF;
+    header[6] = id & 0xFF;
 }
 
-static struct buf_iter get_read_iter(const struct round_buffer *buf) {
-    struct buf_iter iter;
-    iter.iov_cnt = buf_reading_iov(buf, iter.iov);
-    prepare_buf_iter(&iter);
-    return iter;
-}
+static int encode_command(struct connection *tunnel, uint8_t cmd, uint8_t arg) {
+    struct round_buffer *buf = tunnel->out_buf;
+    if (buf_free_length(buf) < COMMAND_FRAME_LENGTH)
+        return 0;
 
-static struct buf_iter get_write_iter(const struct round_buffer *buf) {
-    struct buf_iter iter;
-    iter.iov_cnt = buf_writing_iov(buf, iter.iov);
-    prepare_buf_iter(&iter);
-    return iter;
+    uint8_t frame[COMMAND_FRAME_LENGTH] = {END_BYTE, 0, cmd, arg, END_BYTE};
+    buf_put(buf, frame, COMMAND_FRAME_LENGTH);
+    return 1;
 }
 
 /*
- * Read bytes from src, encode them and write to dst.
- * Function tries to encode maximum possible number of bytes.
- * Returns 1 when src is empty or when at least one byte encoded,
- * and 0 if there are not enough space in dst buffer.
+ * Put the frame of the binary protocol with at most limit bytes of data from src to dst.
+ * When credit is not NULL, frame payload is limited by the credit and it is decreased.
+ * Returns 0 if there are not enough space in dst buffer.
  */
-static int encode(
+static int encode_frame(
         struct round_buffer *src,
         struct round_buffer *dst,
-        uint8_t connection_id) {
-    if (buf_data_length(src) == 0)
+        uint32_t connection_id,
+        uint32_t *credit,
+        size_t limit) {
+    size_t length = buf_data_length(src);
+    if (length > limit)
+        length = limit;
+    if (credit != NULL && length > *credit)
+        length = *credit;
+    if (length == 0)
         return 1;
 
-    struct buf_iter src_it = get_read_iter(src);
-    struct buf_iter dst_it = get_write_iter(dst);
-    size_t src_total = 0, dst_total = 0;
+    size_t avail = buf_free_length(dst);
+    if (avail <= FRAME_HEADER_LENGTH)
+        return 0;
+    if (length > avail - FRAME_HEADER_LENGTH)
+        length = avail - FRAME_HEADER_LENGTH;
+    if (length > MAX_FRAME_PAYLOAD)
+        length = MAX_FRAME_PAYLOAD;
+
+    uint8_t header[FRAME_HEADER_LENGTH];
+    put_header(header, 0, length, connection_id);
+    buf_put(dst, header, FRAME_HEADER_LENGTH);
+    buf_move(dst, src, length);
+    if (credit != NULL)
+        *credit -= length;
+    return 1;
+}
 
-    size_t dst_avail = buf_free_length(dst);
-    int first = *src_it.ptr;
-    if (first == -1 || dst_avail < 4 || (first == ESC_BYTE && dst_avail < 5))
+/*
+ * Encode at most limit bytes of the connection into a compressed frame.
+ * Data that is short or compresses poorly is encoded with encode_frame,
+ * and after a poor attempt the connection skips compression for a while.
+ * Returns 0 if there are not enough space in dst buffer.
+ */
+static int encode_compressed_frame(struct pump *pump, struct connection *c, struct round_buffer *dst, size_t limit) {
+    size_t length = buf_data_length(c->in_buf);
+    if (length > limit)
+        length = limit;
+    if (length > c->tx_credit)
+        length = c->tx_credit;
+    if (length > MAX_COMPRESS_LENGTH)
+        length = MAX_COMPRESS_LENGTH;
+    size_t avail = buf_free_length(dst);
+    if (avail <= FRAME_HEADER_LENGTH + COMPRESSED_PREFIX_LENGTH)
         return 0;
+    if (length > avail - FRAME_HEADER_LENGTH - COMPRESSED_PREFIX_LENGTH)
+        length = avail - FRAME_HEADER_LENGTH - COMPRESSED_PREFIX_LENGTH;
+
+    if (c->compress_skip > 0 || length < MIN_COMPRESS_LENGTH) {
+        size_t before = buf_data_length(c->in_buf);
+        int encoded = encode_frame(c->in_buf, dst, c->id, &c->tx_credit, length);
+        size_t sent = before - buf_data_length(c->in_buf);
+        c->compress_skip -= sent < c->compress_skip ? sent : c->compress_skip;
+        pump->stats.bypassed_bytes += sent;
+        return encoded;
+    }
 
-    *dst_it.ptr = END_BYTE;
-    buf_iter_next(&dst_it);
-    dst_total++;
-    *dst_it.ptr = connection_id;
-    buf_iter_next(&dst_it);
-    dst_total++;
-
-    size_t dst_rem = dst_avail - 3;
-    while (dst_rem > 0) {
-        uint8_t b = *src_it.ptr;
-        if (b == ESC_BYTE || b == END_BYTE) {
-            if (dst_rem < 2)
-                break;
+    buf_peek(c->in_buf, pump->raw, length);
+    uint64_t start = now_ns();
+    size_t packed = lz_compress(pump->raw, length, pump->packed + FRAME_HEADER_LENGTH + COMPRESSED_PREFIX_LENGTH,
+                                length - length / COMPRESS_MIN_SAVING);
+    pump->stats.compress_ns += now_ns() - start;
+    if (packed == 0) {
+        int shift = c->compress_failures < COMPRESS_MAX_BACKOFF_SHIFT ? c->compress_failures : COMPRESS_MAX_BACKOFF_SHIFT;
+        c->compress_skip = (uint32_t) COMPRESS_BACKOFF << shift;
+        if (c->compress_failures < UINT8_MAX)
+            c->compress_failures++;
+        // Data is sent as is, exactly the length given to the compressor
+        encode_frame(c->in_buf, dst, c->id, NULL, length);
+        c->tx_credit -= length;
+        pump->stats.rejected_bytes += length;
+        return 1;
+    }
+    c->compress_failures = 0;
+
+    uint8_t *frame = pump->packed;
+    put_header(frame, FRAME_COMPRESSED, COMPRESSED_PREFIX_LENGTH + packed, c->id);
+    frame[FRAME_HEADER_LENGTH] = length >> 8;
+    frame[FRAME_HEADER_LENGTH + 1] = length & 0xFF;
+    buf_put(dst, frame, FRAME_HEADER_LENGTH + COMPRESSED_PREFIX_LENGTH + packed);
+    buf_advance_read_ptr(c->in_buf, length);
+    c->tx_credit -= length;
+    pump->stats.raw_bytes += length;
+    pump->stats.compressed_bytes += packed;
+    return 1;
+}
 
-            *dst_it.ptr = ESC_BYTE;
-            buf_iter_next(&dst_it);
-            dst_rem--;
-            dst_total++;
-        }
-        *dst_it.ptr = b;
-        dst_rem--;
-        dst_total++;
+static void put_u32(uint8_t *dst, uint32_t value) {
+    dst[0] = value >> 24;
+    dst[1] = (value >> 16) & 0xFF;
+    dst[2] = (value >> 8) & 0xFF;
+    dst[3] = value & 0xFF;
+}
 
-        src_total++;
-        buf_iter_next(&dst_it);
-        if (!buf_iter_next(&src_it))
-            break;
-    }
+static uint32_t get_u32(const uint8_t *src) {
+    return (uint32_t) src[0] << 24 | (uint32_t) src[1] << 16 | (uint32_t) src[2] << 8 | src[3];
+}
 
-    *dst_it.ptr = END_BYTE;
-    dst_total++;
+// Value of other commands is optional, peers that don't expect it skip it
+static int has_value(struct command cmd) {
+    return cmd.cmd == CMD_WINDOW_UPDATE || cmd.cmd == CMD_WINDOW_RETURN || cmd.value != 0;
+}
 
-    buf_advance_read_ptr(src, src_total);
-    buf_advance_write_ptr(dst, dst_total);
+static int encode_binary_command(struct connection *tunnel, struct command cmd) {
+    struct round_buffer *buf = tunnel->out_buf;
+    if (buf_free_length(buf) < MAX_COMMAND_LENGTH)
+        return 0;
+
+    uint8_t frame[MAX_COMMAND_LENGTH];
+    size_t length = has_value(cmd) ? 5 : 1;
+    put_header(frame, FRAME_COMMAND, length, cmd.arg);
+    uint8_t *payload = frame + FRAME_HEADER_LENGTH;
+    payload[0] = cmd.cmd;
+    put_u32(payload + 1, cmd.value);
+    buf_put(buf, frame, FRAME_HEADER_LENGTH + length);
     return 1;
 }
 
 /*
- * Read bytes from src, decode them and write to dst.
- * Bytes are read until the END_BYTE or the end of src buffer or until dsc buffer is full
+ * Move queued commands to a single batch frame of at most limit bytes.
+ * Returns number of commands encoded, 0 if the frame doesn't fit.
  */
-static int decode(
-        struct round_buffer *src,
-        struct round_buffer *dst) {
-    struct buf_iter src_it = get_read_iter(src);
-    struct buf_iter dst_it = get_write_iter(dst);
-
-    int end_reached = 0;
-    size_t dst_rem = buf_free_length(dst);
-    size_t src_total = 0;
-    size_t dst_total = 0;
-    while (dst_rem > 0) {
-        uint8_t b = *src_it.ptr;
-        src_total++;
-        if (b == END_BYTE) {
-            // No need to increment iterator
-            end_reached = 1;
-            break;
-        }
-        if (b == ESC_BYTE) {
-            buf_iter_next(&src_it);
-            b = *src_it.ptr;
-            src_total++;
+static size_t encode_command_batch(struct connection *tunnel, struct cmd_queue *q, size_t limit) {
+    if (limit > buf_free_length(tunnel->out_buf))
+        limit = buf_free_length(tunnel->out_buf);
+    if (limit < FRAME_HEADER_LENGTH + MAX_BATCH_ENTRY_LENGTH)
+        return 0;
+    limit -= FRAME_HEADER_LENGTH;
+    if (limit > MAX_BATCH_PAYLOAD)
+        limit = MAX_BATCH_PAYLOAD;
+
+    uint8_t frame[FRAME_HEADER_LENGTH + MAX_BATCH_PAYLOAD];
+    uint8_t *payload = frame + FRAME_HEADER_LENGTH;
+    size_t length = 0, count = 0;
+    while (cmdq_length(q) > 0 && length + MAX_BATCH_ENTRY_LENGTH <= limit) {
+        struct command cmd = cmdq_dequeue(q);
+        uint8_t *entry = payload + length;
+        entry[0] = cmd.cmd;
+        put_u32(entry + 1, cmd.arg);
+        length += BATCH_ENTRY_LENGTH;
+        if (has_value(cmd)) {
+            entry[0] |= BATCH_VALUE;
+            put_u32(entry + BATCH_ENTRY_LENGTH, cmd.value);
+            length += MAX_BATCH_ENTRY_LENGTH - BATCH_ENTRY_LENGTH;
         }
-        *dst_it.ptr = b;
-        buf_iter_next(&dst_it);
-        dst_total++;
-        dst_rem--;
-        if (!buf_iter_next(&src_it))
-            break;
+        count++;
     }
-    buf_advance_read_ptr(src, src_total);
-    buf_advance_write_ptr(dst, dst_total);
-    return end_reached;
+    put_header(frame, FRAME_COMMAND | FRAME_BATCH, length, count);
+    buf_put(tunnel->out_buf, frame, FRAME_HEADER_LENGTH + length);
+    return count;
 }
 
-static int encode_command(struct connection *tunnel, uint8_t cmd, uint8_t arg) {
-    struct round_buffer *buf = tunnel->out_buf;
-    size_t avail = buf_free_length(buf);
-    if (avail < 5)
-        return 0;
+/*
+ * Without flow control the output buffer limits the stream when it is full, so let it grow.
+ * With flow control the peer reports when it is blocked by credit.
+ */
+static void output_filled(struct pump *pump, struct connection_manager *cm, struct connection *c) {
+    if (pump->rx_version < PROTOCOL_CREDIT && buf_full(c->out_buf))
+        cm_grow_buffer(cm, c, c->out_buf);
+}
 
-    struct buf_iter it = get_write_iter(buf);
+/*
+ * Returns 1 if the command is handled, -1 if it violates the protocol.
+ */
+static int handle_command(struct pump *pump, struct connection_manager *cm,
+                           uint8_t cmd, uint32_t arg, uint32_t value, struct conn_table *table) {
+    pump->frames.commands_decoded++;
+    if (cmd == CMD_WINDOW_UPDATE) {
+        // Update may be late and refer to the closed connection
+        struct connection *c = table_get(table, arg);
+        if (c != NULL) {
+            c->tx_credit += value;
+            c->credit_blocked = 0;
+            // Connection blocked by the credit may continue sending
+            if (!buf_empty(c->in_buf))
+                cm_queue_input(cm, c);
+        }
+    } else if (cmd == CMD_WINDOW_BLOCKED) {
+        // Credit is the limit unless the service doesn't read the data fast enough
+        struct connection *c = table_get(table, arg);
+        if (c != NULL && buf_data_length(c->out_buf) < (size_t) buf_capacity(c->out_buf) / 2 &&
+            cm_grow_buffer(cm, c, c->out_buf) && !pump_grant_credit(pump, c))
+            cm_mark_changed(cm, c);
+    } else if (cmd == CMD_WINDOW_RECLAIM) {
+        struct connection *c = table_get(table, arg);
+        if (c != NULL && c->tx_credit > 0) {
+            struct command ret = {.cmd = CMD_WINDOW_RETURN, .arg = arg, .value = c->tx_credit};
+            if (cmdq_enqueue(pump->cmd_queue, ret))
+                c->tx_credit = 0;
+        }
+    } else if (cmd == CMD_WINDOW_RETURN) {
+        struct connection *c = table_get(table, arg);
+        if (c != NULL) {
+            c->rx_granted -= value < c->rx_granted ? value : c->rx_granted;
+            cm_shrink_buffer(cm, c, c->out_buf, c->rx_granted);
+            // Controller grants the credit the shrunk buffer can accept
+            cm_mark_changed(cm, c);
+        }
+    } else if (cmd == CMD_HELLO) {
+        int version = arg < (uint32_t) pump->max_version ? (int) arg : pump->max_version;
+        if (pump->tx_version == PROTOCOL_STUFFED && version > PROTOCOL_STUFFED) {
+            // Everything after this command is encoded with the new version.
+            if (!send_command(pump, CMD_SWITCH, version))
+                fprintf(stderr, "pump: command queue overflow, protocol is not switched\n");
+        }
+    } else if (cmd == CMD_SWITCH) {
+        // Peer switches once, to a version offered by HELLO, everything after it is decoded with that version
+        if (pump->rx_version != PROTOCOL_STUFFED || arg < PROTOCOL_STUFFED || arg > (uint32_t) pump->max_version) {
+            fprintf(stderr, "pump: protocol violation: switch from version %d to %u\n", pump->rx_version, arg);
+            return -1;
+        }
+        if (pump->rx_version < PROTOCOL_CREDIT && (int) arg >= PROTOCOL_CREDIT)
+            pump->grant_all = 1;
+        pump->rx_version = arg;
+        printf("Peer switched to protocol version %u\n", arg);
+    } else {
+        return pump->cmd_handler(pump->cmd_handler_arg, cmd, arg, value);
+    }
+    return 1;
+}
+
+/*
+ * Move payload of the current binary frame to the connection.
+ * Payload of closed connection is dropped.
+ */
+static void recv_payload(struct pump *pump, struct connection_manager *cm, struct round_buffer *buf,
+                         struct conn_table *table) {
+    struct connection *c = table_get(table, pump->sending_to);
+    size_t moved;
+    if (c != NULL) {
+        moved = buf_move(c->out_buf, buf, pump->remaining);
+        c->rx_granted -= moved < c->rx_granted ? moved : c->rx_granted;
+        cm_schedule_write(cm, c);
+        output_filled(pump, cm, c);
+    } else {
+        moved = buf_advance_read_ptr(buf, pump->remaining);
+    }
+    pump->remaining -= moved;
+    if (pump->remaining == 0)
+        pump->sending_to = -1;
+}
 
-    *it.ptr = END_BYTE;
-    buf_iter_next(&it);
+/*
+ * Decompress the whole frame from the tunnel buffer to the connection.
+ * Data of closed connection is dropped.
+ * Returns 1 on success, -1 if the frame is malformed or exceeds the credit of the connection.
+ */
+static int recv_compressed(struct pump *pump, struct connection_manager *cm, struct round_buffer *buf,
+                            uint32_t conn_id, size_t length, struct conn_table *table) {
+    buf_advance_read_ptr(buf, FRAME_HEADER_LENGTH);
+    buf_peek(buf, pump->packed, length);
+    buf_advance_read_ptr(buf, length);
+
+    ssize_t restored = -1;
+    size_t original = 0;
+    if (length >= COMPRESSED_PREFIX_LENGTH) {
+        original = (size_t) pump->packed[0] << 8 | pump->packed[1];
+        uint64_t start = now_ns();
+        restored = lz_decompress(pump->packed + COMPRESSED_PREFIX_LENGTH, length - COMPRESSED_PREFIX_LENGTH,
+                                 pump->raw, original);
+        pump->stats.decompress_ns += now_ns() - start;
+    }
+    if (restored != (ssize_t) original) {
+        fprintf(stderr, "pump: protocol violation: malformed compressed frame\n");
+        return -1;
+    }
+    pump->stats.received_bytes += length;
+    pump->stats.decompressed_bytes += original;
 
-    *it.ptr = 0;
-    buf_iter_next(&it);
+    struct connection *c = table_get(table, conn_id);
+    if (c == NULL) {
+        fprintf(stderr, "pump: data for closed connection %u is dropped\n", conn_id);
+        return 1;
+    }
+    // Compressed frames are sent only within the credit, which the output buffer always has room for
+    if (buf_free_length(c->out_buf) < original) {
+        fprintf(stderr, "pump: protocol violation: connection %u got more data than its credit\n", conn_id);
+        return -1;
+    }
+    buf_put(c->out_buf, pump->raw, original);
+    c->rx_granted -= original < c->rx_granted ? original : c->rx_granted;
+    cm_schedule_write(cm, c);
+    output_filled(pump, cm, c);
+    return 1;
+}
 
-    *it.ptr = cmd;
-    buf_iter_next(&it);
+/*
+ * Handle every command of the whole batch frame of count commands from the tunnel buffer.
+ * The batch is checked before any of its commands is handled.
+ * Returns 1 on success, -1 if the batch is malformed.
+ */
+static int recv_command_batch(struct pump *pump, struct connection_manager *cm, struct round_buffer *buf,
+                              size_t length, uint32_t count, struct conn_table *table) {
+    if (length == 0 || length > MAX_BATCH_PAYLOAD) {
+        fprintf(stderr, "pump: protocol violation: command batch of %zu bytes\n", length);
+        return -1;
+    }
+    uint8_t payload[MAX_BATCH_PAYLOAD];
+    buf_advance_read_ptr(buf, FRAME_HEADER_LENGTH);
+    buf_peek(buf, payload, length);
+    buf_advance_read_ptr(buf, length);
+
+    size_t pos = 0, entries = 0;
+    while (pos < length) {
+        size_t entry_length = payload[pos] & BATCH_VALUE ? MAX_BATCH_ENTRY_LENGTH : BATCH_ENTRY_LENGTH;
+        if (length - pos < entry_length)
+            break;
+        pos += entry_length;
+        entries++;
+    }
+    if (pos != length || entries != count) {
+        fprintf(stderr, "pump: protocol violation: malformed command batch\n");
+        return -1;
+    }
 
-    *it.ptr = arg;
-    buf_iter_next(&it);
+    for (pos = 0; pos < length;) {
+        uint8_t *entry = payload + pos;
+        uint32_t value = entry[0] & BATCH_VALUE ? get_u32(entry + BATCH_ENTRY_LENGTH) : 0;
+        if (handle_command(pump, cm, entry[0] & ~BATCH_VALUE, get_u32(entry + 1), value, table) == -1)
+            return -1;
+        pos += entry[0] & BATCH_VALUE ? MAX_BATCH_ENTRY_LENGTH : BATCH_ENTRY_LENGTH;
+    }
+    return 1;
+}
 
-    *it.ptr = END_BYTE;
-    buf_iter_next(&it);
+/*
+ * Decode the next frame of the binary protocol.
+ * Returns 1 if any data was consumed from the tunnel input buffer, -1 on protocol violation.
+ */
+static int recv_binary(
+        struct pump *pump,
+        struct connection_manager *cm,
+        struct connection *tunnel,
+        struct conn_table *table) {
+    struct round_buffer *buf = tunnel->in_buf;
+    size_t initial = buf_data_length(buf);
 
-    buf_advance_write_ptr(buf, 5);
+    if (pump->sending_to != -1) {
+        recv_payload(pump, cm, buf, table);
+        if (pump->sending_to != -1)
+            return buf_data_length(buf) != initial;
+    }
 
+    uint8_t frame[MAX_COMMAND_LENGTH];
+    if (buf_peek(buf, frame, FRAME_HEADER_LENGTH) < FRAME_HEADER_LENGTH)
+        return buf_data_length(buf) != initial;
+
+    size_t length = (size_t) frame[1] << 8 | frame[2];
+    uint32_t conn_id = get_u32(frame + 3);
+    if ((frame[0] & FRAME_COMMAND) && (frame[0] & FRAME_BATCH)) {
+        if (buf_data_length(buf) < FRAME_HEADER_LENGTH + length)
+            return buf_data_length(buf) != initial;
+        return recv_command_batch(pump, cm, buf, length, conn_id, table);
+    } else if (frame[0] & FRAME_COMMAND) {
+        if (length == 0) {
+            fprintf(stderr, "pump: protocol violation: command frame without command code\n");
+            return -1;
+        }
+        if (buf_data_length(buf) < FRAME_HEADER_LENGTH + length)
+            return buf_data_length(buf) != initial;
+        buf_peek(buf, frame, MAX_COMMAND_LENGTH);
+        // Unknown parts of the command are skipped
+        buf_advance_read_ptr(buf, FRAME_HEADER_LENGTH + length);
+        uint8_t *payload = frame + FRAME_HEADER_LENGTH;
+        uint32_t value = 0;
+        if (length >= 5)
+            value = get_u32(payload + 1);
+        if (handle_command(pump, cm, payload[0], conn_id, value, table) == -1)
+            return -1;
+    } else {
+        if (conn_id == 0 || conn_id > MAX_STREAM_ID) {
+            fprintf(stderr, "pump: protocol violation: wrong connection id %u\n", conn_id);
+            return -1;
+        }
+        if (frame[0] & FRAME_COMPRESSED) {
+            // Buffers for decompression exist only if this side offered the version
+            if (pump->rx_version < PROTOCOL_COMPRESSED || pump->max_version < PROTOCOL_COMPRESSED) {
+                fprintf(stderr, "pump: protocol violation: compressed frame in version %d\n", pump->rx_version);
+                return -1;
+            }
+            if (buf_data_length(buf) < FRAME_HEADER_LENGTH + length)
+                return buf_data_length(buf) != initial;
+            pump->frames.frames_decoded++;
+            return recv_compressed(pump, cm, buf, conn_id, length, table);
+        }
+        if (table_get(table, conn_id) == NULL)
+            fprintf(stderr, "pump: data for closed connection %u is dropped\n", conn_id);
+        buf_advance_read_ptr(buf, FRAME_HEADER_LENGTH);
+        pump->frames.frames_decoded++;
+        pump->sending_to = conn_id;
+        pump->remaining = length;
+        if (length > 0)
+            recv_payload(pump, cm, buf, table);
+        else
+            pump->sending_to = -1;
+    }
     return 1;
 }
 
-static void recv_from_tunnel(struct pump *pump, struct connection *tunnel, struct connection **connections) {
+/*
+ * Decode the next frame of the stuffed protocol.
+ * Returns 1 if any data was consumed from the tunnel input buffer, -1 on protocol violation.
+ */
+static int recv_stuffed(
+        struct pump *pump,
+        struct connection_manager *cm,
+        struct connection *tunnel,
+        struct conn_table *table) {
     struct round_buffer *buf = tunnel->in_buf;
-    if (buf_empty(buf))
-        return;
-
+    size_t initial = buf_data_length(buf);
     if (pump->sending_to != -1) {
         // Continue to send data from tunnel to connection until the end of the message.
-        if (!decode(buf, connections[pump->sending_to]->out_buf))
-            return;
+        struct connection *c = table_get(table, pump->sending_to);
+        if (c == NULL) {
+            fprintf(stderr, "pump: protocol violation: usage of closed connection\n");
+            return -1;
+        }
+        int end_reached = stuffing_decode(buf, c->out_buf);
+        cm_schedule_write(cm, c);
+        output_filled(pump, cm, c);
+        if (!end_reached)
+            return buf_data_length(buf) != initial;
         pump->sending_to = -1;
     }
     // If input buffer contains END_BYTE(0x7E), connection_id and at least one byte of data
@@ -199,76 +540,313 @@ static void recv_from_tunnel(struct pump *pump, struct connection *tunnel, struc
     size_t available = buf_data_length(buf);
     if (available > 3) {
         uint8_t start[3];
-        if (buf_peek(buf, start, 3) == -1) {
-            printf("PANIC!!!\n");
-            exit(2);
-        }
-
+        buf_peek(buf, start, 3);
         if (start[0] != END_BYTE) {
             fprintf(stderr, "pump: protocol violation: wrong starting byte\n");
-            // TODO: shutdown
-            exit(2);
+            return -1;
         }
         int conn_id = start[1];
         if (conn_id == 0) {
             int cmd = start[2];
             if (available < 5) {
                 // Wait for more data
-                return;
+                return buf_data_length(buf) != initial;
             }
             buf_advance_read_ptr(buf, 3);
             int arg = buf_peek_byte(buf);
-            pump->cmd_handler(pump->cmd_handler_arg, cmd, arg);
             buf_advance_read_ptr(buf, 2);
+            if (handle_command(pump, cm, cmd, arg, 0, table) == -1)
+                return -1;
         } else {
-            if (connections[conn_id] == NULL) {
+            struct connection *c = table_get(table, conn_id);
+            if (c == NULL) {
                 fprintf(stderr, "pump: protocol violation: usage of closed connection\n");
-                // TODO: shutdown
-                exit(2);
+                return -1;
             }
             buf_advance_read_ptr(buf, 2);
-            if (!decode(buf, connections[conn_id]->out_buf)) {
+            pump->frames.frames_decoded++;
+            int end_reached = stuffing_decode(buf, c->out_buf);
+            cm_schedule_write(cm, c);
+            output_filled(pump, cm, c);
+            if (!end_reached)
                 pump->sending_to = conn_id;
-                return;
-            }
         }
     }
+    return buf_data_length(buf) != initial;
 }
 
-int send_command(struct pump *pump, uint8_t cmd, uint8_t arg) {
+/*
+ * Decode every complete frame received from the tunnel, so a buffer of small frames is handled in one pass.
+ * Frames are taken in order, decoding stops at an incomplete frame or at the payload
+ * that the output buffer of its connection can't accept (only without flow control).
+ * Returns 1 if any data was consumed from the tunnel input buffer, -1 on protocol violation.
+ */
+static int recv_from_tunnel(
+        struct pump *pump,
+        struct connection_manager *cm,
+        struct connection *tunnel,
+        struct conn_table *table) {
+    struct round_buffer *buf = tunnel->in_buf;
+    int received = 0;
+    // Version is checked for every frame, SWITCH changes it in the middle of the buffer
+    while (!buf_empty(buf)) {
+        int progress = pump->rx_version >= PROTOCOL_BINARY ? recv_binary(pump, cm, tunnel, table)
+                                                           : recv_stuffed(pump, cm, tunnel, table);
+        if (progress == -1)
+            return -1;
+        if (!progress)
+            break;
+        received = 1;
+    }
+    return received;
+}
+
+int send_command(struct pump *pump, uint8_t cmd, uint32_t arg) {
     return cmdq_enqueue(pump->cmd_queue, (struct command) {.cmd = cmd, .arg=arg});
 }
 
-void pump_transfer(struct pump *pump, struct connection **connections) {
-    struct connection *tunnel = connections[0];
+int send_command_with_value(struct pump *pump, uint8_t cmd, uint32_t arg, uint32_t value) {
+    return cmdq_enqueue(pump->cmd_queue, (struct command) {.cmd = cmd, .arg = arg, .value = value});
+}
 
-    recv_from_tunnel(pump, tunnel, connections);
+void pump_enable_compression(struct pump *pump) {
+    pump->compress = 1;
+}
 
-    // Commands have highest priority
+const struct compression_stats *pump_compression_stats(struct pump *pump) {
+    return &pump->stats;
+}
+
+const struct frame_stats *pump_frame_stats(struct pump *pump) {
+    return &pump->frames;
+}
+
+size_t pump_cmd_queue_length(struct pump *pump) {
+    return cmdq_length(pump->cmd_queue);
+}
+
+void pump_set_coalescing(struct pump *pump, size_t min_payload, int max_delay) {
+    pump->min_payload = min_payload;
+    pump->max_delay_ns = (uint64_t) max_delay * 1000000;
+}
+
+int pump_timeout(struct connection_manager *cm) {
+    struct connection *c = cm_deferred_head(cm);
+    if (c == NULL)
+        return -1;
+    uint64_t now = now_ns();
+    if (c->defer_deadline <= now)
+        return 0;
+    // Round up, so the frame is not found early again
+    return (c->defer_deadline - now + 999999) / 1000000;
+}
+
+int pump_reclaim_credit(struct pump *pump, struct connection *c) {
+    if (pump->tx_version < PROTOCOL_ADAPTIVE)
+        return 1;
+    return cmdq_enqueue(pump->cmd_queue, (struct command) {.cmd = CMD_WINDOW_RECLAIM, .arg = c->id});
+}
+
+int pump_max_id(struct pump *pump) {
+    return pump->tx_version >= PROTOCOL_BINARY ? MAX_STREAM_ID : MAX_STUFFED_ID;
+}
+
+/*
+ * Allow the peer to send as much data as the output buffer of the connection can accept.
+ * Credit is granted in big portions to keep the number of commands low.
+ */
+int pump_grant_credit(struct pump *pump, struct connection *c) {
+    if (pump->rx_version < PROTOCOL_CREDIT)
+        return 1;
+    if ((c->state & (CS_NEW | CS_DELETE)) || !is_alive(c->out_state))
+        return 1;
+
+    size_t capacity = buf_capacity(c->out_buf);
+    size_t used = buf_data_length(c->out_buf) + c->rx_granted;
+    if (used + capacity / 4 > capacity)
+        return 1;
+
+    size_t credit = capacity - used;
+    struct command cmd = {.cmd = CMD_WINDOW_UPDATE, .arg = c->id, .value = credit};
+    if (!cmdq_enqueue(pump->cmd_queue, cmd))
+        return 0;
+    c->rx_granted += credit;
+    return 1;
+}
+
+/*
+ * Returns 1 if the connection can't send data now. Such connections leave the input queue
+ * and are queued again when they receive data or credit or when they are announced to the peer.
+ */
+static int input_blocked(struct pump *pump, struct connection *c) {
+    // Data received before EOF still has to be delivered.
+    if ((c->state & (CS_NEW | CS_DELETE)) || (c->in_state & CS_DELETE) || buf_empty(c->in_buf))
+        return 1;
+    return pump->tx_version >= PROTOCOL_CREDIT && c->tx_credit == 0;
+}
+
+/*
+ * Let the peer know that the connection has used all its credit and has more data,
+ * so the peer may grow its buffer. Connection is reported once until it gets new credit.
+ */
+static void report_blocked(struct pump *pump, struct connection *c) {
+    if (pump->tx_version < PROTOCOL_ADAPTIVE || c->credit_blocked || c->tx_credit > 0 || buf_empty(c->in_buf))
+        return;
+    if (cmdq_enqueue(pump->cmd_queue, (struct command) {.cmd = CMD_WINDOW_BLOCKED, .arg = c->id}))
+        c->credit_blocked = 1;
+}
+
+/*
+ * Returns 1 if the frame of the connection is too small to be sent now.
+ * Held connection is deferred until the deadline, data received meanwhile goes to the same frame.
+ */
+static int hold_frame(struct pump *pump, struct connection_manager *cm, struct connection *c, uint64_t now) {
+    if (buf_data_length(c->in_buf) >= pump->min_payload || !is_alive(c->in_state))
+        return 0;
+    if (c->defer_deadline == 0) {
+        c->defer_deadline = now + pump->max_delay_ns;
+        cm_defer_input(cm, c);
+    }
+    return c->defer_deadline > now;
+}
+
+int pump_transfer(struct pump *pump, struct connection_manager *cm, struct conn_table *table) {
+    struct connection *tunnel = table->items[0];
+
+    // Data left in the tunnel buffer waits for the rest of its frame or for the output buffer to drain
+    if (recv_from_tunnel(pump, cm, tunnel, table) == -1)
+        return -1;
+    int pending = 0;
+
+    if (pump->grant_all) {
+        pump->grant_all = 0;
+        for (size_t i = 1; i < table->count; i++) {
+            if (table->items[i] != NULL && !pump_grant_credit(pump, table->items[i])) {
+                // Queue is full, the rest is granted by the next call
+                pump->grant_all = 1;
+                break;
+            }
+        }
+    }
+
+    // Commands go first, but a burst of them leaves room for the data of waiting streams,
+    // commands that don't fit are sent by the next transfer, which is not delayed.
+    size_t command_length = pump->tx_version >= PROTOCOL_BINARY ? MAX_COMMAND_LENGTH : COMMAND_FRAME_LENGTH;
+    size_t command_budget = buf_free_length(tunnel->out_buf);
+    if (cm_input_head(cm) != NULL)
+        command_budget /= COMMAND_SHARE;
+    // At least one command is sent whenever it fits, so the queue always moves
+    if (command_budget < command_length)
+        command_budget = command_length;
     while (cmdq_length(pump->cmd_queue)) {
-        struct command cmd = cmdq_dequeue(pump->cmd_queue);
-        if (!encode_command(tunnel, cmd.cmd, cmd.arg)) {
-            // Buffer is full
-            return;
+        if (buf_free_length(tunnel->out_buf) < command_length) {
+            // Buffer is full, keep the command in the queue
+            cm_schedule_write(cm, tunnel);
+            return pending;
+        }
+        if (command_budget < command_length) {
+            pending = 1;
+            break;
         }
+        size_t free_before = buf_free_length(tunnel->out_buf);
+        size_t room = free_before < command_budget ? free_before : command_budget;
+        if (pump->tx_version >= PROTOCOL_BATCHED && cmdq_length(pump->cmd_queue) > 1 &&
+            room >= FRAME_HEADER_LENGTH + 2 * MAX_BATCH_ENTRY_LENGTH) {
+            pump->frames.commands_encoded += encode_command_batch(tunnel, pump->cmd_queue, room);
+        } else {
+            struct command cmd = cmdq_dequeue(pump->cmd_queue);
+            pump->frames.commands_encoded++;
+            if (pump->tx_version >= PROTOCOL_BINARY) {
+                encode_binary_command(tunnel, cmd);
+            } else {
+                encode_command(tunnel, cmd.cmd, cmd.arg);
+                if (cmd.cmd == CMD_SWITCH) {
+                    pump->tx_version = cmd.arg;
+                    command_length = MAX_COMMAND_LENGTH;
+                }
+            }
+        }
+        command_budget -= free_before - buf_free_length(tunnel->out_buf);
     }
 
-    int index = pump->current_index;
-    for (int i = 0; i < MAX_CONNECTIONS - 1; i++) {
-        int ind = (index + i) % 255 + 1;
+    struct connection *c;
+    // Data is sent only within the credit granted by the peer
+    int credit = pump->tx_version >= PROTOCOL_CREDIT;
+    int compress = pump->compress && pump->tx_version >= PROTOCOL_COMPRESSED;
+
+    uint64_t now = 0;
+    if (pump->min_payload > 0) {
+        now = now_ns();
+        // Frames held long enough are sent regardless of their size
+        while ((c = cm_deferred_head(cm)) != NULL && c->defer_deadline <= now) {
+            cm_undefer_input(cm, c);
+            if (!input_blocked(pump, c))
+                cm_queue_input(cm, c);
+        }
+    }
 
-        struct connection *c = connections[ind];
-        if (c == NULL || !is_alive(c->state) || !is_alive(c->in_state))
+    // Only connections with data are visited, see cm_queue_input for the order
+    while ((c = cm_input_head(cm)) != NULL) {
+        // Tunnel receives data like other connections, but it is decoded above.
+        if (c == tunnel || input_blocked(pump, c) || (pump->min_payload > 0 && hold_frame(pump, cm, c, now))) {
+            if (c != tunnel && credit)
+                report_blocked(pump, c);
+            // Connection without data to send loses the rest of its turn
+            c->deficit = 0;
+            cm_dequeue_input(cm, c);
             continue;
-        if (!encode(c->in_buf, tunnel->out_buf, c->id)) {
-            // Buffer is full
-            pump->current_index = ind;
+        }
+        if (c->deficit == 0)
+            c->deficit = c->quantum;
+        int was_full = buf_full(c->in_buf);
+        size_t before = buf_data_length(c->in_buf);
+        int encoded;
+        if (compress)
+            encoded = encode_compressed_frame(pump, c, tunnel->out_buf, c->deficit);
+        else if (credit)
+            encoded = encode_frame(c->in_buf, tunnel->out_buf, c->id, &c->tx_credit, c->deficit);
+        else if (pump->tx_version >= PROTOCOL_BINARY)
+            encoded = encode_frame(c->in_buf, tunnel->out_buf, c->id, NULL, c->deficit);
+        else
+            // Stuffed frame can't be limited, it uses the whole turn
+            encoded = stuffing_encode(c->in_buf, tunnel->out_buf, c->id);
+        if (!encoded) {
+            // Buffer is full, the connection keeps its turn
             break;
         }
+        size_t sent = before - buf_data_length(c->in_buf);
+        c->deficit -= sent < c->deficit ? sent : c->deficit;
+        pump->frames.frames_encoded++;
+        if (c->defer_deadline != 0) {
+            cm_undefer_input(cm, c);
+            c->defer_deadline = 0;
+        }
+        // Buffer that was full limits the stream unless the credit does
+        if (was_full && (!credit || c->tx_credit > 0))
+            cm_grow_buffer(cm, c, c->in_buf);
+        if (input_blocked(pump, c)) {
+            c->deficit = 0;
+            cm_dequeue_input(cm, c);
+            if (credit)
+                report_blocked(pump, c);
+        } else if (c->deficit == 0 || sent == 0 || pump->tx_version < PROTOCOL_BINARY) {
+            // Turn goes on only when the frame was limited by its maximal length,
+            // otherwise the connection waits behind the others of its class
+            c->deficit = 0;
+            cm_dequeue_input(cm, c);
+            cm_queue_input(cm, c);
+        }
+        // Drained input buffer may allow the controller to close the connection
+        if (buf_empty(c->in_buf)) {
+            buf_trim(c->in_buf);
+            cm_mark_changed(cm, c);
+        }
     }
+    cm_schedule_write(cm, tunnel);
+    return pending;
 }
 
-struct pump *make_pump(size_t cmd_queue_size, command_handler handler, void *handler_argument) {
+struct pump *make_pump(size_t cmd_queue_size, int max_version, command_handler handler, void *handler_argument) {
     struct cmd_queue *q = make_cmd_queue(cmd_queue_size);
     if (q == NULL)
         return NULL;
@@ -279,10 +857,33 @@ struct pump *make_pump(size_t cmd_queue_size, command_handler handler, void *han
         return NULL;
     }
     pump->sending_to = -1;
-    pump->current_index = 0;
+    pump->remaining = 0;
+    pump->max_version = max_version;
+    pump->tx_version = PROTOCOL_STUFFED;
+    pump->rx_version = PROTOCOL_STUFFED;
+    pump->grant_all = 0;
     pump->cmd_handler_arg = handler_argument;
     pump->cmd_handler = handler;
     pump->cmd_queue = q;
+    pump->compress = 0;
+    pump->min_payload = 0;
+    pump->max_delay_ns = 0;
+    pump->raw = NULL;
+    pump->packed = NULL;
+    memset(&pump->stats, 0, sizeof(pump->stats));
+    memset(&pump->frames, 0, sizeof(pump->frames));
+    if (max_version >= PROTOCOL_COMPRESSED) {
+        pump->raw = malloc(MAX_FRAME_PAYLOAD);
+        pump->packed = malloc(FRAME_HEADER_LENGTH + MAX_FRAME_PAYLOAD);
+        if (pump->raw == NULL || pump->packed == NULL) {
+            free_pump(pump);
+            return NULL;
+        }
+    }
+
+    // Peers that don't know this command just ignore it and keep using the stuffed protocol.
+    if (max_version > PROTOCOL_STUFFED)
+        send_command(pump, CMD_HELLO, max_version);
     return pump;
 }
 
@@ -290,5 +891,7 @@ void free_pump(struct pump *p) {
     if (p == NULL)
         return;
     free_cmd_queue(p->cmd_queue);
+    free(p->raw);
+    free(p->packed);
     free(p);
 }
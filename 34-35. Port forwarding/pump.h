@@ -2,19 +2,136 @@
 #define PUMP_H_INCLUDED
 
 #include "manager.h"
+#include "conn_table.h"
 
-#define MAX_CONNECTIONS 256
+// Largest connection id that fits into frames of the stuffed protocol
+#define MAX_STUFFED_ID 255
+// Largest connection id of the binary protocol
+#define MAX_STREAM_ID 0x7FFFFFFF
+
+// Frames are delimited by END_BYTE and special bytes are escaped
+#define PROTOCOL_STUFFED 1
+// Frames have fixed header with payload length
+#define PROTOCOL_BINARY 2
+// Binary frames, each connection sends only as much data as the peer allows with CMD_WINDOW_UPDATE
+#define PROTOCOL_CREDIT 3
+// Credit-based frames, payload may be compressed
+#define PROTOCOL_COMPRESSED 4
+// Sender reports connections blocked by credit, so the receiver can grow their output buffers,
+// and the receiver may ask for unused credit back to shrink them
+#define PROTOCOL_ADAPTIVE 5
+// Adaptive buffers, queued commands are sent several to a frame
+#define PROTOCOL_BATCHED 6
+
+// Commands handled by the pump itself.
+// Peer announces maximal supported protocol version.
+#define CMD_HELLO 0x40
+// Peer uses the protocol version for everything after this command.
+#define CMD_SWITCH 0x41
+// Peer can accept additional number of bytes for the connection.
+#define CMD_WINDOW_UPDATE 0x42
+// Peer has used all the credit of the connection and has more data to send.
+#define CMD_WINDOW_BLOCKED 0x43
+// Peer asks to return the unused credit of the connection.
+#define CMD_WINDOW_RECLAIM 0x44
+// Peer gives back number of bytes of credit, it won't send them.
+#define CMD_WINDOW_RETURN 0x45
 
 struct pump;
 
-typedef void (*command_handler)(void *arg, uint8_t cmd, uint8_t cmd_arg);
+/*
+ * Payload bytes compressed and bytes the compressor produced for them, payload bytes the compressor
+ * didn't shrink enough and that were sent as is, payload bytes sent as is without compression attempt
+ * while compression is enabled, and bytes received in compressed frames and restored from them.
+ */
+struct compression_stats {
+    uint64_t raw_bytes;
+    uint64_t compressed_bytes;
+    uint64_t rejected_bytes;
+    uint64_t bypassed_bytes;
+    uint64_t received_bytes;
+    uint64_t decompressed_bytes;
+    uint64_t compress_ns;
+    uint64_t decompress_ns;
+};
+
+/*
+ * Data frames and commands put to the tunnel and taken from it.
+ */
+struct frame_stats {
+    uint64_t frames_encoded;
+    uint64_t frames_decoded;
+    uint64_t commands_encoded;
+    uint64_t commands_decoded;
+};
+
+/*
+ * Handler of commands not handled by the pump.
+ * Returns -1 if the command violates the protocol or can't be handled, the tunnel is closed then.
+ */
+typedef int (*command_handler)(void *arg, uint8_t cmd, uint32_t cmd_arg, uint32_t value);
 
-struct pump *make_pump(size_t cmd_queue_size, command_handler handler, void *handler_argument);
+struct pump *make_pump(size_t cmd_queue_size, int max_version, command_handler handler, void *handler_argument);
 
 void free_pump(struct pump *p);
 
-int send_command(struct pump *pump, uint8_t cmd, uint8_t arg);
+int send_command(struct pump *pump, uint8_t cmd, uint32_t arg);
+
+/*
+ * Command with a 4-byte value, which is sent only by binary protocols.
+ * Zero value is not sent and the peer's handler gets zero for commands without value.
+ */
+int send_command_with_value(struct pump *pump, uint8_t cmd, uint32_t arg, uint32_t value);
+
+/*
+ * Compress data sent to the peer once both sides switch to PROTOCOL_COMPRESSED.
+ * Compressed frames are accepted from the peer regardless of this setting.
+ */
+void pump_enable_compression(struct pump *pump);
+
+const struct compression_stats *pump_compression_stats(struct pump *pump);
+
+const struct frame_stats *pump_frame_stats(struct pump *pump);
+
+size_t pump_cmd_queue_length(struct pump *pump);
+
+/*
+ * Hold frames with less than min_payload bytes for at most max_delay milliseconds,
+ * so data that arrives meanwhile goes to the same frame. Streams at EOF are not held.
+ * Zero min_payload disables coalescing.
+ */
+void pump_set_coalescing(struct pump *pump, size_t min_payload, int max_delay);
+
+/*
+ * Returns number of milliseconds until the first held frame has to be sent or -1 if nothing is held.
+ */
+int pump_timeout(struct connection_manager *cm);
+
+/*
+ * Largest connection id that can be sent to the peer.
+ */
+int pump_max_id(struct pump *pump);
+
+/*
+ * Grant credit to the peer if enough space is free in the output buffer of the connection.
+ * Should be called when the connection is established and when its output buffer is drained.
+ * Returns 0 if the command can't be queued.
+ */
+int pump_grant_credit(struct pump *pump, struct connection *c);
+
+/*
+ * Ask the peer to return the credit of the connection, so its output buffer can shrink.
+ * Returns 0 if the command can't be queued.
+ */
+int pump_reclaim_credit(struct pump *pump, struct connection *c);
 
-void pump_transfer(struct pump *pump, struct connection **connections);
+/*
+ * Transfer data between the tunnel and connections from the table.
+ * All complete frames of the tunnel input buffer are decoded, so data left there waits for new events.
+ * Returns 1 if queued commands were held back to leave room for data and the pump has to run again
+ * without waiting for events, 0 if it has nothing to do until new events,
+ * -1 if the peer violated the protocol and the tunnel has to be closed.
+ */
+int pump_transfer(struct pump *pump, struct connection_manager *cm, struct conn_table *table);
 
 #endif
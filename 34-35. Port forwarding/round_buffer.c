@@ -1,16 +1,57 @@
+#define _GNU_SOURCE // memfd_create
 #include "round_buffer.h"
 
+#include <stdio.h>
 #include <stdlib.h> // malloc
 #include <string.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 struct round_buffer {
     size_t offset;
     size_t length;
     size_t capacity;
     uint8_t *buffer;
+    // Header and storage are taken from the pool when it is set
+    struct buf_pool *pool;
+    int lazy;
+    // Storage is mapped twice back-to-back, see buf_create_mirrored
+    int mirrored;
+    // Largest data length since the last buf_take_peak
+    size_t peak;
 };
 
+/*
+ * Storage of pooled buffers is taken from the pool while they have the capacity of the pool.
+ */
+static int storage_pooled(const struct round_buffer *buf) {
+    return buf->pool != NULL && buf->capacity == buf->pool->capacity;
+}
+
+static uint8_t *alloc_storage(const struct round_buffer *buf) {
+    return storage_pooled(buf) ? pool_alloc(&buf->pool->chunks) : malloc(buf->capacity);
+}
+
+static void free_storage(struct round_buffer *buf) {
+    if (storage_pooled(buf))
+        pool_free(&buf->pool->chunks, buf->buffer);
+    else
+        free(buf->buffer);
+    buf->buffer = NULL;
+}
+
+void buf_pool_init(struct buf_pool *pool, size_t capacity, size_t slab_objects) {
+    pool->capacity = capacity;
+    pool_init(&pool->headers, sizeof(struct round_buffer), slab_objects);
+    pool_init(&pool->chunks, capacity, slab_objects);
+}
+
+void buf_pool_destroy(struct buf_pool *pool) {
+    pool_destroy(&pool->headers);
+    pool_destroy(&pool->chunks);
+}
+
 struct round_buffer *buf_create(size_t capacity) {
     void *ptr = malloc(capacity);
     if (ptr == NULL)
@@ -26,13 +67,139 @@ struct round_buffer *buf_create(size_t capacity) {
     res->length = 0;
     res->capacity = capacity;
     res->buffer = ptr;
+    res->pool = NULL;
+    res->lazy = 0;
+    res->mirrored = 0;
+    res->peak = 0;
+
+    return res;
+}
+
+struct round_buffer *buf_create_mirrored(size_t capacity) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    capacity = (capacity + page - 1) / page * page;
+
+    struct round_buffer *res = malloc(sizeof(struct round_buffer));
+    if (res == NULL)
+        return NULL;
+
+    int fd = memfd_create("round_buffer", MFD_CLOEXEC);
+    if (fd == -1) {
+        perror("buf_create_mirrored: memfd_create");
+        goto fail;
+    }
+    if (ftruncate(fd, capacity) == -1) {
+        perror("buf_create_mirrored: ftruncate");
+        goto close_fd;
+    }
+    // Reserve address space for both copies, then map the file over each half
+    uint8_t *ptr = mmap(NULL, 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        perror("buf_create_mirrored: mmap");
+        goto close_fd;
+    }
+    if (mmap(ptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(ptr + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        perror("buf_create_mirrored: mmap");
+        munmap(ptr, 2 * capacity);
+        goto close_fd;
+    }
+    // Mappings keep the memory alive
+    close(fd);
+
+    res->offset = 0;
+    res->length = 0;
+    res->capacity = capacity;
+    res->buffer = ptr;
+    res->pool = NULL;
+    res->lazy = 0;
+    res->mirrored = 1;
+    res->peak = 0;
+    return res;
+
+    close_fd:
+    close(fd);
+    fail:
+    free(res);
+    return NULL;
+}
+
+struct round_buffer *buf_create_pooled(struct buf_pool *pool, int lazy) {
+    struct round_buffer *res = pool_alloc(&pool->headers);
+    if (res == NULL)
+        return NULL;
 
+    res->offset = 0;
+    res->length = 0;
+    res->capacity = pool->capacity;
+    res->buffer = NULL;
+    res->pool = pool;
+    res->lazy = lazy;
+    res->mirrored = 0;
+    res->peak = 0;
+
+    if (!lazy && !buf_reserve(res)) {
+        pool_free(&pool->headers, res);
+        return NULL;
+    }
     return res;
 }
 
 void buf_destroy(struct round_buffer *buf) {
-    free(buf->buffer);
-    free(buf);
+    if (buf->mirrored) {
+        munmap(buf->buffer, 2 * buf->capacity);
+        free(buf);
+        return;
+    }
+    if (buf->buffer != NULL)
+        free_storage(buf);
+    if (buf->pool == NULL)
+        free(buf);
+    else
+        pool_free(&buf->pool->headers, buf);
+}
+
+int buf_reserve(struct round_buffer *buf) {
+    if (buf->buffer != NULL)
+        return 1;
+    buf->buffer = alloc_storage(buf);
+    return buf->buffer != NULL;
+}
+
+void buf_trim(struct round_buffer *buf) {
+    if (!buf->lazy || buf->length > 0 || buf->buffer == NULL)
+        return;
+    free_storage(buf);
+    buf->offset = 0;
+}
+
+int buf_resize(struct round_buffer *buf, size_t capacity) {
+    if (buf->mirrored || capacity < buf->length)
+        return 0;
+    if (buf->buffer == NULL) {
+        // Storage of the new size is taken by buf_reserve
+        buf->capacity = capacity;
+        return 1;
+    }
+
+    struct round_buffer old = *buf;
+    buf->capacity = capacity;
+    buf->buffer = alloc_storage(buf);
+    if (buf->buffer == NULL) {
+        *buf = old;
+        return 0;
+    }
+    // Data is moved to the start of the new storage
+    buf_peek(&old, buf->buffer, old.length);
+    buf->offset = 0;
+    free_storage(&old);
+    return 1;
+}
+
+size_t buf_take_peak(struct round_buffer *buf) {
+    size_t peak = buf->peak;
+    buf->peak = buf->length;
+    return peak;
 }
 
 int buf_full(const struct round_buffer *buf) {
@@ -55,17 +222,33 @@ int buf_capacity(const struct round_buffer *buf) {
     return buf->capacity;
 }
 
+void buf_storage(const struct round_buffer *buf, struct iovec *iov) {
+    iov->iov_base = buf->buffer;
+    // Regions of the mirrored buffer may extend to the second copy
+    iov->iov_len = buf->mirrored ? 2 * buf->capacity : buf->capacity;
+}
+
 int buf_writing_iov(const struct round_buffer *buf, struct iovec *iov) {
-    if (buf->length == buf->capacity)
+    if (buf->length == buf->capacity || buf->buffer == NULL)
         return 0;
 
-    int cnt = 0;
     size_t part_start = buf->offset + buf->length;
-    if (part_start < buf->capacity) {
-        iov[cnt].iov_base = buf->buffer + part_start;
-        iov[cnt].iov_len = buf->capacity - part_start;
-        cnt++;
+    if (buf->mirrored) {
+        iov[0].iov_base = buf->buffer + part_start % buf->capacity;
+        iov[0].iov_len = buf->capacity - buf->length;
+        return 1;
     }
+    if (part_start >= buf->capacity) {
+        // Data wraps around, free space is a single region before the offset.
+        iov[0].iov_base = buf->buffer + (part_start - buf->capacity);
+        iov[0].iov_len = buf->capacity - buf->length;
+        return 1;
+    }
+
+    int cnt = 0;
+    iov[cnt].iov_base = buf->buffer + part_start;
+    iov[cnt].iov_len = buf->capacity - part_start;
+    cnt++;
 
     if (buf->offset > 0) {
         iov[cnt].iov_base = buf->buffer;
@@ -81,7 +264,7 @@ int buf_reading_iov(const struct round_buffer *buf, struct iovec *iov) {
         return 0;
 
     size_t end = buf->offset + buf->length;
-    if (end <= buf->capacity) {
+    if (end <= buf->capacity || buf->mirrored) {
         iov[0].iov_base = buf->buffer + buf->offset;
         iov[0].iov_len = buf->length;
         return 1;
@@ -100,13 +283,10 @@ size_t buf_advance_read_ptr(struct round_buffer *buf, size_t length) {
     if (max < length)
         length = max;
 
-    if (length == buf->length) {
-        buf->length = 0;
-        buf->offset = 0;
-    } else {
-        buf->length -= length;
-        buf->offset = (buf->offset + length) % buf->capacity;
-    }
+    // Offset is not reset when the buffer becomes empty,
+    // because the free space may be in use by asynchronous read.
+    buf->length -= length;
+    buf->offset = (buf->offset + length) % buf->capacity;
     return length;
 }
 
@@ -116,6 +296,8 @@ size_t buf_advance_write_ptr(struct round_buffer *buf, size_t length) {
         length = max;
 
     buf->length += length;
+    if (buf->length > buf->peak)
+        buf->peak = buf->length;
 
     return length;
 }
@@ -146,6 +328,45 @@ ssize_t buf_peek(struct round_buffer *buf, void *ptr, size_t len) {
     return res;
 }
 
+size_t buf_put(struct round_buffer *buf, const void *ptr, size_t len) {
+    if (!buf_reserve(buf))
+        return 0;
+    struct iovec iov[2];
+    int cnt = buf_writing_iov(buf, iov);
+
+    size_t res = 0;
+    for (int i = 0; i < cnt && len > 0; i++) {
+        size_t l = len;
+        if (iov[i].iov_len < len)
+            l = iov[i].iov_len;
+        memcpy(iov[i].iov_base, ptr, l);
+        ptr += l;
+        len -= l;
+        res += l;
+    }
+    buf_advance_write_ptr(buf, res);
+    return res;
+}
+
+size_t buf_move(struct round_buffer *dst, struct round_buffer *src, size_t len) {
+    struct iovec iov[2];
+    int cnt = buf_reading_iov(src, iov);
+
+    size_t res = 0;
+    for (int i = 0; i < cnt && len > 0; i++) {
+        size_t l = len;
+        if (iov[i].iov_len < len)
+            l = iov[i].iov_len;
+        l = buf_put(dst, iov[i].iov_base, l);
+        len -= l;
+        res += l;
+        if (l < iov[i].iov_len)
+            break;
+    }
+    buf_advance_read_ptr(src, res);
+    return res;
+}
+
 ssize_t buf_write(int fd, struct round_buffer *buf) {
     struct iovec iov[2];
     int cnt = buf_reading_iov(buf, iov);
@@ -160,6 +381,8 @@ ssize_t buf_write(int fd, struct round_buffer *buf) {
 }
 
 ssize_t buf_read(int fd, struct round_buffer *buf) {
+    if (!buf_reserve(buf))
+        return -2;
     struct iovec iov[2];
     int cnt = buf_writing_iov(buf, iov);
     if (cnt == 0)
@@ -1,20 +1,74 @@
 #ifndef ROUND_BUFFER_H
 #define ROUND_BUFFER_H
 
+#include "pool.h"
+
 #include <sys/types.h> // ssize_t
 #include <sys/uio.h> // struct iovec
 
 struct round_buffer;
 
+/*
+ * Headers and storage of buffers with the same capacity.
+ */
+struct buf_pool {
+    size_t capacity;
+    struct pool headers;
+    struct pool chunks;
+};
+
+void buf_pool_init(struct buf_pool *pool, size_t capacity, size_t slab_objects);
+void buf_pool_destroy(struct buf_pool *pool);
+
 struct round_buffer *buf_create(size_t capacity);
+/*
+ * Storage is a memory file mapped twice back-to-back, so both data and free space
+ * are always returned as a single region. Capacity is rounded up to the page size.
+ * Returns NULL if mapping is not possible.
+ */
+struct round_buffer *buf_create_mirrored(size_t capacity);
+/*
+ * Lazy buffer takes storage from the pool when data is written to it
+ * and returns the storage by buf_trim when it is empty.
+ */
+struct round_buffer *buf_create_pooled(struct buf_pool *pool, int lazy);
 void buf_destroy(struct round_buffer *buf);
 
+/*
+ * Make sure the storage of the lazy buffer is allocated. Returns 0 on failure.
+ * buf_put, buf_move and buf_read do it by themselves,
+ * buffer must be reserved before the free space is obtained by buf_writing_iov.
+ */
+int buf_reserve(struct round_buffer *buf);
+
+/*
+ * Return storage of the empty lazy buffer to the pool.
+ * Storage must not be in use by asynchronous read.
+ */
+void buf_trim(struct round_buffer *buf);
+
+/*
+ * Change capacity of the buffer keeping its data, capacity must not be less than the data length.
+ * Pooled buffer takes storage from the pool while its capacity equals the capacity of the pool.
+ * Mirrored buffers can't be resized. Storage must not be in use by asynchronous operations.
+ * Returns 0 on failure, the buffer is not changed then.
+ */
+int buf_resize(struct round_buffer *buf, size_t capacity);
+
+/*
+ * Returns the largest data length since the previous call.
+ */
+size_t buf_take_peak(struct round_buffer *buf);
+
 int buf_full(const struct round_buffer *buf);
 int buf_empty(const struct round_buffer *buf);
 size_t buf_data_length(const struct round_buffer *buf);
 size_t buf_free_length(const struct round_buffer *buf);
 int buf_capacity(const struct round_buffer *buf);
 
+// Memory region where data is stored.
+void buf_storage(const struct round_buffer *buf, struct iovec *iov);
+
 #define MAX_IOV_LEN 2
 int buf_writing_iov(const struct round_buffer *buf, struct iovec *iov);
 int buf_reading_iov(const struct round_buffer *buf, struct iovec *iov);
@@ -24,6 +78,10 @@ size_t buf_advance_write_ptr(struct round_buffer *buf, size_t length);
 
 int buf_peek_byte(struct round_buffer *buf);
 ssize_t buf_peek(struct round_buffer *buf, void *ptr, size_t len);
+// Copy at most len bytes to the buffer. Returns number of bytes copied.
+size_t buf_put(struct round_buffer *buf, const void *ptr, size_t len);
+// Move at most len bytes from src to dst. Returns number of bytes moved.
+size_t buf_move(struct round_buffer *dst, struct round_buffer *src, size_t len);
 ssize_t buf_write(int fd, struct round_buffer *buf);
 ssize_t buf_read(int fd, struct round_buffer *buf);
 
@@ -0,0 +1,374 @@
+#include "stuffing.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+static inline int is_special(uint8_t b) {
+    return (b | 1) == ESC_BYTE;
+}
+
+static size_t find_special_scalar(const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (is_special(data[i]))
+            return i;
+    }
+    return len;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse2")))
+static size_t find_special_sse2(const uint8_t *data, size_t len) {
+    const __m128i ones = _mm_set1_epi8(1);
+    const __m128i esc = _mm_set1_epi8(ESC_BYTE);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (data + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(v, ones), esc));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return i + find_special_scalar(data + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t find_special_avx2(const uint8_t *data, size_t len) {
+    const __m256i ones = _mm256_set1_epi8(1);
+    const __m256i esc = _mm256_set1_epi8(ESC_BYTE);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (data + i));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_or_si256(v, ones), esc));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    if (i + 16 <= len) {
+        size_t r = find_special_sse2(data + i, 16);
+        if (r < 16)
+            return i + r;
+        i += 16;
+    }
+    return i + find_special_scalar(data + i, len - i);
+}
+
+#endif
+
+struct kernel {
+    const char *name;
+    size_t (*find)(const uint8_t *, size_t);
+};
+
+static const struct kernel kernels[] = {
+        [KERNEL_SCALAR] = {"scalar", find_special_scalar},
+#ifdef HAVE_X86_KERNELS
+        [KERNEL_SSE2] = {"sse2", find_special_sse2},
+        [KERNEL_AVX2] = {"avx2", find_special_avx2},
+#endif
+};
+
+#define KERNEL_COUNT (sizeof(kernels) / sizeof(kernels[0]))
+
+static const struct kernel *current_kernel = NULL;
+
+static int kernel_supported(int kernel) {
+    if (kernel < 0 || kernel >= (int) KERNEL_COUNT)
+        return 0;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (kernel == KERNEL_SSE2)
+        return __builtin_cpu_supports("sse2");
+    if (kernel == KERNEL_AVX2)
+        return __builtin_cpu_supports("avx2");
+#endif
+    return 1;
+}
+
+static const struct kernel *get_kernel(void) {
+    if (current_kernel == NULL) {
+        int k = KERNEL_COUNT - 1;
+        while (!kernel_supported(k))
+            k--;
+        current_kernel = &kernels[k];
+    }
+    return current_kernel;
+}
+
+int stuffing_select_kernel(int kernel) {
+    if (!kernel_supported(kernel))
+        return 0;
+    current_kernel = &kernels[kernel];
+    return 1;
+}
+
+const char *stuffing_kernel_name(void) {
+    return get_kernel()->name;
+}
+
+size_t find_special(const uint8_t *data, size_t len) {
+    return get_kernel()->find(data, len);
+}
+
+// Runs shorter than this are scanned without calling the kernel
+#define SHORT_RUN 16
+
+/*
+ * Returns length of the run of ordinary bytes at the start of data.
+ */
+static inline size_t find_run(const struct kernel *kernel, const uint8_t *data, size_t len) {
+    size_t i = 0;
+    while (i < len && i < SHORT_RUN) {
+        if (is_special(data[i]))
+            return i;
+        i++;
+    }
+    if (i == len)
+        return len;
+    return i + kernel->find(data + i, len - i);
+}
+
+struct buf_iter {
+    struct iovec iov[MAX_IOV_LEN];
+    int iov_cnt;
+    int iov_ind;
+    uint8_t *ptr;
+    size_t rem;
+};
+
+static void prepare_buf_iter(struct buf_iter *iter) {
+    iter->iov_ind = 0;
+    iter->ptr = iter->iov[0].iov_base;
+    iter->rem = iter->iov_cnt > 0 ? iter->iov[0].iov_len : 0;
+}
+
+/*
+ * Skip len bytes. Returns 0 if the end of the last region is reached.
+ */
+static inline int buf_iter_skip(struct buf_iter *iter, size_t len) {
+    while (len > 0) {
+        size_t l = len < iter->rem ? len : iter->rem;
+        iter->ptr += l;
+        iter->rem -= l;
+        len -= l;
+        if (iter->rem == 0) {
+            if (++iter->iov_ind == iter->iov_cnt)
+                return 0;
+            iter->rem = iter->iov[iter->iov_ind].iov_len;
+            iter->ptr = iter->iov[iter->iov_ind].iov_base;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Copy len bytes to the iterator position. Caller guarantees there is enough space.
+ */
+static inline void buf_iter_put(struct buf_iter *iter, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        size_t l = len < iter->rem ? len : iter->rem;
+        memcpy(iter->ptr, data, l);
+        data += l;
+        len -= l;
+        buf_iter_skip(iter, l);
+    }
+}
+
+static inline void buf_iter_put_byte(struct buf_iter *iter, uint8_t b) {
+    *iter->ptr = b;
+    buf_iter_skip(iter, 1);
+}
+
+static struct buf_iter get_read_iter(const struct round_buffer *buf) {
+    struct buf_iter iter;
+    iter.iov_cnt = buf_reading_iov(buf, iter.iov);
+    prepare_buf_iter(&iter);
+    return iter;
+}
+
+static struct buf_iter get_write_iter(const struct round_buffer *buf) {
+    struct buf_iter iter;
+    iter.iov_cnt = buf_writing_iov(buf, iter.iov);
+    prepare_buf_iter(&iter);
+    return iter;
+}
+
+/*
+ * Encode data from the contiguous source to the contiguous destination.
+ * Returns number of bytes written, *src_used is set to number of bytes consumed.
+ */
+static size_t encode_flat(const struct kernel *kernel, const uint8_t *src, size_t src_len,
+                          uint8_t *dst, size_t dst_rem, size_t *src_used) {
+    size_t s = 0, d = 0;
+    while (d < dst_rem && s < src_len) {
+        size_t n = src_len - s < dst_rem - d ? src_len - s : dst_rem - d;
+        size_t clean = find_run(kernel, src + s, n);
+        memcpy(dst + d, src + s, clean);
+        s += clean;
+        d += clean;
+        if (clean == n)
+            continue;
+
+        if (dst_rem - d < 2)
+            break;
+        dst[d++] = ESC_BYTE;
+        dst[d++] = src[s++];
+    }
+    *src_used = s;
+    return d;
+}
+
+/*
+ * Decode data from the contiguous source to the contiguous destination.
+ * Returns number of bytes consumed, *dst_used is set to number of bytes written.
+ */
+static size_t decode_flat(const struct kernel *kernel, const uint8_t *src, size_t src_len,
+                          uint8_t *dst, size_t dst_rem, size_t *dst_used, int *end_reached) {
+    size_t s = 0, d = 0;
+    *end_reached = 0;
+    while (d < dst_rem && s < src_len) {
+        size_t n = src_len - s < dst_rem - d ? src_len - s : dst_rem - d;
+        size_t clean = find_run(kernel, src + s, n);
+        memcpy(dst + d, src + s, clean);
+        s += clean;
+        d += clean;
+        if (clean == n)
+            continue;
+
+        if (src[s] == END_BYTE) {
+            s++;
+            *end_reached = 1;
+            break;
+        }
+        // Escaped byte is not received yet.
+        if (s + 1 == src_len)
+            break;
+        dst[d++] = src[s + 1];
+        s += 2;
+    }
+    *dst_used = d;
+    return s;
+}
+
+int stuffing_encode(
+        struct round_buffer *src,
+        struct round_buffer *dst,
+        uint8_t connection_id) {
+    if (buf_data_length(src) == 0)
+        return 1;
+    if (!buf_reserve(dst))
+        return 0;
+
+    const struct kernel *kernel = get_kernel();
+    struct buf_iter src_it = get_read_iter(src);
+    struct buf_iter dst_it = get_write_iter(dst);
+
+    size_t dst_avail = buf_free_length(dst);
+    if (dst_avail < 4 || (is_special(*src_it.ptr) && dst_avail < 5))
+        return 0;
+
+    // Mirrored and not wrapped buffers are encoded with plain pointers
+    if (src_it.iov_cnt == 1 && dst_it.iov_cnt == 1) {
+        uint8_t *dst_ptr = dst_it.ptr;
+        size_t src_total;
+        dst_ptr[0] = END_BYTE;
+        dst_ptr[1] = connection_id;
+        size_t dst_total = 2 + encode_flat(kernel, src_it.ptr, src_it.rem, dst_ptr + 2, dst_avail - 3, &src_total);
+        dst_ptr[dst_total++] = END_BYTE;
+        buf_advance_read_ptr(src, src_total);
+        buf_advance_write_ptr(dst, dst_total);
+        return 1;
+    }
+
+    buf_iter_put_byte(&dst_it, END_BYTE);
+    buf_iter_put_byte(&dst_it, connection_id);
+    size_t src_total = 0, dst_total = 2;
+
+    // Space for the encoded data, one byte is reserved for the trailing END_BYTE
+    size_t dst_rem = dst_avail - 3;
+    while (dst_rem > 0) {
+        // Copy run of ordinary bytes as is
+        size_t n = src_it.rem < dst_rem ? src_it.rem : dst_rem;
+        size_t clean = find_run(kernel, src_it.ptr, n);
+        buf_iter_put(&dst_it, src_it.ptr, clean);
+        src_total += clean;
+        dst_total += clean;
+        dst_rem -= clean;
+        if (!buf_iter_skip(&src_it, clean))
+            break;
+        if (clean == n)
+            continue;
+
+        if (dst_rem < 2)
+            break;
+        buf_iter_put_byte(&dst_it, ESC_BYTE);
+        buf_iter_put_byte(&dst_it, *src_it.ptr);
+        src_total++;
+        dst_total += 2;
+        dst_rem -= 2;
+        if (!buf_iter_skip(&src_it, 1))
+            break;
+    }
+
+    buf_iter_put_byte(&dst_it, END_BYTE);
+    dst_total++;
+
+    buf_advance_read_ptr(src, src_total);
+    buf_advance_write_ptr(dst, dst_total);
+    return 1;
+}
+
+int stuffing_decode(
+        struct round_buffer *src,
+        struct round_buffer *dst) {
+    if (buf_empty(src) || !buf_reserve(dst))
+        return 0;
+
+    const struct kernel *kernel = get_kernel();
+    struct buf_iter src_it = get_read_iter(src);
+    struct buf_iter dst_it = get_write_iter(dst);
+
+    int end_reached = 0;
+    size_t dst_rem = buf_free_length(dst);
+    size_t src_total = 0;
+    size_t dst_total = 0;
+    if (src_it.iov_cnt == 1 && dst_it.iov_cnt == 1) {
+        src_total = decode_flat(kernel, src_it.ptr, src_it.rem, dst_it.ptr, dst_rem, &dst_total, &end_reached);
+        buf_advance_read_ptr(src, src_total);
+        buf_advance_write_ptr(dst, dst_total);
+        return end_reached;
+    }
+    while (dst_rem > 0) {
+        size_t n = src_it.rem < dst_rem ? src_it.rem : dst_rem;
+        size_t clean = find_run(kernel, src_it.ptr, n);
+        buf_iter_put(&dst_it, src_it.ptr, clean);
+        src_total += clean;
+        dst_total += clean;
+        dst_rem -= clean;
+        if (!buf_iter_skip(&src_it, clean))
+            break;
+        if (clean == n)
+            continue;
+
+        if (*src_it.ptr == END_BYTE) {
+            src_total++;
+            end_reached = 1;
+            break;
+        }
+        if (!buf_iter_skip(&src_it, 1)) {
+            // Escaped byte is not received yet.
+            break;
+        }
+        buf_iter_put_byte(&dst_it, *src_it.ptr);
+        src_total += 2;
+        dst_total++;
+        dst_rem--;
+        if (!buf_iter_skip(&src_it, 1))
+            break;
+    }
+    buf_advance_read_ptr(src, src_total);
+    buf_advance_write_ptr(dst, dst_total);
+    return end_reached;
+}
@@ -0,0 +1,50 @@
+#ifndef STUFFING_H_INCLUDED
+#define STUFFING_H_INCLUDED
+
+#include "round_buffer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Byte stuffing used by version 1 of the tunnel protocol.
+ * Frames are delimited by END_BYTE, both special bytes inside frames are prefixed with ESC_BYTE.
+ * Special bytes differ only in the lowest bit, so kernels test (b | 1) == ESC_BYTE.
+ */
+#define END_BYTE 0x7E
+#define ESC_BYTE 0x7F
+
+#define KERNEL_SCALAR 0
+#define KERNEL_SSE2 1
+#define KERNEL_AVX2 2
+
+/*
+ * Use specified kernel to search for special bytes.
+ * Returns 0 if the kernel is not supported by the processor.
+ * By default the fastest supported kernel is used.
+ */
+int stuffing_select_kernel(int kernel);
+
+const char *stuffing_kernel_name(void);
+
+/*
+ * Returns index of the first special byte in data or len if there is no such byte.
+ */
+size_t find_special(const uint8_t *data, size_t len);
+
+/*
+ * Read bytes from src, encode them and write to dst as a single frame.
+ * Function tries to encode maximum possible number of bytes.
+ * Returns 1 when src is empty or when at least one byte encoded,
+ * and 0 if there are not enough space in dst buffer.
+ */
+int stuffing_encode(struct round_buffer *src, struct round_buffer *dst, uint8_t connection_id);
+
+/*
+ * Read bytes from src, decode them and write to dst.
+ * Bytes are read until the END_BYTE or the end of src buffer or until dst buffer is full.
+ * Returns 1 if END_BYTE was consumed.
+ */
+int stuffing_decode(struct round_buffer *src, struct round_buffer *dst);
+
+#endif
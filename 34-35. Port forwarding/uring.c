@@ -0,0 +1,182 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+struct uring {
+    int fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    // Tail of entries prepared but not published yet
+    unsigned sqe_tail;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+struct uring *make_uring(unsigned entries) {
+    struct uring *ring = malloc(sizeof(struct uring));
+    if (ring == NULL) {
+        perror("make_uring: malloc");
+        return NULL;
+    }
+    memset(ring, 0, sizeof(struct uring));
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if (ring->fd == -1) {
+        perror("make_uring: io_uring_setup");
+        free(ring);
+        return NULL;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+        fprintf(stderr, "make_uring: kernel is too old\n");
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_size > ring->sq_size)
+        ring->sq_size = ring->cq_size;
+    ring->cq_size = ring->sq_size;
+
+    // Both rings share single mapping
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        perror("make_uring: mmap");
+        goto fail_ring;
+    }
+    ring->cq_ptr = ring->sq_ptr;
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        perror("make_uring: mmap");
+        goto fail_sq;
+    }
+
+    uint8_t *sq = ring->sq_ptr;
+    ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_entries = *(unsigned *) (sq + p.sq_off.ring_entries);
+    ring->sqe_tail = *ring->sq_tail;
+
+    // Entries are always submitted in order, so the index array is an identity.
+    unsigned *array = (unsigned *) (sq + p.sq_off.array);
+    for (unsigned i = 0; i < ring->sq_entries; i++)
+        array[i] = i;
+
+    uint8_t *cq = ring->cq_ptr;
+    ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    return ring;
+
+    fail_sq:
+    munmap(ring->sq_ptr, ring->sq_size);
+    fail_ring:
+    close(ring->fd);
+    free(ring);
+    return NULL;
+}
+
+void free_uring(struct uring *ring) {
+    if (ring == NULL)
+        return;
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->sq_ptr, ring->sq_size);
+    if (close(ring->fd) == -1)
+        perror("free_uring: close");
+    free(ring);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries)
+        return NULL;
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+int uring_submit(struct uring *ring, unsigned wait_nr) {
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (to_submit == 0 && wait_nr == 0)
+        return 0;
+
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    return sys_io_uring_enter(ring->fd, to_submit, wait_nr, flags);
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_register_buffers(struct uring *ring, unsigned nr) {
+    struct io_uring_rsrc_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = nr;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    return sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg));
+}
+
+int uring_update_buffers(struct uring *ring, unsigned index, const struct iovec *iov, unsigned nr) {
+    struct io_uring_rsrc_update2 up;
+    memset(&up, 0, sizeof(up));
+    up.offset = index;
+    up.data = (uint64_t) (uintptr_t) iov;
+    up.nr = nr;
+    return sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up));
+}
@@ -0,0 +1,47 @@
+#ifndef URING_H_INCLUDED
+#define URING_H_INCLUDED
+
+#include <sys/uio.h> // struct iovec
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring wrapper built directly on top of the system calls.
+ */
+struct uring;
+
+struct uring *make_uring(unsigned entries);
+
+void free_uring(struct uring *ring);
+
+/*
+ * Returns next free submission queue entry or NULL if the queue is full.
+ * Entry is cleared and will be submitted by the next uring_submit call.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/*
+ * Submit prepared entries and wait for at least wait_nr completions.
+ * Returns -1 and sets errno on failure.
+ */
+int uring_submit(struct uring *ring, unsigned wait_nr);
+
+/*
+ * Returns the oldest completion or NULL if there are no completions.
+ * Call uring_cqe_seen when the completion is handled.
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+
+void uring_cqe_seen(struct uring *ring);
+
+/*
+ * Register table of nr empty fixed buffers.
+ */
+int uring_register_buffers(struct uring *ring, unsigned nr);
+
+/*
+ * Replace nr fixed buffers starting from index.
+ * Empty iovec ({NULL, 0}) unregisters buffer.
+ */
+int uring_update_buffers(struct uring *ring, unsigned index, const struct iovec *iov, unsigned nr);
+
+#endif
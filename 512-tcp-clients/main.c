@@ -1,48 +1,268 @@
 #include <errno.h>
-#include <sys/wait.h>
+#include <fcntl.h>
+#include <limits.h> // INT_MAX
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
 #include <sys/types.h> // Man recomends to include this header alongside with socket.h altough it is not required
 #include <sys/socket.h> // socket, bind
 #include <netinet/in.h> // sockaddr_in, in_port_t, in_addr
+#include <netinet/tcp.h> // TCP_NODELAY
 #include <arpa/inet.h> // inet_aton, inet_ntoa
 #include <unistd.h> // close
 #include <stdlib.h>
 #include <stdio.h> // perror
 #include <string.h> // memset
+#include <time.h>
 
-#define BUF_SIZE 256
-#define CLIENTS_COUNT 510
-#define REPEATS_COUNT 10000
+/*
+ * Load generator for echo services: every connection sends requests of the payload size
+ * and waits for the echo. Connections are spread over threads, each thread serves its connections with epoll.
+ * Closed loop (default): each connection keeps up to pipeline depth requests in flight.
+ * Open loop (-r): requests are sent at the given total rate regardless of responses,
+ * and latency is measured from the time the request was due, so queueing delay is not hidden.
+ * Several comma-separated rates are run one after another, each for the duration.
+ */
+
+#define MAX_CLIENTS 100000
+#define MAX_THREADS 256
+#define MAX_SOURCES 64
+#define MAX_RATES 64
+#define MAX_EVENTS 256
+// Connects in progress per thread, so the listen queue of the target doesn't overflow
+#define MAX_CONNECTING 256
+// Byte at stream offset i is i % PATTERN_PERIOD, so the echo can be checked at any offset
+#define PATTERN_PERIOD 251
+#define READ_BUF_SIZE 65536
+#define MAX_WRITE 65536
+
+#define CS_CONNECTING 1
+#define CS_ACTIVE 2
+#define CS_CLOSED 3
 
 struct sockaddr_in dst_address;
+struct in_addr sources[MAX_SOURCES];
+int sources_count = 0;
+int clients_count = 510;
+int threads_count = 0;
+size_t payload_size = 256;
+int depth = 1;
+double duration = 10;
+// Total request rates (requests per second) of the open loop phases, none in closed loop mode
+double rates[MAX_RATES];
+int rates_count = 0;
+int phases_count = 1;
+// Latency is recorded with this number of significant decimal digits
+int precision = 2;
 
-int parse_port(const char *str, in_port_t *res) {
+uint8_t *pattern;
+size_t pattern_length;
+
+/*
+ * HDR-style histogram: values below 2^sub_bucket_bits are exact, larger ones are kept
+ * in power of two ranges, each split into 2^sub_bucket_bits linear sub-buckets,
+ * so every value is recorded with the same relative precision.
+ */
+int sub_bucket_bits;
+int histogram_size;
+
+struct histogram {
+    uint64_t count;
+    uint64_t max;
+    uint64_t *buckets;
+};
+
+struct client {
+    int fd;
+    int state;
+    // Stream offsets of the data written and read back
+    uint64_t sent;
+    uint64_t received;
+    // Times (ns) the requests in flight were sent (closed loop) or due (open loop), ring of cap entries
+    uint64_t *send_times;
+    int cap;
+    int first;
+    int in_flight;
+};
+
+// Results of the requests due in one phase
+struct phase {
+    uint64_t requests;
+    // Requests not sent because the connection is broken
+    uint64_t missed;
+    // Requests without response when the test stopped
+    uint64_t unfinished;
+    struct histogram latency;
+};
+
+struct worker {
+    pthread_t thread;
+    int epoll_fd;
+    struct client *clients;
+    // Index of the first client among all clients and number of clients of the worker
+    int first;
+    int count;
+    // Next client to connect and number of connects in progress
+    int next;
+    int connecting;
+    // Requests are sent after all workers have connected their clients
+    int running;
+    // Open loop: timer of the next request, its due time (ns) and number in the phase, next client to use
+    int timer_fd;
+    int phase;
+    uint64_t due;
+    uint64_t due_count;
+    int cursor;
+    uint64_t bytes;
+    uint64_t connect_errors;
+    uint64_t errors;
+    struct phase *phases;
+};
+
+volatile int stopped = 0;
+pthread_barrier_t barrier;
+// Start of the first phase (ns)
+uint64_t start_time;
+
+/*
+ * Parse the whole string as a decimal number from min to max. Returns -1 on failure.
+ */
+int parse_number(const char *str, unsigned long min, unsigned long max, unsigned long *res) {
     char *end;
     errno = 0;
-    long r = strtol(str, &end, 10);
-    if (r < 0 || r > 65535)
+    unsigned long r = strtoul(str, &end, 10);
+    // strtoul skips spaces and negates numbers with minus
+    if (errno != 0 || str[0] < '0' || str[0] > '9' || *end != '\0' || r < min || r > max)
+        return -1;
+    *res = r;
+    return 0;
+}
+
+/*
+ * Parse the whole string as a positive number. Returns -1 on failure.
+ */
+int parse_positive(const char *str, double *res) {
+    char *end;
+    errno = 0;
+    double r = strtod(str, &end);
+    if (errno != 0 || end == str || *end != '\0' || !(r > 0))
+        return -1;
+    *res = r;
+    return 0;
+}
+
+int parse_port(const char *str, in_port_t *res) {
+    unsigned long r;
+    if (parse_number(str, 0, 65535, &r) == -1)
         return -1;
     *res = (in_port_t) r;
     return 0;
 }
 
 void print_usage_and_exit(const char *name) {
-    fprintf(stderr, "USAGE %s <target-ip> <target-port>\n", name);
+    fprintf(stderr, "USAGE %s [-c connections] [-t threads] [-s payload-size] [-p pipeline-depth] [-d seconds] "
+                    "[-b source-ip[,source-ip...]] [-r requests-per-second[,requests-per-second...]] "
+                    "[-H significant-digits] <target-ip> <target-port>\n", name);
     exit(1);
 }
 
+void parse_sources(const char *name, char *list) {
+    for (char *ip = strtok(list, ","); ip != NULL; ip = strtok(NULL, ",")) {
+        if (sources_count == MAX_SOURCES) {
+            fprintf(stderr, "At most %d source addresses are supported\n", MAX_SOURCES);
+            print_usage_and_exit(name);
+        }
+        if (!inet_aton(ip, &sources[sources_count++])) {
+            fprintf(stderr, "Invalid source ip address\n");
+            print_usage_and_exit(name);
+        }
+    }
+}
+
+void parse_rates(const char *name, char *list) {
+    for (char *rate = strtok(list, ","); rate != NULL; rate = strtok(NULL, ",")) {
+        if (rates_count == MAX_RATES) {
+            fprintf(stderr, "At most %d rates are supported\n", MAX_RATES);
+            print_usage_and_exit(name);
+        }
+        if (parse_positive(rate, &rates[rates_count++]) == -1) {
+            fprintf(stderr, "Request rate must be positive\n");
+            print_usage_and_exit(name);
+        }
+    }
+}
+
 void parse_args(int argc, char *const argv[]) {
-    if (argc != 3) {
+    int opt;
+    unsigned long number;
+    while ((opt = getopt(argc, argv, "c:t:s:p:d:b:r:H:")) != -1) {
+        switch (opt) {
+            case 'c':
+                if (parse_number(optarg, 1, MAX_CLIENTS, &number) == -1) {
+                    fprintf(stderr, "Number of connections must be from 1 to %d\n", MAX_CLIENTS);
+                    print_usage_and_exit(argv[0]);
+                }
+                clients_count = (int) number;
+                break;
+            case 't':
+                if (parse_number(optarg, 1, MAX_THREADS, &number) == -1) {
+                    fprintf(stderr, "Number of threads must be from 1 to %d\n", MAX_THREADS);
+                    print_usage_and_exit(argv[0]);
+                }
+                threads_count = (int) number;
+                break;
+            case 's':
+                if (parse_number(optarg, 1, SIZE_MAX, &number) == -1) {
+                    fprintf(stderr, "Payload size must be a positive number\n");
+                    print_usage_and_exit(argv[0]);
+                }
+                payload_size = number;
+                break;
+            case 'p':
+                if (parse_number(optarg, 1, INT_MAX, &number) == -1) {
+                    fprintf(stderr, "Pipeline depth must be from 1 to %d\n", INT_MAX);
+                    print_usage_and_exit(argv[0]);
+                }
+                depth = (int) number;
+                break;
+            case 'd':
+                if (parse_positive(optarg, &duration) == -1) {
+                    fprintf(stderr, "Duration must be positive\n");
+                    print_usage_and_exit(argv[0]);
+                }
+                break;
+            case 'b':
+                parse_sources(argv[0], optarg);
+                break;
+            case 'r':
+                parse_rates(argv[0], optarg);
+                break;
+            case 'H':
+                if (parse_number(optarg, 1, 3, &number) == -1) {
+                    fprintf(stderr, "Number of significant digits must be from 1 to 3\n");
+                    print_usage_and_exit(argv[0]);
+                }
+                precision = (int) number;
+                break;
+            default:
+                print_usage_and_exit(argv[0]);
+        }
+    }
+    if (argc - optind != 2) {
         print_usage_and_exit(argv[0]);
     }
 
     struct in_addr target_ip_addr;
-    if (!inet_aton(argv[1], &target_ip_addr)) {
+    if (!inet_aton(argv[optind], &target_ip_addr)) {
         fprintf(stderr, "Invalid target ip address\n");
         print_usage_and_exit(argv[0]);
     }
 
     in_port_t target_port;
-    if (parse_port(argv[2], &target_port) == -1) {
+    if (parse_port(argv[optind + 1], &target_port) == -1) {
         fprintf(stderr, "Invalid target port value\n");
         print_usage_and_exit(argv[0]);
     }
@@ -50,84 +270,531 @@ void parse_args(int argc, char *const argv[]) {
     dst_address.sin_family = AF_INET;
     dst_address.sin_port = htons(target_port);
     dst_address.sin_addr = target_ip_addr;
+
+    if (threads_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads_count = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : (int) cpus;
+    }
+    if (threads_count > clients_count)
+        threads_count = clients_count;
+    if (rates_count > 0)
+        phases_count = rates_count;
+
+    // Width of a sub-bucket is at most 10^-precision of its values
+    int sub_buckets = 1;
+    for (int i = 0; i < precision; i++)
+        sub_buckets *= 10;
+    sub_bucket_bits = 64 - __builtin_clzll(sub_buckets - 1);
+    histogram_size = (64 - sub_bucket_bits + 1) << sub_bucket_bits;
 }
 
-int child_main() {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) {
-        perror("sock");
-        return 1;
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int histogram_init(struct histogram *h) {
+    h->count = 0;
+    h->max = 0;
+    h->buckets = calloc(histogram_size, sizeof(uint64_t));
+    return h->buckets != NULL;
+}
+
+int histogram_index(uint64_t value) {
+    uint64_t sub_buckets = 1ULL << sub_bucket_bits;
+    if (value < sub_buckets)
+        return (int) value;
+    int magnitude = 63 - __builtin_clzll(value) - sub_bucket_bits;
+    return (int) (((magnitude + 1) << sub_bucket_bits) + (value >> magnitude) - sub_buckets);
+}
+
+// Largest value that falls into the bucket
+uint64_t histogram_value(int index) {
+    uint64_t sub_buckets = 1ULL << sub_bucket_bits;
+    if ((uint64_t) index < sub_buckets)
+        return index;
+    int magnitude = (index >> sub_bucket_bits) - 1;
+    uint64_t lowest = (sub_buckets + (index & (sub_buckets - 1))) << magnitude;
+    return lowest + (1ULL << magnitude) - 1;
+}
+
+void histogram_add(struct histogram *h, uint64_t value) {
+    h->buckets[histogram_index(value)]++;
+    h->count++;
+    if (value > h->max)
+        h->max = value;
+}
+
+void histogram_merge(struct histogram *dst, const struct histogram *src) {
+    for (int i = 0; i < histogram_size; i++)
+        dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+uint64_t histogram_percentile(const struct histogram *h, double percentile) {
+    uint64_t rank = (uint64_t) (h->count * percentile / 100);
+    if (rank >= h->count)
+        return h->max;
+    uint64_t seen = 0;
+    for (int i = 0; i < histogram_size; i++) {
+        seen += h->buckets[i];
+        if (seen > rank)
+            return histogram_value(i) < h->max ? histogram_value(i) : h->max;
     }
+    return h->max;
+}
 
-    if (connect(sock, (struct sockaddr *)&dst_address, sizeof(dst_address)) == -1) {
-        perror("connect");
-        if (close(sock) == -1)
-            perror("close");
-        return 1;
+void raise_descriptor_limit() {
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == -1) {
+        perror("getrlimit");
+        return;
     }
-    
-    char buf[BUF_SIZE], recv_buf[BUF_SIZE];
-    for (int j = 0; j < BUF_SIZE; j++)
-        buf[j] = j;
-
-    for (int i = 0; i < REPEATS_COUNT; i++) {
-        char *ptr = buf;
-        size_t len = sizeof(buf);
-        while (len > 0) {
-            ssize_t res = write(sock, ptr, len);
-            if (res == -1) {
-                perror("write");
-                goto end;
-            }
-            len -= res;
-        }
-        ptr = recv_buf;
-        len = sizeof(recv_buf);
-        while (len > 0) {
-            ssize_t res = read(sock, ptr, len);
-            if (res == -1) {
-                perror("read");
-                goto end;
+    lim.rlim_cur = lim.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &lim) == -1)
+        perror("setrlimit");
+}
+
+/*
+ * Phase the request belongs to by the time it was sent or due.
+ */
+struct phase *request_phase(struct worker *w, uint64_t time) {
+    uint64_t phase = time > start_time ? (uint64_t) ((time - start_time) / (duration * 1e9)) : 0;
+    return &w->phases[phase < (uint64_t) phases_count ? phase : (uint64_t) phases_count - 1];
+}
+
+/*
+ * Append the request to the ring of the client, the ring grows when the open loop is ahead of responses.
+ */
+int push_request(struct client *c, uint64_t time) {
+    if (c->in_flight == c->cap) {
+        int cap = c->cap * 2;
+        uint64_t *times = malloc(cap * sizeof(uint64_t));
+        if (times == NULL) {
+            perror("malloc");
+            return 0;
+        }
+        for (int i = 0; i < c->in_flight; i++)
+            times[i] = c->send_times[(c->first + i) % c->cap];
+        free(c->send_times);
+        c->send_times = times;
+        c->cap = cap;
+        c->first = 0;
+    }
+    c->send_times[(c->first + c->in_flight) % c->cap] = time;
+    c->in_flight++;
+    return 1;
+}
+
+void close_client(struct worker *w, struct client *c) {
+    if (c->state == CS_CONNECTING)
+        w->connecting--;
+    c->state = CS_CLOSED;
+    if (close(c->fd) == -1)
+        perror("close");
+    c->fd = -1;
+}
+
+/*
+ * Start connecting clients until MAX_CONNECTING connects are in progress.
+ */
+void connect_clients(struct worker *w) {
+    while (w->next < w->count && w->connecting < MAX_CONNECTING) {
+        int index = w->next++;
+        struct client *c = &w->clients[index];
+        int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (sock == -1) {
+            perror("socket");
+            w->connect_errors++;
+            continue;
+        }
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (sources_count > 0) {
+            // Each source address has its own range of ephemeral ports
+            struct sockaddr_in src;
+            memset(&src, 0, sizeof(src));
+            src.sin_family = AF_INET;
+            src.sin_addr = sources[(w->first + index) % sources_count];
+            if (bind(sock, (struct sockaddr *) &src, sizeof(src)) == -1) {
+                perror("bind");
+                close(sock);
+                w->connect_errors++;
+                continue;
             }
-            len -= res;
         }
-        for (int i = 0; i < BUF_SIZE; i++) {
-            if (buf[i] != recv_buf[i]) {
-                fprintf(stderr, "ERROR\n");
-                goto end;
+        if (connect(sock, (struct sockaddr *) &dst_address, sizeof(dst_address)) == -1 && errno != EINPROGRESS) {
+            perror("connect");
+            close(sock);
+            w->connect_errors++;
+            continue;
+        }
+        c->fd = sock;
+        c->state = CS_CONNECTING;
+        w->connecting++;
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c};
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+            perror("epoll_ctl");
+            close_client(w, c);
+            w->connect_errors++;
+        }
+    }
+}
+
+/*
+ * Write the requests in flight until the socket doesn't accept more data.
+ * In closed loop new requests are started while the pipeline is not full.
+ * Returns 0 if the connection is broken.
+ */
+int send_requests(struct worker *w, struct client *c) {
+    for (;;) {
+        // Bytes of the requests already started, the oldest one may be partially echoed
+        uint64_t started = (c->received / payload_size + c->in_flight) * payload_size;
+        if (c->sent == started) {
+            if (rates_count > 0 || c->in_flight == depth || stopped)
+                return 1;
+            if (!push_request(c, now_ns()))
+                return 0;
+            started += payload_size;
+        }
+        size_t len = started - c->sent < MAX_WRITE ? started - c->sent : MAX_WRITE;
+        ssize_t res = write(c->fd, pattern + c->sent % PATTERN_PERIOD, len);
+        if (res == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            return 0;
+        }
+        c->sent += res;
+    }
+}
+
+/*
+ * Read echoed data, check it and complete the requests.
+ * Returns 0 if the connection is broken.
+ */
+int receive_responses(struct worker *w, struct client *c) {
+    static __thread uint8_t buf[READ_BUF_SIZE];
+    for (;;) {
+        ssize_t res = read(c->fd, buf, sizeof(buf));
+        if (res == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            return 0;
+        }
+        if (res == 0) {
+            fprintf(stderr, "Connection closed by the target\n");
+            return 0;
+        }
+        if ((uint64_t) res > c->sent - c->received ||
+            memcmp(buf, pattern + c->received % PATTERN_PERIOD, res) != 0) {
+            fprintf(stderr, "ERROR: echo differs from the request\n");
+            return 0;
+        }
+
+        uint64_t now = now_ns();
+        uint64_t completed = c->received / payload_size;
+        c->received += res;
+        w->bytes += res;
+        for (; completed < c->received / payload_size; completed++) {
+            uint64_t sent = c->send_times[c->first];
+            struct phase *phase = request_phase(w, sent);
+            histogram_add(&phase->latency, now - sent);
+            phase->requests++;
+            c->first = (c->first + 1) % c->cap;
+            c->in_flight--;
+        }
+    }
+}
+
+void handle_event(struct worker *w, struct client *c, uint32_t events) {
+    if (c->state == CS_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+            errno = err;
+            perror("connect");
+            close_client(w, c);
+            w->connect_errors++;
+            return;
+        }
+        if (!(events & EPOLLOUT))
+            return;
+        c->state = CS_ACTIVE;
+        w->connecting--;
+    }
+    if (c->state != CS_ACTIVE || !w->running)
+        return;
+    if (!receive_responses(w, c) || !send_requests(w, c)) {
+        close_client(w, c);
+        w->errors++;
+    }
+}
+
+/*
+ * Open loop: due time of the next request of the worker. Worker sends its share of the phase rate,
+ * requests go to its clients in turn, so every client sends at the same fixed rate.
+ */
+uint64_t next_due(struct worker *w) {
+    double rate = rates[w->phase] * w->count / clients_count;
+    return start_time + (uint64_t) (w->phase * duration * 1e9 + w->due_count * 1e9 / rate);
+}
+
+void arm_timer(struct worker *w) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = w->due / 1000000000;
+    its.it_value.tv_nsec = w->due % 1000000000;
+    if (timerfd_settime(w->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+        perror("timerfd_settime");
+}
+
+/*
+ * Send all requests that are due, then arm the timer for the next one.
+ */
+void send_due_requests(struct worker *w) {
+    uint64_t timeouts;
+    if (read(w->timer_fd, &timeouts, sizeof(timeouts)) == -1 && errno != EAGAIN)
+        perror("read timer");
+
+    uint64_t now = now_ns();
+    while (w->phase < phases_count && w->due <= now) {
+        struct client *c = &w->clients[w->cursor];
+        w->cursor = (w->cursor + 1) % w->count;
+        if (c->state != CS_ACTIVE) {
+            w->phases[w->phase].missed++;
+        } else if (!push_request(c, w->due) || !send_requests(w, c)) {
+            close_client(w, c);
+            w->errors++;
+        }
+
+        w->due_count++;
+        w->due = next_due(w);
+        uint64_t phase_end = start_time + (uint64_t) ((w->phase + 1) * duration * 1e9);
+        if (w->due >= phase_end) {
+            w->phase++;
+            w->due_count = 0;
+            w->due = w->phase < phases_count ? next_due(w) : 0;
+        }
+    }
+    if (w->phase < phases_count)
+        arm_timer(w);
+}
+
+void *run_worker(void *arg) {
+    struct worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    // Requests are not sent until all clients are connected
+    connect_clients(w);
+    while (w->next < w->count || w->connecting > 0) {
+        int cnt = epoll_wait(w->epoll_fd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < cnt; i++)
+            handle_event(w, events[i].data.ptr, events[i].events);
+        connect_clients(w);
+    }
+    pthread_barrier_wait(&barrier);
+    // Main thread sets the start time
+    pthread_barrier_wait(&barrier);
+
+    w->running = 1;
+    if (rates_count > 0) {
+        w->due = next_due(w);
+        arm_timer(w);
+    } else {
+        for (int i = 0; i < w->count; i++) {
+            struct client *c = &w->clients[i];
+            if (c->state == CS_ACTIVE && !send_requests(w, c)) {
+                close_client(w, c);
+                w->errors++;
             }
-            buf[i]++;
         }
     }
-end:
-    if (close(sock) == -1)
+
+    while (!stopped) {
+        int cnt = epoll_wait(w->epoll_fd, events, MAX_EVENTS, 100);
+        if (cnt == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < cnt; i++) {
+            if (events[i].data.ptr == &w->timer_fd)
+                send_due_requests(w);
+            else
+                handle_event(w, events[i].data.ptr, events[i].events);
+        }
+    }
+
+    // Requests left without response are as slow as the test allows to see
+    for (int i = 0; i < w->count; i++) {
+        struct client *c = &w->clients[i];
+        for (int j = 0; j < c->in_flight; j++)
+            request_phase(w, c->send_times[(c->first + j) % c->cap])->unfinished++;
+    }
+    return NULL;
+}
+
+int init_worker(struct worker *w, int first, int count) {
+    memset(w, 0, sizeof(*w));
+    w->first = first;
+    w->count = count;
+    w->timer_fd = -1;
+    w->epoll_fd = epoll_create1(0);
+    if (w->epoll_fd == -1) {
+        perror("epoll_create1");
+        return 0;
+    }
+    if (rates_count > 0) {
+        w->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &w->timer_fd};
+        if (w->timer_fd == -1 || epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->timer_fd, &ev) == -1) {
+            perror("timerfd");
+            return 0;
+        }
+    }
+    w->clients = calloc(count, sizeof(struct client));
+    w->phases = calloc(phases_count, sizeof(struct phase));
+    if (w->clients == NULL || w->phases == NULL) {
+        perror("calloc");
+        return 0;
+    }
+    for (int i = 0; i < phases_count; i++) {
+        if (!histogram_init(&w->phases[i].latency)) {
+            perror("calloc");
+            return 0;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        struct client *c = &w->clients[i];
+        c->fd = -1;
+        c->cap = depth;
+        c->send_times = malloc(depth * sizeof(uint64_t));
+        if (c->send_times == NULL) {
+            perror("malloc");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void destroy_worker(struct worker *w) {
+    for (int i = 0; w->clients != NULL && i < w->count; i++) {
+        if (w->clients[i].fd != -1 && close(w->clients[i].fd) == -1)
+            perror("close");
+        free(w->clients[i].send_times);
+    }
+    free(w->clients);
+    for (int i = 0; w->phases != NULL && i < phases_count; i++)
+        free(w->phases[i].latency.buckets);
+    free(w->phases);
+    if (w->timer_fd != -1 && close(w->timer_fd) == -1)
         perror("close");
-    return 0;
+    if (w->epoll_fd != -1 && close(w->epoll_fd) == -1)
+        perror("close");
+}
+
+void print_report(struct worker *workers, double elapsed) {
+    uint64_t bytes = 0, connect_errors = 0, errors = 0;
+    int active = 0;
+    for (int i = 0; i < threads_count; i++) {
+        struct worker *w = &workers[i];
+        bytes += w->bytes;
+        connect_errors += w->connect_errors;
+        errors += w->errors;
+        for (int j = 0; j < w->count; j++)
+            active += w->clients[j].state == CS_ACTIVE;
+    }
+    printf("connections: %d requested, %d active, %llu failed to connect, %llu broken\n", clients_count, active,
+           (unsigned long long) connect_errors, (unsigned long long) errors);
+    printf("%.2f MB/s each way in %.2f s\n", bytes / elapsed / 1e6, elapsed);
+    printf("%12s %12s %10s %10s %10s %10s %10s %10s %10s %10s\n", "target/s", "requests/s", "p50 us", "p90 us",
+           "p99 us", "p99.9 us", "p99.99 us", "max us", "missed", "unfinished");
+
+    struct phase total;
+    if (!histogram_init(&total.latency)) {
+        perror("calloc");
+        return;
+    }
+    for (int p = 0; p < phases_count; p++) {
+        memset(total.latency.buckets, 0, histogram_size * sizeof(uint64_t));
+        total.latency.count = total.latency.max = 0;
+        total.requests = total.missed = total.unfinished = 0;
+        for (int i = 0; i < threads_count; i++) {
+            struct phase *phase = &workers[i].phases[p];
+            histogram_merge(&total.latency, &phase->latency);
+            total.requests += phase->requests;
+            total.missed += phase->missed;
+            total.unfinished += phase->unfinished;
+        }
+        const struct histogram *h = &total.latency;
+        printf("%12.0f %12.0f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10llu %10llu\n",
+               rates_count > 0 ? rates[p] : 0.0, total.requests / (rates_count > 0 ? duration : elapsed),
+               histogram_percentile(h, 50) / 1e3, histogram_percentile(h, 90) / 1e3,
+               histogram_percentile(h, 99) / 1e3, histogram_percentile(h, 99.9) / 1e3,
+               histogram_percentile(h, 99.99) / 1e3, h->max / 1e3,
+               (unsigned long long) total.missed, (unsigned long long) total.unfinished);
+    }
+    free(total.latency.buckets);
 }
 
 int main(int argc, char *const argv[]) {
-    parse_args(argc, argv); 
-
-    pid_t pids[CLIENTS_COUNT];
-    for (int i = 0; i < CLIENTS_COUNT; i++) {
-        pid_t pid = pids[i] = fork();
-        if (pid == -1) {
-            perror("fork");
-        } else if (pid == 0) {
-            return child_main();
-        }
-    }
-    for (int i = 0; i < CLIENTS_COUNT; i++) {
-        if (pids[i] > 0) {
-            for (;;) {
-                if(waitpid(pids[i], NULL, 0) == -1) {
-                    if (errno == EINTR)
-                        continue;
-                    perror("waitpid");
-                }
-                break;
-            }
+    parse_args(argc, argv);
+    raise_descriptor_limit();
+    signal(SIGPIPE, SIG_IGN);
+
+    pattern_length = PATTERN_PERIOD + MAX_WRITE;
+    pattern = malloc(pattern_length);
+    struct worker *workers = calloc(threads_count, sizeof(struct worker));
+    if (pattern == NULL || workers == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (size_t i = 0; i < pattern_length; i++)
+        pattern[i] = i % PATTERN_PERIOD;
+
+    for (int i = 0; i < threads_count; i++) {
+        int first = (int) ((long) clients_count * i / threads_count);
+        int last = (int) ((long) clients_count * (i + 1) / threads_count);
+        if (!init_worker(&workers[i], first, last - first))
+            return 1;
+    }
+
+    pthread_barrier_init(&barrier, NULL, threads_count + 1);
+    for (int i = 0; i < threads_count; i++) {
+        int err = pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+        if (err) {
+            errno = err;
+            perror("pthread_create");
+            return 1;
         }
     }
+    pthread_barrier_wait(&barrier);
+    start_time = now_ns();
+    pthread_barrier_wait(&barrier);
+
+    double total = duration * phases_count;
+    struct timespec ts = {.tv_sec = (time_t) total, .tv_nsec = (long) ((total - (time_t) total) * 1e9)};
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+    stopped = 1;
+    double elapsed = (now_ns() - start_time) / 1e9;
+    for (int i = 0; i < threads_count; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    print_report(workers, elapsed);
+    for (int i = 0; i < threads_count; i++)
+        destroy_worker(&workers[i]);
+    pthread_barrier_destroy(&barrier);
+    free(workers);
+    free(pattern);
     return 0;
 }
@@ -0,0 +1,390 @@
+#define _GNU_SOURCE // accept4
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/socket.h> // socket, bind
+#include <netinet/in.h> // sockaddr_in, in_port_t, in_addr
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <arpa/inet.h> // inet_aton
+#include <unistd.h> // close
+#include <stdlib.h>
+#include <stdio.h> // perror
+#include <string.h> // memset
+
+/*
+ * Target service for benchmarks of the forwarders: echo sends back everything it receives,
+ * discard drops received data and chargen sends a stream of text lines (RFC 864) as fast as it is read.
+ * Each thread has its own listening socket on the same port (SO_REUSEPORT), so the kernel
+ * spreads connections between threads, and serves its connections with edge-triggered epoll.
+ */
+
+#define MAX_THREADS 256
+#define MAX_EVENTS 256
+// Chargen lines are 72 characters starting from the next printable character, followed by CRLF
+#define LINE_LENGTH 74
+#define PRINTABLE 95
+#define CHARGEN_PERIOD (LINE_LENGTH * PRINTABLE)
+
+#define MODE_ECHO 1
+#define MODE_DISCARD 2
+#define MODE_CHARGEN 3
+
+struct sockaddr_in address;
+int mode = MODE_ECHO;
+int threads_count = 0;
+size_t buffer_size = 65536;
+
+// Chargen data starting at any offset below CHARGEN_PERIOD and of buffer_size bytes
+char *chargen;
+
+struct connection {
+    int fd;
+    // Echo: received data not yet sent back is from start to end of buf
+    char *buf;
+    size_t start;
+    size_t end;
+    // Chargen: stream offset of the next byte to send
+    uint64_t sent;
+    // Echo: peer has shut down its side, connection is closed when buf is drained
+    int eof;
+};
+
+struct worker {
+    pthread_t thread;
+    int listener;
+    int epoll_fd;
+};
+
+int parse_port(const char *str, in_port_t *res) {
+    char *end;
+    errno = 0;
+    long r = strtol(str, &end, 10);
+    if (r < 0 || r > 65535)
+        return -1;
+    *res = (in_port_t) r;
+    return 0;
+}
+
+void print_usage_and_exit(const char *name) {
+    fprintf(stderr, "USAGE %s [-m echo|discard|chargen] [-t threads] [-s buffer-size] <ip> <port>\n", name);
+    exit(1);
+}
+
+void parse_args(int argc, char *const argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "m:t:s:")) != -1) {
+        switch (opt) {
+            case 'm':
+                if (!strcmp(optarg, "echo")) {
+                    mode = MODE_ECHO;
+                } else if (!strcmp(optarg, "discard")) {
+                    mode = MODE_DISCARD;
+                } else if (!strcmp(optarg, "chargen")) {
+                    mode = MODE_CHARGEN;
+                } else {
+                    fprintf(stderr, "Unknown mode\n");
+                    print_usage_and_exit(argv[0]);
+                }
+                break;
+            case 't':
+                threads_count = atoi(optarg);
+                if (threads_count < 1 || threads_count > MAX_THREADS) {
+                    fprintf(stderr, "Number of threads must be from 1 to %d\n", MAX_THREADS);
+                    print_usage_and_exit(argv[0]);
+                }
+                break;
+            case 's':
+                buffer_size = strtoul(optarg, NULL, 10);
+                if (buffer_size == 0) {
+                    fprintf(stderr, "Buffer size must be positive\n");
+                    print_usage_and_exit(argv[0]);
+                }
+                break;
+            default:
+                print_usage_and_exit(argv[0]);
+        }
+    }
+    if (argc - optind != 2) {
+        print_usage_and_exit(argv[0]);
+    }
+
+    struct in_addr ip_addr;
+    if (!inet_aton(argv[optind], &ip_addr)) {
+        fprintf(stderr, "Invalid ip address\n");
+        print_usage_and_exit(argv[0]);
+    }
+
+    in_port_t port;
+    if (parse_port(argv[optind + 1], &port) == -1) {
+        fprintf(stderr, "Invalid port value\n");
+        print_usage_and_exit(argv[0]);
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr = ip_addr;
+
+    if (threads_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads_count = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : (int) cpus;
+    }
+}
+
+void raise_descriptor_limit() {
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == -1) {
+        perror("getrlimit");
+        return;
+    }
+    lim.rlim_cur = lim.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &lim) == -1)
+        perror("setrlimit");
+}
+
+int open_listener() {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock == -1) {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+        perror("setsockopt");
+        goto failed;
+    }
+    if (bind(sock, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        perror("bind");
+        goto failed;
+    }
+    if (listen(sock, SOMAXCONN) == -1) {
+        perror("listen");
+        goto failed;
+    }
+    return sock;
+
+    failed:
+    close(sock);
+    return -1;
+}
+
+void close_connection(struct connection *c) {
+    if (close(c->fd) == -1)
+        perror("close");
+    free(c->buf);
+    free(c);
+}
+
+void accept_connections(struct worker *w) {
+    for (;;) {
+        int sock = accept4(w->listener, NULL, NULL, SOCK_NONBLOCK);
+        if (sock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct connection *c = calloc(1, sizeof(struct connection));
+        if (c == NULL) {
+            perror("calloc");
+            close(sock);
+            continue;
+        }
+        c->fd = sock;
+        if (mode == MODE_ECHO) {
+            c->buf = malloc(buffer_size);
+            if (c->buf == NULL) {
+                perror("malloc");
+                close_connection(c);
+                continue;
+            }
+        }
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c};
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+            perror("epoll_ctl");
+            close_connection(c);
+        }
+    }
+}
+
+/*
+ * Send back received data and read more while the peer accepts it.
+ * Returns 0 if the connection has to be closed.
+ */
+int serve_echo(struct connection *c) {
+    for (;;) {
+        while (c->start < c->end) {
+            ssize_t res = write(c->fd, c->buf + c->start, c->end - c->start);
+            if (res == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 1;
+                if (errno == EINTR)
+                    continue;
+                perror("write");
+                return 0;
+            }
+            c->start += res;
+        }
+        if (c->eof)
+            return 0;
+        c->start = c->end = 0;
+
+        ssize_t res = read(c->fd, c->buf, buffer_size);
+        if (res == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            return 0;
+        }
+        if (res == 0)
+            c->eof = 1;
+        c->end = res;
+    }
+}
+
+/*
+ * Read and drop everything. Chargen also drops what it receives, as RFC 864 says.
+ * Returns 0 if the connection has to be closed.
+ */
+int serve_discard(struct connection *c) {
+    static __thread char buf[65536];
+    for (;;) {
+        ssize_t res = read(c->fd, buf, buffer_size < sizeof(buf) ? buffer_size : sizeof(buf));
+        if (res == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            return 0;
+        }
+        if (res == 0)
+            return 0;
+    }
+}
+
+int serve_chargen(struct connection *c, uint32_t events) {
+    if ((events & (EPOLLIN | EPOLLRDHUP)) && !serve_discard(c))
+        return 0;
+    for (;;) {
+        ssize_t res = write(c->fd, chargen + c->sent % CHARGEN_PERIOD, buffer_size);
+        if (res == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            if (errno != EPIPE && errno != ECONNRESET)
+                perror("write");
+            return 0;
+        }
+        c->sent += res;
+    }
+}
+
+void handle_event(struct connection *c, uint32_t events) {
+    int ok;
+    if (events & EPOLLERR) {
+        ok = 0;
+    } else if (mode == MODE_ECHO) {
+        ok = serve_echo(c);
+    } else if (mode == MODE_DISCARD) {
+        ok = serve_discard(c);
+    } else {
+        ok = serve_chargen(c, events);
+    }
+    if (!ok)
+        close_connection(c);
+}
+
+void *run_worker(void *arg) {
+    struct worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int cnt = epoll_wait(w->epoll_fd, events, MAX_EVENTS, -1);
+        if (cnt == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return NULL;
+        }
+        for (int i = 0; i < cnt; i++) {
+            if (events[i].data.ptr == NULL)
+                accept_connections(w);
+            else
+                handle_event(events[i].data.ptr, events[i].events);
+        }
+    }
+}
+
+int init_worker(struct worker *w) {
+    w->listener = open_listener();
+    if (w->listener == -1)
+        return 0;
+    w->epoll_fd = epoll_create1(0);
+    if (w->epoll_fd == -1) {
+        perror("epoll_create1");
+        return 0;
+    }
+    // Listener is marked with NULL
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.ptr = NULL};
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listener, &ev) == -1) {
+        perror("epoll_ctl");
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char *const argv[]) {
+    parse_args(argc, argv);
+    raise_descriptor_limit();
+    signal(SIGPIPE, SIG_IGN);
+
+    if (mode == MODE_CHARGEN) {
+        chargen = malloc(CHARGEN_PERIOD + buffer_size);
+        if (chargen == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        for (size_t i = 0; i < CHARGEN_PERIOD + buffer_size; i++) {
+            size_t line = i / LINE_LENGTH % PRINTABLE, column = i % LINE_LENGTH;
+            if (column == LINE_LENGTH - 2)
+                chargen[i] = '\r';
+            else if (column == LINE_LENGTH - 1)
+                chargen[i] = '\n';
+            else
+                chargen[i] = (char) (' ' + (line + column) % PRINTABLE);
+        }
+    }
+
+    struct worker *workers = calloc(threads_count, sizeof(struct worker));
+    if (workers == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < threads_count; i++) {
+        if (!init_worker(&workers[i]))
+            return 1;
+    }
+    for (int i = 0; i < threads_count; i++) {
+        int err = pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+        if (err) {
+            errno = err;
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    // Workers run until the process is killed
+    for (int i = 0; i < threads_count; i++)
+        pthread_join(workers[i].thread, NULL);
+    return 1;
+}